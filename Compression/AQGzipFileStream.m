@@ -38,11 +38,18 @@
 
 #import <Foundation/Foundation.h>
 #import "AQGzipStream.h"
+#import "_AQGzipIndexInternal.h"
+#import "_AQGzipBufferPool.h"
 
 #import <zlib.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/stat.h>
 #import <mach/mach_port.h>
 #import <mach/mach_init.h>
 
+#define INDEXED_READ_SIZE   (16 * 1024)
+
 @interface AQGzipFileInputStream : NSInputStream
 {
     NSString *          _path;
@@ -53,6 +60,25 @@
     NSError *           _error;
     NSStreamStatus      _status;
 }
+- (void) postStreamEvent: (NSStreamEvent) event;
+@end
+
+// reads from any offset, starting from the nearest point in an index
+@interface AQGzipIndexedFileInputStream : AQGzipFileInputStream
+{
+    AQGzipIndex *       _index;
+    int                 _fd;
+    z_stream            _zStream;
+    BOOL                _inflating;
+    uint8_t *           _input;
+    unsigned long long  _offset;        // uncompressed offset of the next byte to be read
+    unsigned long long  _skip;          // bytes to decompress & discard before reaching it
+    unsigned long long  _position;      // uncompressed offset of the next byte inflate will produce
+    NSUInteger          _trailerLeft;   // bytes of a member's trailer still to be stepped over
+    BOOL                _inflatingRaw;  // from an index point, rather than a member's gzip header
+    BOOL                _atEnd;
+}
+- (id) initWithPath: (NSString *) path index: (AQGzipIndex *) index;
 @end
 
 @interface AQGzipFileOutputStream : NSOutputStream <AQGzipOutputCompressor>
@@ -84,6 +110,22 @@
 
 @end
 
+@implementation AQGzipInputStream (GzipFileRandomAccess)
+
++ (id) gzipStreamWithFileAtPath: (NSString *) path index: (AQGzipIndex *) index
+{
+    return ( [[[AQGzipIndexedFileInputStream alloc] initWithPath: path index: index] autorelease] );
+}
+
+- (id) initWithGzipFileAtPath: (NSString *) path index: (AQGzipIndex *) index
+{
+    id result = [[AQGzipIndexedFileInputStream alloc] initWithPath: path index: index];
+    [self release];
+    return ( result );
+}
+
+@end
+
 @implementation AQGzipOutputStream (GzipFileOutput)
 
 + (id<AQGzipOutputCompressor>) gzipStreamToFileAtPath: (NSString *) path
@@ -363,6 +405,344 @@ static CFRunLoopSourceRef RunloopSourceForStream( NSStream * stream, mach_port_t
 
 #pragma mark -
 
+@interface AQGzipIndexedFileInputStream ()
+- (void) _failWithError: (NSError *) error;
+- (BOOL) _positionAtOffset: (unsigned long long) offset;
+- (NSInteger) _inflateIntoBuffer: (uint8_t *) buffer length: (NSUInteger) len;
+- (BOOL) _startNextMember;
+@end
+
+@implementation AQGzipIndexedFileInputStream
+
+- (id) initWithPath: (NSString *) path index: (AQGzipIndex *) index
+{
+    if ( [super initWithPath: path] == nil )
+        return ( nil );
+    
+    _index = [index retain];
+    _fd = -1;
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    [self close];
+    
+    [_index release];
+    AQGzipBufferPoolFree( _input );
+    
+    [super dealloc];
+}
+
+- (void) finalize
+{
+    [self close];
+    
+    AQGzipBufferPoolFree( _input );
+    
+    [super finalize];
+}
+
+- (void) open
+{
+    if ( _status != NSStreamStatusNotOpen )
+        return;
+    
+    _fd = open( [_path fileSystemRepresentation], O_RDONLY );
+    if ( _fd == -1 )
+    {
+        [self _failWithError: [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]];
+        return;
+    }
+    
+    // an index for some other file would have us decompressing garbage
+    struct stat info;
+    if ( (fstat(_fd, &info) != 0) || ((unsigned long long)info.st_size != [_index compressedLength]) )
+    {
+        NSDictionary * userInfo = [NSDictionary dictionaryWithObject: @"The gzip index doesn't match the file"
+                                                              forKey: NSLocalizedDescriptionKey];
+        [self _failWithError: [NSError errorWithDomain: AQZlibErrorDomain code: Z_DATA_ERROR userInfo: userInfo]];
+        return;
+    }
+    
+    _input = AQGzipBufferPoolAlloc( INDEXED_READ_SIZE );
+    if ( [self _positionAtOffset: _offset] == NO )
+        return;
+    
+    _status = NSStreamStatusOpen;
+    [self postStreamEvent: NSStreamEventOpenCompleted];
+    
+    if ( _atEnd == NO )
+        [self postStreamEvent: NSStreamEventHasBytesAvailable];
+}
+
+- (void) close
+{
+    if ( _inflating )
+    {
+        inflateEnd( &_zStream );
+        _inflating = NO;
+    }
+    
+    if ( _fd == -1 )
+        return;
+    
+    close( _fd );
+    _fd = -1;
+    _status = NSStreamStatusClosed;
+}
+
+- (void) _failWithError: (NSError *) error
+{
+    [_error release];
+    _error = [error retain];
+    _status = NSStreamStatusError;
+    [self postStreamEvent: NSStreamEventErrorOccurred];
+}
+
+- (id) propertyForKey: (NSString *) key
+{
+    if ( [key isEqualToString: NSStreamFileCurrentOffsetKey] )
+        return ( [NSNumber numberWithUnsignedLongLong: _offset] );
+    return ( [super propertyForKey: key] );
+}
+
+- (BOOL) setProperty: (id) property forKey: (NSString *) key
+{
+    if ( [key isEqualToString: NSStreamFileCurrentOffsetKey] == NO )
+        return ( [super setProperty: property forKey: key] );
+    
+    unsigned long long offset = [property unsignedLongLongValue];
+    if ( offset > [_index uncompressedLength] )
+        return ( NO );
+    
+    // before opening, we just remember where to start
+    if ( _fd == -1 )
+    {
+        _offset = offset;
+        return ( YES );
+    }
+    
+    if ( (_status != NSStreamStatusOpen) && (_status != NSStreamStatusAtEnd) )
+        return ( NO );
+    
+    // moving forward a little is cheaper than going back to an index point
+    const AQGzipIndexPoint * point = [_index _pointForOffset: offset];
+    if ( (offset >= _offset) && (_offset >= point->output) && (_atEnd == NO) )
+    {
+        _skip += offset - _offset;
+        _offset = offset;
+        return ( YES );
+    }
+    
+    if ( [self _positionAtOffset: offset] == NO )
+        return ( NO );
+    
+    _status = NSStreamStatusOpen;
+    if ( _atEnd == NO )
+        [self postStreamEvent: NSStreamEventHasBytesAvailable];
+    
+    return ( YES );
+}
+
+- (BOOL) _positionAtOffset: (unsigned long long) offset
+{
+    const AQGzipIndexPoint * point = [_index _pointForOffset: offset];
+    
+    if ( _inflating )
+        inflateEnd( &_zStream );
+    memset( &_zStream, 0, sizeof(z_stream) );
+    _zStream.zalloc = AQGzipBufferPoolZalloc;
+    _zStream.zfree = AQGzipBufferPoolZfree;
+    
+    // the data from an index point on is a raw deflate stream
+    int err = inflateInit2( &_zStream, -MAX_WBITS );
+    _inflating = (err == Z_OK);
+    
+    // a point may begin part-way through a byte, in which case its last few bits are fed in first
+    off_t start = (off_t) point->input - (point->bits != 0 ? 1 : 0);
+    if ( (err == Z_OK) && (lseek(_fd, start, SEEK_SET) == -1) )
+    {
+        [self _failWithError: [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]];
+        return ( NO );
+    }
+    
+    if ( (err == Z_OK) && (point->bits != 0) )
+    {
+        uint8_t byte = 0;
+        if ( read(_fd, &byte, 1) != 1 )
+        {
+            [self _failWithError: [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]];
+            return ( NO );
+        }
+        
+        err = inflatePrime( &_zStream, point->bits, byte >> (8 - point->bits) );
+    }
+    
+    if ( (err == Z_OK) && (point->output != 0) )
+        err = inflateSetDictionary( &_zStream, [_index _windowForPoint: point], AQGZIP_WINDOW_SIZE );
+    
+    if ( err != Z_OK )
+    {
+        [self _failWithError: [NSError errorWithDomain: AQZlibErrorDomain code: err userInfo: nil]];
+        return ( NO );
+    }
+    
+    _zStream.avail_in = 0;
+    _inflatingRaw = YES;
+    _trailerLeft = 0;
+    _position = point->output;
+    _skip = offset - point->output;
+    _offset = offset;
+    _atEnd = (offset >= [_index uncompressedLength]);
+    
+    return ( YES );
+}
+
+// returns the number of bytes decompressed, zero at the end of the data, or -1 on error
+- (NSInteger) _inflateIntoBuffer: (uint8_t *) buffer length: (NSUInteger) len
+{
+    _zStream.next_out = buffer;
+    _zStream.avail_out = (uInt) len;
+    
+    while ( (_zStream.avail_out == len) && (_atEnd == NO) )
+    {
+        if ( _zStream.avail_in == 0 )
+        {
+            ssize_t numRead = read( _fd, _input, INDEXED_READ_SIZE );
+            if ( numRead <= 0 )
+            {
+                // the file can't end before the deflate stream does
+                if ( numRead == 0 )
+                    [self _failWithError: [NSError errorWithDomain: AQZlibErrorDomain code: Z_DATA_ERROR userInfo: nil]];
+                else
+                    [self _failWithError: [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]];
+                return ( -1 );
+            }
+            
+            _zStream.next_in = _input;
+            _zStream.avail_in = (uInt) numRead;
+        }
+        
+        // the raw deflate data from an index point stops short of its member's trailer
+        if ( _trailerLeft != 0 )
+        {
+            uInt count = (uInt) MIN((NSUInteger)_zStream.avail_in, _trailerLeft);
+            _zStream.next_in += count;
+            _zStream.avail_in -= count;
+            _trailerLeft -= count;
+            continue;
+        }
+        
+        uInt availOut = _zStream.avail_out;
+        int err = inflate( &_zStream, Z_NO_FLUSH );
+        _position += availOut - _zStream.avail_out;
+        
+        if ( err == Z_STREAM_END )
+        {
+            // the index covers every member of a concatenated gzip file
+            if ( _position >= [_index uncompressedLength] )
+                _atEnd = YES;
+            else if ( [self _startNextMember] == NO )
+                return ( -1 );
+        }
+        else if ( (err != Z_OK) && (err != Z_BUF_ERROR) )
+        {
+            NSDictionary * userInfo = nil;
+            if ( _zStream.msg != NULL )
+                userInfo = [NSDictionary dictionaryWithObject: [NSString stringWithUTF8String: _zStream.msg]
+                                                       forKey: NSLocalizedDescriptionKey];
+            [self _failWithError: [NSError errorWithDomain: AQZlibErrorDomain code: err userInfo: userInfo]];
+            return ( -1 );
+        }
+    }
+    
+    return ( (NSInteger) (len - _zStream.avail_out) );
+}
+
+- (BOOL) _startNextMember
+{
+    z_stream previous = _zStream;
+    
+    // from here on each member is read whole, header & trailer included
+    if ( _inflatingRaw )
+        _trailerLeft = 8;
+    _inflatingRaw = NO;
+    
+    inflateEnd( &_zStream );
+    memset( &_zStream, 0, sizeof(z_stream) );
+    _zStream.zalloc = AQGzipBufferPoolZalloc;
+    _zStream.zfree = AQGzipBufferPoolZfree;
+    
+    int err = inflateInit2( &_zStream, MAX_WBITS + 16 );
+    _inflating = (err == Z_OK);
+    if ( err != Z_OK )
+    {
+        [self _failWithError: [NSError errorWithDomain: AQZlibErrorDomain code: err userInfo: nil]];
+        return ( NO );
+    }
+    
+    _zStream.next_in = previous.next_in;
+    _zStream.avail_in = previous.avail_in;
+    _zStream.next_out = previous.next_out;
+    _zStream.avail_out = previous.avail_out;
+    
+    return ( YES );
+}
+
+- (NSInteger) read: (uint8_t *) buffer maxLength: (NSUInteger) len
+{
+    if ( (_status != NSStreamStatusOpen) || (len == 0) )
+        return ( 0 );
+    
+    _status = NSStreamStatusReading;
+    
+    // anything before the requested offset is decompressed into the caller's buffer & dropped
+    while ( (_skip != 0) && (_atEnd == NO) )
+    {
+        NSInteger numSkipped = [self _inflateIntoBuffer: buffer length: (NSUInteger) MIN((unsigned long long)len, _skip)];
+        if ( numSkipped < 0 )
+            return ( -1 );
+        _skip -= numSkipped;
+    }
+    
+    NSInteger numRead = 0;
+    if ( _atEnd == NO )
+        numRead = [self _inflateIntoBuffer: buffer length: len];
+    if ( numRead < 0 )
+        return ( -1 );
+    
+    _offset += numRead;
+    _status = NSStreamStatusOpen;
+    
+    if ( _atEnd )
+    {
+        _status = NSStreamStatusAtEnd;
+        [self postStreamEvent: NSStreamEventEndEncountered];
+    }
+    else
+    {
+        [self postStreamEvent: NSStreamEventHasBytesAvailable];
+    }
+    
+    return ( numRead );
+}
+
+- (BOOL) getBuffer: (uint8_t **) buffer length: (NSUInteger *) len
+{
+    return ( NO );
+}
+
+- (BOOL) hasBytesAvailable
+{
+    return ( (_status == NSStreamStatusOpen) && (_atEnd == NO) );
+}
+
+@end
+
+#pragma mark -
+
 @implementation AQGzipFileOutputStream
 
 @synthesize compressionLevel=_level;
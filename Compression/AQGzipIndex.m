@@ -0,0 +1,377 @@
+/*
+ * AQGzipIndex.m
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQGzipStream.h"
+#import "_AQGzipIndexInternal.h"
+#import <zlib.h>
+#import <sys/stat.h>
+#import <libkern/OSByteOrder.h>
+
+#define DEFAULT_SPACING     (1024 * 1024)
+#define READ_CHUNK_SIZE     (16 * 1024)
+
+// Index file layout, all little-endian:
+//  "AQGZIDX1", then spacing, uncompressed length, compressed length & point count (64 bits each),
+//  then each point's output & input offsets (64 bits each) and bits (32 bits),
+//  then each point's window, in the same order
+static const char __indexMagic[8] = { 'A', 'Q', 'G', 'Z', 'I', 'D', 'X', '1' };
+#define INDEX_HEADER_SIZE   (sizeof(__indexMagic) + 4 * sizeof(uint64_t))
+#define INDEX_POINT_SIZE    (2 * sizeof(uint64_t) + sizeof(uint32_t))
+
+static void SetIndexError( NSError ** error, NSString * domain, NSInteger code, NSString * desc )
+{
+    if ( error == NULL )
+        return;
+    
+    NSDictionary * userInfo = nil;
+    if ( desc != nil )
+        userInfo = [NSDictionary dictionaryWithObject: desc forKey: NSLocalizedDescriptionKey];
+    *error = [NSError errorWithDomain: domain code: code userInfo: userInfo];
+}
+
+@interface AQGzipIndex ()
+- (id) _initByScanningFileAtPath: (NSString *) path spacing: (unsigned long long) spacing error: (NSError **) error;
+- (void) _addPointWithOutput: (unsigned long long) output input: (unsigned long long) input bits: (int) bits
+                      window: (const uint8_t *) window left: (NSUInteger) left;
+@end
+
+@implementation AQGzipIndex
+
+@synthesize spacing=_spacing, uncompressedLength=_uncompressedLength, compressedLength=_compressedLength;
+
++ (AQGzipIndex *) indexForGzipFileAtPath: (NSString *) path
+                                 spacing: (unsigned long long) spacing
+                                   error: (NSError **) error
+{
+    return ( [[[self alloc] _initByScanningFileAtPath: path spacing: spacing error: error] autorelease] );
+}
+
+- (id) _initByScanningFileAtPath: (NSString *) path spacing: (unsigned long long) spacing error: (NSError **) error
+{
+    if ( [super init] == nil )
+        return ( nil );
+    
+    _spacing = (spacing == 0 ? DEFAULT_SPACING : spacing);
+    _points = [[NSMutableData alloc] init];
+    NSMutableData * windows = [[NSMutableData alloc] init];
+    _windowData = windows;
+    
+    FILE * file = fopen( [path fileSystemRepresentation], "rb" );
+    if ( file == NULL )
+    {
+        SetIndexError( error, NSPOSIXErrorDomain, errno, nil );
+        [self release];
+        return ( nil );
+    }
+    
+    z_stream stream;
+    memset( &stream, 0, sizeof(z_stream) );
+    
+    // gzip or zlib header, detected automatically
+    int err = inflateInit2( &stream, 15 + 32 );
+    
+    uint8_t input[READ_CHUNK_SIZE];
+    // zeroed, since the first points copy parts of it which are never written, and those go in the sidecar
+    uint8_t * window = calloc( 1, AQGZIP_WINDOW_SIZE );
+    unsigned long long totalIn = 0, totalOut = 0, lastPoint = 0;
+    BOOL havePoint = NO, isGzip = NO, memberEnded = NO, memberStarted = NO;
+    
+    // the output is decompressed into a circular window, so the 32KB preceding any point is
+    //  always to hand
+    stream.avail_out = 0;
+    
+    while ( err == Z_OK )
+    {
+        stream.avail_in = (uInt) fread( input, 1, READ_CHUNK_SIZE, file );
+        if ( ferror(file) )
+        {
+            err = Z_ERRNO;
+            break;
+        }
+        if ( stream.avail_in == 0 )
+        {
+            // the file ended before the compressed data did, unless it was between members
+            err = (memberEnded ? Z_STREAM_END : Z_DATA_ERROR);
+            break;
+        }
+        
+        if ( totalIn == 0 )
+            isGzip = (input[0] == 0x1f);
+        stream.next_in = input;
+        
+        do
+        {
+            if ( memberEnded )
+            {
+                // concatenated gzip files decompress as one, as with gunzip; anything else after
+                //  the end of the data (often zero padding) is ignored
+                if ( (isGzip == NO) || (stream.next_in[0] != 0x1f) )
+                {
+                    err = Z_STREAM_END;
+                    break;
+                }
+                
+                inflateReset( &stream );
+                memberEnded = NO;
+                memberStarted = YES;
+            }
+            
+            if ( stream.avail_out == 0 )
+            {
+                stream.avail_out = AQGZIP_WINDOW_SIZE;
+                stream.next_out = window;
+            }
+            
+            // Z_BLOCK returns at the end of each deflate block, which is where points go
+            totalIn += stream.avail_in;
+            totalOut += stream.avail_out;
+            err = inflate( &stream, Z_BLOCK );
+            totalIn -= stream.avail_in;
+            totalOut -= stream.avail_out;
+            
+            if ( err == Z_STREAM_END )
+            {
+                memberEnded = YES;
+                err = Z_OK;
+                continue;
+            }
+            
+            if ( err == Z_NEED_DICT )
+                err = Z_DATA_ERROR;
+            if ( (err != Z_OK) && (err != Z_BUF_ERROR) )
+                break;
+            err = Z_OK;
+            
+            // bit 7 of data_type marks the end of a block header, bit 6 that it was the last block.
+            //  Each member after the first gets a point at its start, since the reader has to
+            //  parse a gzip header to get there from an earlier one
+            if ( ((stream.data_type & 128) != 0) && ((stream.data_type & 64) == 0) &&
+                 ((havePoint == NO) ||
+                  ((totalOut > lastPoint) && (memberStarted || (totalOut - lastPoint > _spacing)))) )
+            {
+                [self _addPointWithOutput: totalOut input: totalIn bits: (stream.data_type & 7)
+                                   window: window left: stream.avail_out];
+                lastPoint = totalOut;
+                havePoint = YES;
+            }
+            if ( (stream.data_type & 128) != 0 )
+                memberStarted = NO;
+            
+        } while ( stream.avail_in != 0 );
+    }
+    
+    inflateEnd( &stream );
+    free( window );
+    
+    struct stat info;
+    if ( fstat(fileno(file), &info) == 0 )
+        _compressedLength = (unsigned long long) info.st_size;
+    fclose( file );
+    
+    if ( err != Z_STREAM_END )
+    {
+        if ( err == Z_ERRNO )
+            SetIndexError( error, NSPOSIXErrorDomain, errno, nil );
+        else
+            SetIndexError( error, AQZlibErrorDomain, err, (stream.msg != NULL ? [NSString stringWithUTF8String: stream.msg] : nil) );
+        [self release];
+        return ( nil );
+    }
+    
+    _uncompressedLength = totalOut;
+    _windows = (const uint8_t *) [windows bytes];
+    
+    return ( self );
+}
+
+- (void) _addPointWithOutput: (unsigned long long) output input: (unsigned long long) input bits: (int) bits
+                      window: (const uint8_t *) window left: (NSUInteger) left
+{
+    AQGzipIndexPoint point = { output, input, bits };
+    [_points appendBytes: &point length: sizeof(AQGzipIndexPoint)];
+    
+    // unwind the circular window: the oldest data starts where the next output would go
+    NSMutableData * windows = (NSMutableData *) _windowData;
+    NSUInteger offset = [windows length];
+    [windows increaseLengthBy: AQGZIP_WINDOW_SIZE];
+    
+    uint8_t * copy = (uint8_t *)[windows mutableBytes] + offset;
+    if ( left != 0 )
+        memcpy( copy, window + AQGZIP_WINDOW_SIZE - left, left );
+    if ( left < AQGZIP_WINDOW_SIZE )
+        memcpy( copy + left, window, AQGZIP_WINDOW_SIZE - left );
+}
+
+- (id) initWithContentsOfFile: (NSString *) path error: (NSError **) error
+{
+    if ( [super init] == nil )
+        return ( nil );
+    
+    // the windows make up most of the file, and only a few are ever used, so it's mapped
+    NSData * data = [NSData dataWithContentsOfFile: path options: NSMappedRead error: error];
+    if ( data == nil )
+    {
+        [self release];
+        return ( nil );
+    }
+    
+    const uint8_t * bytes = (const uint8_t *) [data bytes];
+    NSUInteger length = [data length];
+    unsigned long long count = 0;
+    
+    if ( (length >= INDEX_HEADER_SIZE) && (memcmp(bytes, __indexMagic, sizeof(__indexMagic)) == 0) )
+    {
+        _spacing            = OSReadLittleInt64( bytes, 8 );
+        _uncompressedLength = OSReadLittleInt64( bytes, 16 );
+        _compressedLength   = OSReadLittleInt64( bytes, 24 );
+        count               = OSReadLittleInt64( bytes, 32 );
+    }
+    
+    if ( (count == 0) || (count > (length - INDEX_HEADER_SIZE) / (INDEX_POINT_SIZE + AQGZIP_WINDOW_SIZE)) ||
+         (length != INDEX_HEADER_SIZE + count * (INDEX_POINT_SIZE + AQGZIP_WINDOW_SIZE)) )
+    {
+        SetIndexError( error, NSCocoaErrorDomain, NSFileReadCorruptFileError, nil );
+        [self release];
+        return ( nil );
+    }
+    
+    _points = [[NSMutableData alloc] initWithLength: (NSUInteger) count * sizeof(AQGzipIndexPoint)];
+    AQGzipIndexPoint * points = (AQGzipIndexPoint *) [_points mutableBytes];
+    
+    const uint8_t * p = bytes + INDEX_HEADER_SIZE;
+    NSUInteger i;
+    for ( i = 0; i < count; i++, p += INDEX_POINT_SIZE )
+    {
+        uint32_t bits = OSReadLittleInt32( p, 16 );
+        points[i].output = OSReadLittleInt64( p, 0 );
+        points[i].input  = OSReadLittleInt64( p, 8 );
+        points[i].bits   = (int) bits;
+        
+        // anything else would send the seeking code off the rails: the first point must be at the
+        //  start of the data, the rest in order, and each one inside the file, at a valid bit
+        BOOL valid = ((bits <= 7) && (points[i].input <= _compressedLength) &&
+                      ((bits == 0) || (points[i].input != 0)) &&
+                      (points[i].output <= _uncompressedLength));
+        if ( i == 0 )
+            valid = valid && (points[i].output == 0);
+        else
+            valid = valid && (points[i].output > points[i-1].output);
+        
+        if ( valid == NO )
+        {
+            SetIndexError( error, NSCocoaErrorDomain, NSFileReadCorruptFileError, nil );
+            [self release];
+            return ( nil );
+        }
+    }
+    
+    _windowData = [data retain];
+    _windows = p;
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    [_points release];
+    [_windowData release];
+    [super dealloc];
+}
+
+- (BOOL) writeToFile: (NSString *) path error: (NSError **) error
+{
+    NSUInteger count = [self pointCount];
+    NSMutableData * data = [[NSMutableData alloc] initWithLength: INDEX_HEADER_SIZE + count * INDEX_POINT_SIZE];
+    uint8_t * bytes = (uint8_t *) [data mutableBytes];
+    
+    memcpy( bytes, __indexMagic, sizeof(__indexMagic) );
+    OSWriteLittleInt64( bytes, 8, _spacing );
+    OSWriteLittleInt64( bytes, 16, _uncompressedLength );
+    OSWriteLittleInt64( bytes, 24, _compressedLength );
+    OSWriteLittleInt64( bytes, 32, (uint64_t) count );
+    
+    const AQGzipIndexPoint * points = (const AQGzipIndexPoint *) [_points bytes];
+    uint8_t * p = bytes + INDEX_HEADER_SIZE;
+    NSUInteger i;
+    for ( i = 0; i < count; i++, p += INDEX_POINT_SIZE )
+    {
+        OSWriteLittleInt64( p, 0, points[i].output );
+        OSWriteLittleInt64( p, 8, points[i].input );
+        OSWriteLittleInt32( p, 16, (uint32_t) points[i].bits );
+    }
+    
+    [data appendBytes: _windows length: count * AQGZIP_WINDOW_SIZE];
+    
+    BOOL result = [data writeToFile: path options: NSAtomicWrite error: error];
+    [data release];
+    
+    return ( result );
+}
+
+- (NSUInteger) pointCount
+{
+    return ( [_points length] / sizeof(AQGzipIndexPoint) );
+}
+
+@end
+
+@implementation AQGzipIndex (Internal)
+
+- (const AQGzipIndexPoint *) _pointForOffset: (unsigned long long) offset
+{
+    const AQGzipIndexPoint * points = (const AQGzipIndexPoint *) [_points bytes];
+    NSUInteger low = 0, high = [self pointCount];
+    
+    // the first point is always at offset zero
+    while ( high - low > 1 )
+    {
+        NSUInteger mid = low + (high - low) / 2;
+        if ( points[mid].output <= offset )
+            low = mid;
+        else
+            high = mid;
+    }
+    
+    return ( &points[low] );
+}
+
+- (const uint8_t *) _windowForPoint: (const AQGzipIndexPoint *) point
+{
+    NSUInteger index = point - (const AQGzipIndexPoint *) [_points bytes];
+    return ( _windows + index * AQGZIP_WINDOW_SIZE );
+}
+
+@end
@@ -9,6 +9,39 @@
 #import "AQGzipStream.h"
 #import "_AQGzipStreamInternal.h"
 
+// the window bits for inflateInit2() which select a format, or zero if there isn't yet enough
+//  input to tell
+static int WindowBitsForFormat( AQGzipStreamFormat format, const Bytef * input, uInt length )
+{
+    switch ( format )
+    {
+        case AQGzipStreamFormatGzip:
+            return ( MAX_WBITS + 16 );
+            
+        case AQGzipStreamFormatZlib:
+            return ( MAX_WBITS );
+            
+        case AQGzipStreamFormatRawDeflate:
+            return ( -MAX_WBITS );
+            
+        default:
+            break;
+    }
+    
+    if ( length < 2 )
+        return ( 0 );
+    
+    if ( (input[0] == 0x1f) && (input[1] == 0x8b) )
+        return ( MAX_WBITS + 16 );
+    
+    // zlib: the deflate method with a window of 32KB or less, and a check value in the second byte
+    if ( ((input[0] & 0x0f) == Z_DEFLATED) && ((input[0] >> 4) <= 7) &&
+         ((((unsigned)input[0] << 8) | input[1]) % 31 == 0) )
+        return ( MAX_WBITS );
+    
+    return ( -MAX_WBITS );
+}
+
 @implementation AQGzipInputStream
 
 - (id) initWithCompressedStream: (NSInputStream *) compressedStream
@@ -19,6 +52,8 @@
     _internal = [[_AQGzipStreamInternal alloc] init];
     _compressedDataStream = [compressedStream retain];
     _internal.status = NSStreamStatusNotOpen;
+    _format = AQGzipStreamFormatAutoDetect;
+    _decodesConcatenatedMembers = YES;
     
     [_compressedDataStream setDelegate: self];
     
@@ -95,6 +130,32 @@
     _internal.outputSize = value;
 }
 
+- (AQGzipStreamFormat) format
+{
+    return ( _format );
+}
+
+- (void) setFormat: (AQGzipStreamFormat) value
+{
+    if ( _internal.status != NSStreamStatusNotOpen )
+        return;
+    
+    _format = value;
+}
+
+- (BOOL) decodesConcatenatedMembers
+{
+    return ( _decodesConcatenatedMembers );
+}
+
+- (void) setDecodesConcatenatedMembers: (BOOL) value
+{
+    if ( _internal.status != NSStreamStatusNotOpen )
+        return;
+    
+    _decodesConcatenatedMembers = value;
+}
+
 - (void) open
 {
     if ( _internal.status != NSStreamStatusNotOpen )
@@ -111,7 +172,7 @@
     if ( _internal.status == NSStreamStatusNotOpen )
         return;
     
-    int err = inflateEnd( _internal.zStream );
+    int err = inflateEnd( _internal->_zStream );
     if ( err < Z_OK )
         [_internal setZlibError: err];
     
@@ -119,6 +180,11 @@
     _internal.status = (err < Z_OK ? NSStreamStatusError : NSStreamStatusClosed);
 }
 
+- (unsigned long long) compressedBytesRead
+{
+    return ( _compressedBase + _internal->_zStream->total_in );
+}
+
 - (_AQGzipStreamInternal *) _internal
 {
     return ( _internal );
@@ -129,6 +195,91 @@
     [_internal.delegate stream: self handleEvent: event];
 }
 
+- (void) _endMember
+{
+    z_stream * zStream = _internal->_zStream;
+    
+    _member.compressedLength = zStream->total_in;
+    _member.checkValue = (_windowBits < 0 ? 0 : (uint32_t) zStream->adler);
+    AQGzipMember member = _member;
+    
+    _compressedBase += zStream->total_in;
+    _member.compressedOffset = _compressedBase;
+    _member.uncompressedOffset += _member.uncompressedLength;
+    _member.uncompressedLength = 0;
+    _memberEnded = NO;
+    
+    if ( (_windowBits > MAX_WBITS) && _decodesConcatenatedMembers )
+    {
+        // keeps the window bits, so the next member is read as gzip too. This zeroes total_out,
+        //  which is fine since the output buffer is empty
+        inflateReset( zStream );
+    }
+    else
+    {
+        _ignoresRemainingInput = YES;
+    }
+    
+    id delegate = _internal.delegate;
+    if ( [delegate respondsToSelector: @selector(gzipStream:didEndMember:)] )
+        [delegate gzipStream: self didEndMember: member];
+}
+
+// returns NO if an error occurred
+- (BOOL) _handlePendingInput
+{
+    z_stream * zStream = _internal->_zStream;
+    
+    while ( _internal.status != NSStreamStatusError )
+    {
+        if ( _memberEnded )
+        {
+            // everything up to the end of a member gets read before moving on to the next
+            if ( _internal.outputAvailable != 0 )
+                break;
+            [self _endMember];
+        }
+        
+        if ( _ignoresRemainingInput )
+        {
+            zStream->avail_in = 0;
+            break;
+        }
+        
+        // trailing garbage (often zero padding) after a complete gzip member is ignored, as by gunzip
+        if ( (zStream->avail_in > 0) && (zStream->total_in == 0) && (_member.compressedOffset != 0) &&
+             (zStream->next_in[0] != 0x1f) )
+        {
+            _ignoresRemainingInput = YES;
+            continue;
+        }
+        
+        if ( zStream->avail_in == 0 )
+            break;
+        
+        uLong outputBefore = zStream->total_out;
+        int err = inflate( zStream, Z_SYNC_FLUSH );
+        _member.uncompressedLength += zStream->total_out - outputBefore;
+        
+        // a full output buffer isn't an error; we'll carry on once it's been read. We've no way
+        //  to supply a preset dictionary though
+        if ( ((err < Z_OK) && (err != Z_BUF_ERROR)) || (err == Z_NEED_DICT) )
+        {
+            [_internal setZlibError: err];
+            [_compressedDataStream close];
+            return ( NO );
+        }
+        
+        if ( err != Z_STREAM_END )
+            break;
+        
+        _memberEnded = YES;
+    }
+    
+    [_internal resetInputIfEmpty];
+    return ( _internal.status != NSStreamStatusError );
+}
+
 - (void) stream: (NSStream *) stream handleEvent: (NSStreamEvent) event
 {
     switch ( event )
@@ -147,7 +298,14 @@
             if ( _internal.status == NSStreamStatusAtEnd )
                 break;
             
-            if ( (_internal.total_out == 0) && (_internal.avail_in == 0) )
+            if ( (_internal.status == NSStreamStatusOpening) && (_internal->_zStream->avail_in != 0) )
+            {
+                // a single byte, too short to be in any format
+                [_internal setZlibError: Z_DATA_ERROR];
+                break;
+            }
+            
+            if ( (_internal->_zStream->total_out == 0) && (_internal->_zStream->avail_in == 0) )
             {
                 _internal.status = NSStreamStatusAtEnd;
                 [_internal postStreamEvent: NSStreamEventEndEncountered];
@@ -168,7 +326,12 @@
                 int status = Z_OK;
                 if ( _internal.status == NSStreamStatusOpening )
                 {
-                    status = inflateInit2( _internal.zStream, (15+32) );
+                    int windowBits = WindowBitsForFormat( _format, _internal->_zStream->next_in,
+                                                          _internal->_zStream->avail_in );
+                    if ( windowBits == 0 )
+                        break;      // wait for the next byte
+                    
+                    status = inflateInit2( _internal->_zStream, windowBits );
                     if ( status != Z_OK )
                     {
                         [stream close];
@@ -176,25 +339,14 @@
                         break;
                     }
                     
+                    _windowBits = windowBits;
                     _internal.status = NSStreamStatusOpen;
                     [_internal postStreamEvent: NSStreamEventOpenCompleted];
                 }
                 
-                // attempt to decompress some data
-                status = inflate( _internal.zStream, Z_SYNC_FLUSH );
-                if ( status < Z_OK )
-                {
-                    [stream close];
-                    [_internal setZlibError: status];
+                // attempt to decompress some data, resetting the input buffer if it's all used
+                if ( [self _handlePendingInput] == NO )
                     break;
-                }
-                
-                // if it used all the input data we'll reset the input buffer
-                if ( _internal.avail_in == 0 )
-                {
-                    _internal.next_in = _internal.input;
-                    _internal.writeOffset = 0;
-                }
                 
                 // if it put data into the output we post the appropriate event
                 if ( _internal.outputAvailable > 0 )
@@ -226,23 +378,18 @@
         CFRunLoopRemoveSource( [aRunLoop getCFRunLoop], _internal.runloopSource, (CFStringRef)mode );
 }
 
-- (void) _handlePendingInput
+- (void) _requestMoreOutput
 {
-    if ( _internal.avail_in > 0 )
+    if ( _internal.outputAvailable == 0 )
     {
-        int err = inflate( _internal.zStream, Z_SYNC_FLUSH );
-        if ( err < Z_OK )
-        {
-            [_internal setZlibError: err];
-            [_compressedDataStream close];
-            return;
-        }
-        
-        if ( _internal.avail_in == 0 )
-        {
-            _internal.next_in = _internal.input;
-            _internal.writeOffset = 0;
-        }
+        // we fake the event, because we've probably been ignoring it for a while
+        if ( [_compressedDataStream hasBytesAvailable] )
+            [self stream: _compressedDataStream handleEvent: NSStreamEventHasBytesAvailable];
+    }
+    else
+    {
+        // there's more data left to be read, so we'll post another event
+        [_internal postStreamEvent: NSStreamEventHasBytesAvailable];
     }
 }
 
@@ -274,25 +421,7 @@
         ready = _internal.outputAvailable;
     }
     
-    if ( ready == 0 )
-    {
-        // we fake the event, because we've probably been ignoring it for a while
-        if ( [_compressedDataStream hasBytesAvailable] )
-            [self stream: _compressedDataStream handleEvent: NSStreamEventHasBytesAvailable];
-    }/*
-    else
-    {
-        // read the amount requested, setup variables in the zlib stream
-        [_internal readOutputToBuffer: buffer + totalRead length: len];
-        totalRead += len;
-        
-        [_internal setStatusForStream: _compressedDataStream];
-    }*/
-    else if ( _internal.outputAvailable > 0 )
-    {
-        // there's more data left to be read, so we'll post another event
-        [_internal postStreamEvent: NSStreamEventHasBytesAvailable];
-    }
+    [self _requestMoreOutput];
     
     if ( _internal.status == NSStreamStatusReading )
         _internal.status = NSStreamStatusOpen;
@@ -302,8 +431,34 @@
 
 - (BOOL) getBuffer: (uint8_t **) buffer length: (NSUInteger *) len
 {
-    // sorry, but we need to do buffer management when the caller reads stuff out
-    return ( NO );
+    if ( _internal.status != NSStreamStatusOpen )
+        return ( NO );
+    
+    NSInteger ready = _internal.outputAvailable;
+    if ( ready == 0 )
+        return ( NO );
+    
+    // the caller reads straight out of our output buffer, then tells us how much it used
+    *buffer = (uint8_t *) _internal.outputPtr;
+    *len = (NSUInteger) ready;
+    return ( YES );
+}
+
+- (void) consumeBufferedBytes: (NSUInteger) length
+{
+    if ( _internal.status != NSStreamStatusOpen )
+        return;
+    
+    [_internal consumeOutput: (NSInteger) length];
+    
+    if ( _internal.outputAvailable == 0 )
+    {
+        // the output buffer has been reset, so there's room to decompress more
+        [self _handlePendingInput];
+        [_internal setStatusForStream: _compressedDataStream];
+    }
+    
+    [self _requestMoreOutput];
 }
 
 - (BOOL) hasBytesAvailable
@@ -38,6 +38,25 @@
 
 #import "AQGzipStream.h"
 #import "_AQGzipStreamInternal.h"
+#import "_AQGzipParallelCompressor.h"
+
+#define DEFAULT_BLOCK_SIZE  (128 * 1024)
+
+// the window bits for deflateInit2() which produce each format
+static int WindowBitsForFormat( AQGzipStreamFormat format )
+{
+    switch ( format )
+    {
+        case AQGzipStreamFormatZlib:
+            return ( MAX_WBITS );
+            
+        case AQGzipStreamFormatRawDeflate:
+            return ( -MAX_WBITS );
+            
+        default:
+            return ( MAX_WBITS + 16 );
+    }
+}
 
 @implementation AQGzipOutputStream
 
@@ -53,6 +72,9 @@
     _outputStream = [destinationStream retain];
     _internal.status = NSStreamStatusNotOpen;
     _level = AQGzipCompressionLevelDefault;
+    _threadCount = 1;
+    _blockSize = DEFAULT_BLOCK_SIZE;
+    _format = AQGzipStreamFormatGzip;
     
     [_outputStream setDelegate: self];
     
@@ -64,6 +86,7 @@
     [self close];
     [_outputStream release];
     [_internal release];
+    [_parallel release];
     [super dealloc];
 }
 
@@ -101,6 +124,45 @@
     _level = newLevel;
 }
 
+- (AQGzipStreamFormat) format
+{
+    return ( _format );
+}
+
+- (void) setFormat: (AQGzipStreamFormat) value
+{
+    if ( _internal.status != NSStreamStatusNotOpen )
+        return;
+    
+    _format = (value == AQGzipStreamFormatAutoDetect ? AQGzipStreamFormatGzip : value);
+}
+
+- (NSUInteger) compressionThreadCount
+{
+    return ( _threadCount );
+}
+
+- (void) setCompressionThreadCount: (NSUInteger) value
+{
+    if ( _internal.status != NSStreamStatusNotOpen )
+        return;
+    
+    _threadCount = MAX(value, (NSUInteger)1);
+}
+
+- (NSUInteger) compressionBlockSize
+{
+    return ( _blockSize );
+}
+
+- (void) setCompressionBlockSize: (NSUInteger) value
+{
+    if ( (_internal.status != NSStreamStatusNotOpen) || (value == 0) )
+        return;
+    
+    _blockSize = value;
+}
+
 - (NSInteger) inputBufferSize
 {
     return ( _internal.inputSize );
@@ -127,6 +189,13 @@
     _internal.outputSize = value;
 }
 
+- (void) _parallelCompressionFailed
+{
+    _internal.error = [_parallel error];
+    _internal.status = NSStreamStatusError;
+    [_internal postStreamEvent: NSStreamEventErrorOccurred];
+}
+
 - (void) open
 {
     if ( _internal.status != NSStreamStatusNotOpen )
@@ -139,14 +208,70 @@
     _internal.status = NSStreamStatusOpening;
 }
 
+// compresses any remaining input & writes out the final block along with the format's trailer,
+//  waiting on the destination as necessary
+- (int) _finishDeflating
+{
+    int err = Z_OK;
+    
+    for ( ;; )
+    {
+        while ( _internal.outputAvailable > 0 )
+        {
+            if ( [_internal readOutputToStream: _outputStream] <= 0 )
+            {
+                NSError * error = [_outputStream streamError];
+                if ( error == nil )
+                    error = [NSError errorWithDomain: NSPOSIXErrorDomain code: EIO userInfo: nil];
+                _internal.error = error;
+                _internal.status = NSStreamStatusError;
+                [_internal postStreamEvent: NSStreamEventErrorOccurred];
+                return ( Z_ERRNO );
+            }
+        }
+        
+        if ( err == Z_STREAM_END )
+            return ( Z_OK );
+        
+        // the output buffer is empty, so deflate can always make some progress
+        err = deflate( _internal->_zStream, Z_FINISH );
+        if ( (err < Z_OK) && ((err != Z_BUF_ERROR) || (_internal.outputAvailable == 0)) )
+            return ( err );
+    }
+}
+
 - (void) close
 {
     if ( (_internal.status == NSStreamStatusNotOpen) ||
          (_internal.status >= NSStreamStatusClosed) )
         return;
     
-    int err = deflateEnd( _internal.zStream );
-    if ( err < Z_OK )
+    if ( _parallel != nil )
+    {
+        // the remaining blocks & the trailer are written before the destination closes
+        BOOL finished = [_parallel finish];
+        if ( finished == NO )
+            [self _parallelCompressionFailed];
+        
+        [_outputStream close];
+        if ( finished )
+            _internal.status = NSStreamStatusClosed;
+        return;
+    }
+    
+    // nothing was written, but an empty stream still gets its header & trailer
+    int err = Z_OK;
+    if ( _internal.status == NSStreamStatusOpening )
+        err = deflateInit2( _internal->_zStream, _level, Z_DEFLATED, 
+                            WindowBitsForFormat(_format), 8, Z_DEFAULT_STRATEGY );
+    
+    if ( err == Z_OK )
+        err = [self _finishDeflating];
+    
+    int endErr = deflateEnd( _internal->_zStream );
+    if ( err == Z_OK )
+        err = endErr;
+    if ( (err < Z_OK) && (_internal.status != NSStreamStatusError) )
         [_internal setZlibError: err];
     
     [_outputStream close];
@@ -166,17 +291,15 @@
 - (int) _handlePendingInput
 {
     // try to compress some more input
-    int err = deflate( _internal.zStream, Z_SYNC_FLUSH );
+    int err = deflate( _internal->_zStream, Z_SYNC_FLUSH );
     if ( err < Z_OK )
     {
         [_outputStream close];
         [_internal setZlibError: err];
     }
-    else if ( _internal.avail_in == 0 )
+    else
     {
-        _internal.next_in = _internal.input;
-        _internal.avail_in = 0;
-        _internal.writeOffset = 0;
+        [_internal resetInputIfEmpty];
     }
     
     return ( err );
@@ -207,8 +330,17 @@
             
         case NSStreamEventHasSpaceAvailable:
         {
+            if ( _parallel != nil )
+            {
+                if ( [_parallel writeCompletedBlocks] )
+                    [_internal postStreamEvent: NSStreamEventHasSpaceAvailable];
+                else
+                    [self _parallelCompressionFailed];
+                break;
+            }
+            
             BOOL sentData = NO;
-            if ( (_internal.outputAvailable == 0) && (_internal.avail_in > 0) )
+            if ( (_internal.outputAvailable == 0) && (_internal->_zStream->avail_in > 0) )
             {
                 if ( [self _handlePendingInput] < Z_OK )
                     break;
@@ -221,7 +353,7 @@
                 sentData = YES;
                 
                 if ( ([_outputStream hasSpaceAvailable] == NO) ||
-                     (_internal.avail_in == 0) )
+                     (_internal->_zStream->avail_in == 0) )
                     break;
                 
                 if ( [self _handlePendingInput] < Z_OK )
@@ -260,10 +392,19 @@
     if ( [self hasSpaceAvailable] == NO )
         return ( 0 );
     
-    if ( _internal.status == NSStreamStatusOpening )
+    if ( (_internal.status == NSStreamStatusOpening) && (_threadCount > 1) )
     {
-        int err = deflateInit2( _internal.zStream, _level, Z_DEFLATED, 
-                                (15+16), 8, Z_DEFAULT_STRATEGY );
+        _parallel = [[_AQGzipParallelCompressor alloc] initWithDestination: _outputStream
+                                                           compressionLevel: (int) _level
+                                                                     format: _format
+                                                                  blockSize: _blockSize
+                                                                threadCount: _threadCount];
+        _internal.status = NSStreamStatusOpen;
+    }
+    else if ( _internal.status == NSStreamStatusOpening )
+    {
+        int err = deflateInit2( _internal->_zStream, _level, Z_DEFLATED, 
+                                WindowBitsForFormat(_format), 8, Z_DEFAULT_STRATEGY );
         if ( err != Z_OK )
         {
             [_outputStream close];
@@ -277,6 +418,17 @@
     if ( _internal.status != NSStreamStatusOpen )
         return ( 0 );
     
+    if ( _parallel != nil )
+    {
+        _internal.status = NSStreamStatusWriting;
+        NSInteger written = [_parallel write: buffer length: length];
+        _internal.status = NSStreamStatusOpen;
+        
+        if ( written < 0 )
+            [self _parallelCompressionFailed];
+        return ( written );
+    }
+    
     _internal.status = NSStreamStatusWriting;
     NSInteger copied = [_internal writeInputFromBuffer: buffer length: length];
     _internal.status = NSStreamStatusOpen;
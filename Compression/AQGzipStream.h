@@ -38,7 +38,7 @@
 
 #import <Foundation/Foundation.h>
 
-@class _AQGzipStreamInternal;
+@class _AQGzipStreamInternal, _AQGzipParallelCompressor;
 
 // these values match those from <zlib.h>
 enum
@@ -53,6 +53,28 @@ enum
 };
 typedef NSInteger AQGzipCompressionLevel;
 
+// the wrapper around the deflate data (RFCs 1950-1952). HTTP's 'gzip' content-encoding is
+//  the gzip format; 'deflate' is meant to be the zlib format, but some servers send raw deflate
+enum
+{
+    AQGzipStreamFormatGzip          = 0,    // gzip header & CRC-32 trailer
+    AQGzipStreamFormatZlib          = 1,    // two-byte zlib header & Adler-32 trailer
+    AQGzipStreamFormatRawDeflate    = 2,    // no header or trailer at all
+    AQGzipStreamFormatAutoDetect    = 3     // input only: any of the above, told apart by the first bytes
+};
+typedef NSInteger AQGzipStreamFormat;
+
+// one member of a gzip stream, or the whole of a zlib or raw deflate stream. Offsets are from
+//  the start of all the data read by the stream, so they can be used to seek straight to a member
+typedef struct
+{
+    unsigned long long  compressedOffset;
+    unsigned long long  compressedLength;   // including the member's header & trailer
+    unsigned long long  uncompressedOffset;
+    unsigned long long  uncompressedLength;
+    uint32_t            checkValue;         // CRC-32 for gzip, Adler-32 for zlib, zero for raw deflate
+} AQGzipMember;
+
 ////////////////////////////////////////////////////////////////////////
 
 // all these properties can only be set prior to opening the stream
@@ -76,6 +98,13 @@ typedef NSInteger AQGzipCompressionLevel;
 {
     NSInputStream *         _compressedDataStream;
     _AQGzipStreamInternal * _internal;
+    AQGzipStreamFormat      _format;
+    int                     _windowBits;            // as given to inflateInit2(), once the format is known
+    BOOL                    _decodesConcatenatedMembers;
+    BOOL                    _memberEnded;           // waiting for its output to be read
+    BOOL                    _ignoresRemainingInput;
+    unsigned long long      _compressedBase;        // compressed bytes in earlier members
+    AQGzipMember            _member;                // the one being decompressed
 }
 
 // designated initializer
@@ -83,6 +112,27 @@ typedef NSInteger AQGzipCompressionLevel;
 // creates a memory stream from the compressed data
 - (id) initWithCompressedData: (NSData *) data;
 
+// The format of the compressed data. Defaults to AQGzipStreamFormatAutoDetect, which looks at
+//  the first two bytes: the gzip magic number or a valid zlib header select those formats, and
+//  anything else is taken to be raw deflate data. Can only be set before the stream is opened.
+@property (nonatomic) AQGzipStreamFormat format;
+
+// When set (the default), gzip data made up of several members -- as made by concatenating gzip
+//  files, or by appending to one -- is decompressed as one stream, as gunzip does. Otherwise,
+//  or for zlib & raw deflate data, anything after the first member is ignored.
+// Can only be set before the stream is opened.
+@property (nonatomic) BOOL decodesConcatenatedMembers;
+
+// the number of bytes of compressed data consumed so far; useful for measuring progress
+//  against the length of the compressed data (this matches AQXMLParserProgressSource)
+@property (nonatomic, readonly) unsigned long long compressedBytesRead;
+
+// -getBuffer:length: returns the decompressed data waiting in the output buffer, without
+//  copying it. Once the caller is done with some of it, this releases those bytes so the
+//  buffer can be refilled; the pointer is invalid after that, or after -read:maxLength:.
+//  This matches AQXMLParserBufferedInputStream.
+- (void) consumeBufferedBytes: (NSUInteger) length;
+
 @end
 
 @interface AQGzipOutputStream : NSOutputStream <AQGzipMemoryStreamOptimisation, AQGzipOutputCompressor>
@@ -90,11 +140,35 @@ typedef NSInteger AQGzipCompressionLevel;
     NSOutputStream *        _outputStream;
     _AQGzipStreamInternal * _internal;
     AQGzipCompressionLevel  _level;
+    NSUInteger              _threadCount;
+    NSUInteger              _blockSize;
+    _AQGzipParallelCompressor * _parallel;
+    AQGzipStreamFormat      _format;
 }
 
 // designated initializer
 - (id) initWithDestinationStream: (NSOutputStream *) stream;
 
+// The format to write. Defaults to AQGzipStreamFormatGzip, which AQGzipStreamFormatAutoDetect
+//  also means here. Can only be set before the stream is opened.
+@property (nonatomic) AQGzipStreamFormat format;
+
+// When more than one (the default is one), input is divided into blocks of compressionBlockSize
+//  bytes (default 128KB) which are compressed on up to this many threads at once. The output
+//  is still a single stream in the chosen format, readable by AQGzipInputStream (or gunzip),
+//  but is only complete once the stream has been closed. Writes may wait for earlier blocks to be compressed.
+// Both can only be set before the stream is opened.
+@property (nonatomic) NSUInteger compressionThreadCount;
+@property (nonatomic) NSUInteger compressionBlockSize;
+
+@end
+
+// The delegate of an AQGzipInputStream can implement this to find out where each member ends.
+// It's called once all the data up to the end of the member has been read, and before any from
+//  the next member is available -- usually from within -read:maxLength: or -consumeBufferedBytes:.
+@protocol AQGzipInputStreamDelegate <NSObject>
+@optional
+- (void) gzipStream: (AQGzipInputStream *) stream didEndMember: (AQGzipMember) member;
 @end
 
 ////////////////////////////////////////////////////////////////////////
@@ -115,6 +189,53 @@ typedef NSInteger AQGzipCompressionLevel;
 - (id<AQGzipOutputCompressor>) initToGzipFileAtPath: (NSString *) path;
 @end
 
+////////////////////////////////////////////////////////////////////////
+// Random access to gzip files
+
+// A list of points in a gzip file at which decompression can begin, so it can be read from
+//  any offset without decompressing everything before it. A point is recorded at the first
+//  deflate block boundary after every 'spacing' bytes of uncompressed data, along with the
+//  32KB of data preceding it, which is all the following data can refer back to. Reaching
+//  any offset then costs decompressing no more than 'spacing' bytes.
+// Building an index reads the whole file, so it's worth keeping in a file alongside it. Each
+//  point takes a little over 32KB, which should be considered when choosing the spacing.
+@interface AQGzipIndex : NSObject
+{
+    NSMutableData *         _points;
+    NSData *                _windowData;
+    const uint8_t *         _windows;
+    unsigned long long      _spacing;
+    unsigned long long      _uncompressedLength;
+    unsigned long long      _compressedLength;
+}
+
+// scans the file, recording a point every 'spacing' bytes (default 1MB if zero). A file made up
+//  of several gzip members is indexed as one stream, with a point at the start of each member
++ (AQGzipIndex *) indexForGzipFileAtPath: (NSString *) path
+                                 spacing: (unsigned long long) spacing
+                                   error: (NSError **) error;
+
+// load & save a sidecar index file
+- (id) initWithContentsOfFile: (NSString *) path error: (NSError **) error;
+- (BOOL) writeToFile: (NSString *) path error: (NSError **) error;
+
+@property (nonatomic, readonly) NSUInteger pointCount;
+@property (nonatomic, readonly) unsigned long long spacing;
+@property (nonatomic, readonly) unsigned long long uncompressedLength;
+@property (nonatomic, readonly) unsigned long long compressedLength;     // i.e. the file's size
+
+@end
+
+// Reads a gzip file using an index built from it. Setting the stream's
+//  NSStreamFileCurrentOffsetKey property to an uncompressed offset, before or after opening,
+//  moves to it by decompressing only from the nearest preceding index point. The data's CRC
+//  isn't checked when reading this way. The stream fails to open if the file's size doesn't
+//  match the index.
+@interface AQGzipInputStream (GzipFileRandomAccess)
++ (id) gzipStreamWithFileAtPath: (NSString *) path index: (AQGzipIndex *) index;
+- (id) initWithGzipFileAtPath: (NSString *) path index: (AQGzipIndex *) index;
+@end
+
 ////////////////////////////////////////////////////////////////////////
 // Constants
 
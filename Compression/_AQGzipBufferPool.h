@@ -0,0 +1,54 @@
+/*
+ * _AQGzipBufferPool.h
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <zlib.h>
+
+// A process-wide pool of the memory gzip streams use: their input & output buffers, and the
+//  state & window zlib allocates through zalloc/zfree. Opening & closing many short-lived
+//  streams then reuses the same few blocks, already faulted in, rather than going to malloc
+//  each time.
+// Blocks are grouped by power-of-two size, from 512 bytes to 256KB; larger requests go
+//  straight to malloc & free. Only a limited amount of memory is kept for each size.
+// All functions are thread-safe. The memory isn't collectable, so it must be given back
+//  explicitly, including from -finalize.
+
+void * AQGzipBufferPoolAlloc( size_t size );
+void AQGzipBufferPoolFree( void * buffer );
+
+// for z_stream's zalloc & zfree members
+voidpf AQGzipBufferPoolZalloc( voidpf opaque, uInt items, uInt size );
+void AQGzipBufferPoolZfree( voidpf opaque, voidpf address );
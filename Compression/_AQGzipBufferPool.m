@@ -0,0 +1,143 @@
+/*
+ * _AQGzipBufferPool.m
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "_AQGzipBufferPool.h"
+#import <libkern/OSAtomic.h>
+
+#define MIN_CLASS_SHIFT     9                   // 512 bytes
+#define MAX_CLASS_SHIFT     18                  // 256KB
+#define CLASS_COUNT         (MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1)
+#define UNPOOLED            0xff
+#define MAX_FREE_BYTES      (1024 * 1024)       // kept per size class, once returned
+#define MIN_FREE_BLOCKS     4
+
+// Every block begins with this, and the caller gets the memory after it. Its size keeps the
+//  caller's memory aligned as malloc's would be.
+typedef union _PoolHeader
+{
+    union _PoolHeader * next;           // while on a free list
+    uint8_t             sizeClass;      // while in use
+    double              align[2];
+} PoolHeader;
+
+static PoolHeader *     __freeLists[CLASS_COUNT] = { NULL };
+static NSUInteger       __freeCounts[CLASS_COUNT] = { 0 };
+static OSSpinLock       __poolLock = OS_SPINLOCK_INIT;
+
+static uint8_t SizeClassForSize( size_t size )
+{
+    uint8_t shift = MIN_CLASS_SHIFT;
+    while ( ((size_t)1 << shift) < size )
+    {
+        if ( ++shift > MAX_CLASS_SHIFT )
+            return ( UNPOOLED );
+    }
+    
+    return ( shift - MIN_CLASS_SHIFT );
+}
+
+void * AQGzipBufferPoolAlloc( size_t size )
+{
+    uint8_t sizeClass = SizeClassForSize( size );
+    PoolHeader * header = NULL;
+    
+    if ( sizeClass != UNPOOLED )
+    {
+        OSSpinLockLock( &__poolLock );
+        header = __freeLists[sizeClass];
+        if ( header != NULL )
+        {
+            __freeLists[sizeClass] = header->next;
+            __freeCounts[sizeClass]--;
+        }
+        OSSpinLockUnlock( &__poolLock );
+        
+        // a new block is made as large as any request in its class
+        if ( header == NULL )
+            size = (size_t)1 << (sizeClass + MIN_CLASS_SHIFT);
+    }
+    
+    if ( header == NULL )
+    {
+        header = malloc( sizeof(PoolHeader) + size );
+        if ( header == NULL )
+            return ( NULL );
+    }
+    
+    header->sizeClass = sizeClass;
+    return ( header + 1 );
+}
+
+void AQGzipBufferPoolFree( void * buffer )
+{
+    if ( buffer == NULL )
+        return;
+    
+    PoolHeader * header = ((PoolHeader *) buffer) - 1;
+    uint8_t sizeClass = header->sizeClass;
+    
+    if ( sizeClass != UNPOOLED )
+    {
+        NSUInteger limit = MAX(MAX_FREE_BYTES >> (sizeClass + MIN_CLASS_SHIFT), MIN_FREE_BLOCKS);
+        
+        OSSpinLockLock( &__poolLock );
+        if ( __freeCounts[sizeClass] < limit )
+        {
+            header->next = __freeLists[sizeClass];
+            __freeLists[sizeClass] = header;
+            __freeCounts[sizeClass]++;
+            header = NULL;
+        }
+        OSSpinLockUnlock( &__poolLock );
+    }
+    
+    // the pool for this size is full, or it was never pooled
+    if ( header != NULL )
+        free( header );
+}
+
+voidpf AQGzipBufferPoolZalloc( voidpf opaque, uInt items, uInt size )
+{
+    // zlib expects Z_NULL on failure, including for sizes which overflow
+    if ( (size != 0) && (items > SIZE_MAX / size) )
+        return ( Z_NULL );
+    return ( AQGzipBufferPoolAlloc((size_t)items * size) );
+}
+
+void AQGzipBufferPoolZfree( voidpf opaque, voidpf address )
+{
+    AQGzipBufferPoolFree( address );
+}
@@ -0,0 +1,55 @@
+/*
+ * _AQGzipIndexInternal.h
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQGzipStream.h"
+
+// the amount of uncompressed data a deflate stream can refer back to
+#define AQGZIP_WINDOW_SIZE  32768
+
+typedef struct _AQGzipIndexPoint
+{
+    unsigned long long  output;     // offset of the point in the uncompressed data
+    unsigned long long  input;      // offset in the file of the first whole byte after the point
+    int                 bits;       // the number of bits of the previous byte after the point, if any
+    
+} AQGzipIndexPoint;
+
+@interface AQGzipIndex (Internal)
+// the last point at or before the given uncompressed offset
+- (const AQGzipIndexPoint *) _pointForOffset: (unsigned long long) offset;
+// the AQGZIP_WINDOW_SIZE bytes of uncompressed data preceding a point
+- (const uint8_t *) _windowForPoint: (const AQGzipIndexPoint *) point;
+@end
@@ -0,0 +1,99 @@
+/*
+ * _AQGzipParallelCompressor.h
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <zlib.h>
+#import "AQGzipStream.h"
+
+// Compresses data into a single gzip member (or zlib or raw deflate stream) using several
+//  threads, in the manner of pigz.
+// Input is divided into fixed-size blocks, each of which is deflated independently as raw
+//  deflate data on a worker thread, using the last 32KB of the previous block as its preset
+//  dictionary so little compression is lost. Every block but the last ends with a sync flush,
+//  leaving it byte-aligned, so the compressed blocks can simply be written one after another.
+//  Each block's CRC (or Adler-32) is computed alongside, and they're combined in order for the
+//  trailer.
+// Only a limited number of blocks are in flight at once; beyond that, writes wait for the
+//  oldest to be compressed & written, so memory use stays bounded.
+
+@interface _AQGzipParallelCompressor : NSObject
+{
+    NSOutputStream *    _destination;       // not retained; belongs to the owning stream
+    int                 _level;
+    AQGzipStreamFormat  _format;
+    NSUInteger          _blockSize;
+    NSUInteger          _threadCount;
+    
+    // blocks waiting for a worker, and every block not yet written, both in input order
+    NSCondition *       _condition;
+    NSMutableArray *    _queue;
+    NSMutableArray *    _blocks;
+    NSUInteger          _workerCount;       // started & not yet exited
+    NSUInteger          _idleCount;         // waiting for a block
+    BOOL                _finishing;
+    
+    NSMutableData *     _input;             // the block being filled
+    NSData *            _previousInput;     // supplies the next block's dictionary
+    
+    NSData *            _output;            // compressed block being written to the destination
+    NSUInteger          _outputOffset;
+    BOOL                _wroteHeader;
+    
+    uLong               _check;             // CRC-32 for gzip, Adler-32 for zlib
+    uLong               _length;            // modulo 2^32, as stored in the trailer
+    
+    NSError *           _error;
+}
+
+- (id) initWithDestination: (NSOutputStream *) destination
+          compressionLevel: (int) level
+                    format: (AQGzipStreamFormat) format
+                 blockSize: (NSUInteger) blockSize
+               threadCount: (NSUInteger) threadCount;
+
+// Takes all the bytes given, returning -1 on error. May wait for earlier blocks to be
+//  compressed, writing them to the destination as it does so.
+- (NSInteger) write: (const uint8_t *) buffer length: (NSUInteger) length;
+
+// writes any blocks compressed so far while the destination has space; never waits
+- (BOOL) writeCompletedBlocks;
+
+// compresses whatever remains, then writes everything along with the format's trailer
+- (BOOL) finish;
+
+@property (nonatomic, readonly) NSError * error;
+
+@end
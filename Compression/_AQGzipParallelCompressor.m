@@ -0,0 +1,476 @@
+/*
+ * _AQGzipParallelCompressor.m
+ * AQToolkit
+ * 
+ * Copyright (c) 2009 Jim Dovey
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 
+ * Neither the name of the project's author nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "_AQGzipParallelCompressor.h"
+#import "AQGzipStream.h"
+#import <libkern/OSByteOrder.h>
+
+#define DICTIONARY_SIZE     (32 * 1024)     // the largest window deflate can use
+#define BLOCKS_PER_THREAD   2               // blocks in flight, per thread, before writes wait
+
+// a minimal gzip header: no name or timestamp, OS unknown
+static const uint8_t __gzipHeader[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0xff };
+
+@interface _AQGzipBlock : NSObject
+{
+@public
+    NSData *        input;
+    NSData *        dictionary;     // the previous block's input, or nil for the first
+    NSMutableData * output;
+    uLong           check;
+    BOOL            last;
+    BOOL            done;
+}
+@end
+
+@implementation _AQGzipBlock
+
+- (void) dealloc
+{
+    [input release];
+    [dictionary release];
+    [output release];
+    [super dealloc];
+}
+
+@end
+
+#pragma mark -
+
+@interface _AQGzipParallelCompressor ()
+- (void) _compressBlocks;
+- (int) _compressBlock: (_AQGzipBlock *) block withStream: (z_stream *) stream;
+- (BOOL) _submitBlock: (BOOL) last;
+- (_AQGzipBlock *) _nextCompletedBlockWaiting: (BOOL) wait;
+- (BOOL) _writeNextBlockWaiting: (BOOL) wait;
+- (BOOL) _writeOutputWaiting: (BOOL) wait;
+- (void) _setError: (NSError *) error;
+@end
+
+@implementation _AQGzipParallelCompressor
+
+- (id) initWithDestination: (NSOutputStream *) destination
+          compressionLevel: (int) level
+                    format: (AQGzipStreamFormat) format
+                 blockSize: (NSUInteger) blockSize
+               threadCount: (NSUInteger) threadCount
+{
+    if ( [super init] == nil )
+        return ( nil );
+    
+    _destination = destination;
+    _level = level;
+    _format = (format == AQGzipStreamFormatAutoDetect ? AQGzipStreamFormatGzip : format);
+    _blockSize = MAX(blockSize, (NSUInteger)DICTIONARY_SIZE);
+    _threadCount = MAX(threadCount, (NSUInteger)1);
+    
+    _condition = [[NSCondition alloc] init];
+    _queue = [[NSMutableArray alloc] init];
+    _blocks = [[NSMutableArray alloc] init];
+    
+    // the header goes out ahead of the first block
+    if ( _format == AQGzipStreamFormatZlib )
+    {
+        // 32KB window, with the level hint zlib itself would use
+        uint8_t header[2] = { 0x78, 0 };
+        if ( (level >= 0) && (level < 2) )
+            header[1] = 0 << 6;
+        else if ( (level >= 2) && (level < 6) )
+            header[1] = 1 << 6;
+        else if ( (level == 6) || (level == Z_DEFAULT_COMPRESSION) )
+            header[1] = 2 << 6;
+        else
+            header[1] = 3 << 6;
+        header[1] += 31 - (((header[0] << 8) | header[1]) % 31);
+        
+        _check = adler32( 0L, Z_NULL, 0 );
+        _output = [[NSData alloc] initWithBytes: header length: sizeof(header)];
+    }
+    else if ( _format == AQGzipStreamFormatGzip )
+    {
+        _check = crc32( 0L, Z_NULL, 0 );
+        _output = [[NSData alloc] initWithBytes: __gzipHeader length: sizeof(__gzipHeader)];
+    }
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    [_condition release];
+    [_queue release];
+    [_blocks release];
+    [_input release];
+    [_previousInput release];
+    [_output release];
+    [_error release];
+    [super dealloc];
+}
+
+- (NSError *) error
+{
+    [_condition lock];
+    NSError * result = [[_error retain] autorelease];
+    [_condition unlock];
+    return ( result );
+}
+
+- (void) _setError: (NSError *) error
+{
+    [_condition lock];
+    if ( _error == nil )
+        _error = [error retain];
+    [_condition broadcast];
+    [_condition unlock];
+}
+
+#pragma mark Input
+
+- (NSInteger) write: (const uint8_t *) buffer length: (NSUInteger) length
+{
+    if ( _finishing || ([self error] != nil) )
+        return ( -1 );
+    
+    NSUInteger remaining = length;
+    while ( remaining != 0 )
+    {
+        if ( _input == nil )
+            _input = [[NSMutableData alloc] initWithCapacity: _blockSize];
+        
+        NSUInteger count = MIN(remaining, _blockSize - [_input length]);
+        [_input appendBytes: buffer length: count];
+        buffer += count;
+        remaining -= count;
+        
+        if ( ([_input length] == _blockSize) && ([self _submitBlock: NO] == NO) )
+            return ( -1 );
+    }
+    
+    if ( [self writeCompletedBlocks] == NO )
+        return ( -1 );
+    
+    return ( (NSInteger) length );
+}
+
+- (BOOL) _submitBlock: (BOOL) last
+{
+    // only this thread adds or removes blocks, so the count can be read without the lock
+    while ( [_blocks count] >= _threadCount * BLOCKS_PER_THREAD )
+    {
+        if ( [self _writeNextBlockWaiting: YES] == NO )
+            return ( NO );
+    }
+    
+    _AQGzipBlock * block = [[_AQGzipBlock alloc] init];
+    block->input = (_input != nil ? _input : [[NSData alloc] init]);
+    block->dictionary = _previousInput;
+    block->last = last;
+    
+    _input = nil;
+    _previousInput = [block->input retain];
+    
+    [_condition lock];
+    
+    [_blocks addObject: block];
+    [_queue addObject: block];
+    
+    // workers stay around until -finish, so one is only started when none are free to take this block
+    if ( (_workerCount < _threadCount) && (_idleCount < [_queue count]) )
+    {
+        _workerCount++;
+        [NSThread detachNewThreadSelector: @selector(_compressBlocks) toTarget: self withObject: nil];
+    }
+    
+    [_condition broadcast];
+    [_condition unlock];
+    
+    [block release];
+    return ( YES );
+}
+
+#pragma mark Worker Threads
+
+- (void) _compressBlocks
+{
+    NSAutoreleasePool * rootPool = [[NSAutoreleasePool alloc] init];
+    
+    // each worker keeps one deflate stream, reset for every block
+    z_stream stream;
+    memset( &stream, 0, sizeof(z_stream) );
+    int err = deflateInit2( &stream, _level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY );
+    
+    [_condition lock];
+    
+    for ( ;; )
+    {
+        // wait for more blocks until the input is finished or something has failed
+        while ( ([_queue count] == 0) && (_finishing == NO) && (_error == nil) )
+        {
+            _idleCount++;
+            [_condition wait];
+            _idleCount--;
+        }
+        
+        if ( ([_queue count] == 0) || (_error != nil) )
+            break;
+        
+        _AQGzipBlock * block = [[_queue objectAtIndex: 0] retain];
+        [_queue removeObjectAtIndex: 0];
+        [_condition unlock];
+        
+        if ( err == Z_OK )
+            err = [self _compressBlock: block withStream: &stream];
+        
+        if ( err != Z_OK )
+        {
+            NSDictionary * userInfo = nil;
+            if ( stream.msg != NULL )
+                userInfo = [NSDictionary dictionaryWithObject: [NSString stringWithUTF8String: stream.msg]
+                                                       forKey: NSLocalizedDescriptionKey];
+            [self _setError: [NSError errorWithDomain: AQZlibErrorDomain code: err userInfo: userInfo]];
+        }
+        
+        [_condition lock];
+        block->done = YES;
+        [_condition broadcast];
+        [block release];
+    }
+    
+    _workerCount--;
+    [_condition unlock];
+    
+    deflateEnd( &stream );
+    [rootPool drain];
+}
+
+- (int) _compressBlock: (_AQGzipBlock *) block withStream: (z_stream *) stream
+{
+    NSUInteger inputLength = [block->input length];
+    
+    int err = deflateReset( stream );
+    if ( err != Z_OK )
+        return ( err );
+    
+    if ( block->dictionary != nil )
+    {
+        NSUInteger dictLength = MIN([block->dictionary length], (NSUInteger)DICTIONARY_SIZE);
+        const Bytef * dict = (const Bytef *)[block->dictionary bytes] + [block->dictionary length] - dictLength;
+        err = deflateSetDictionary( stream, dict, (uInt) dictLength );
+        if ( err != Z_OK )
+            return ( err );
+    }
+    
+    if ( _format == AQGzipStreamFormatGzip )
+        block->check = crc32( crc32(0L, Z_NULL, 0), (const Bytef *)[block->input bytes], (uInt) inputLength );
+    else if ( _format == AQGzipStreamFormatZlib )
+        block->check = adler32( adler32(0L, Z_NULL, 0), (const Bytef *)[block->input bytes], (uInt) inputLength );
+    
+    // a sync flush can add a few bytes to deflate's usual bound
+    block->output = [[NSMutableData alloc] initWithLength: deflateBound(stream, inputLength) + 16];
+    stream->next_in = (Bytef *)[block->input bytes];
+    stream->avail_in = (uInt) inputLength;
+    
+    // every block but the last is left byte-aligned & open, so the next can follow it directly
+    int flush = (block->last ? Z_FINISH : Z_SYNC_FLUSH);
+    NSUInteger produced = 0;
+    
+    for ( ;; )
+    {
+        stream->next_out = (Bytef *)[block->output mutableBytes] + produced;
+        stream->avail_out = (uInt) ([block->output length] - produced);
+        
+        err = deflate( stream, flush );
+        produced = [block->output length] - stream->avail_out;
+        
+        if ( err == Z_STREAM_END )
+        {
+            err = Z_OK;
+            break;
+        }
+        if ( (err != Z_OK) && (err != Z_BUF_ERROR) )
+            break;
+        if ( stream->avail_out != 0 )
+        {
+            // the flush is complete
+            err = Z_OK;
+            break;
+        }
+        
+        [block->output increaseLengthBy: 1024];
+    }
+    
+    [block->output setLength: produced];
+    return ( err );
+}
+
+#pragma mark Output
+
+- (_AQGzipBlock *) _nextCompletedBlockWaiting: (BOOL) wait
+{
+    _AQGzipBlock * block = nil;
+    
+    [_condition lock];
+    
+    if ( [_blocks count] != 0 )
+    {
+        block = [_blocks objectAtIndex: 0];
+        while ( wait && (block->done == NO) && (_error == nil) )
+            [_condition wait];
+        
+        if ( block->done && (_error == nil) )
+        {
+            [block retain];
+            [_blocks removeObjectAtIndex: 0];
+        }
+        else
+        {
+            block = nil;
+        }
+    }
+    
+    [_condition unlock];
+    
+    return ( [block autorelease] );
+}
+
+// returns YES if a whole block was written
+- (BOOL) _writeNextBlockWaiting: (BOOL) wait
+{
+    if ( _output == nil )
+    {
+        _AQGzipBlock * block = [self _nextCompletedBlockWaiting: wait];
+        if ( block == nil )
+            return ( NO );
+        
+        // the blocks' check values are combined in order, giving that of the whole input
+        uLong length = (uLong) [block->input length];
+        if ( _format == AQGzipStreamFormatGzip )
+            _check = crc32_combine( _check, block->check, length );
+        else if ( _format == AQGzipStreamFormatZlib )
+            _check = adler32_combine( _check, block->check, length );
+        _length += length;
+        
+        _output = [block->output retain];
+        _outputOffset = 0;
+    }
+    
+    return ( [self _writeOutputWaiting: wait] );
+}
+
+// returns YES once all of _output has been written
+- (BOOL) _writeOutputWaiting: (BOOL) wait
+{
+    const uint8_t * bytes = (const uint8_t *)[_output bytes];
+    NSUInteger length = [_output length];
+    
+    while ( _outputOffset < length )
+    {
+        if ( (wait == NO) && ([_destination hasSpaceAvailable] == NO) )
+            return ( NO );
+        
+        NSInteger count = [_destination write: bytes + _outputOffset maxLength: length - _outputOffset];
+        if ( count <= 0 )
+        {
+            NSError * error = [_destination streamError];
+            if ( error == nil )
+                error = [NSError errorWithDomain: NSPOSIXErrorDomain code: EIO userInfo: nil];
+            [self _setError: error];
+            return ( NO );
+        }
+        
+        _outputOffset += count;
+    }
+    
+    [_output release];
+    _output = nil;
+    _outputOffset = 0;
+    
+    return ( YES );
+}
+
+- (BOOL) writeCompletedBlocks
+{
+    while ( [self _writeNextBlockWaiting: NO] )
+        ;
+    
+    return ( [self error] == nil );
+}
+
+- (BOOL) finish
+{
+    if ( _finishing )
+        return ( [self error] == nil );
+    
+    // there's always a last block, even an empty one, to mark the end of the deflate data
+    BOOL submitted = (([self error] == nil) && [self _submitBlock: YES]);
+    
+    // idle workers exit once they see there's nothing more coming
+    [_condition lock];
+    _finishing = YES;
+    [_condition broadcast];
+    [_condition unlock];
+    
+    if ( submitted == NO )
+        return ( NO );
+    
+    while ( [self _writeNextBlockWaiting: YES] )
+        ;
+    
+    if ( ([self error] != nil) || ([_blocks count] != 0) )
+        return ( NO );
+    
+    // raw deflate data has no trailer
+    uint8_t trailer[8];
+    NSUInteger trailerLength = 0;
+    if ( _format == AQGzipStreamFormatGzip )
+    {
+        OSWriteLittleInt32( trailer, 0, (uint32_t) _check );
+        OSWriteLittleInt32( trailer, 4, (uint32_t) _length );
+        trailerLength = 8;
+    }
+    else if ( _format == AQGzipStreamFormatZlib )
+    {
+        OSWriteBigInt32( trailer, 0, (uint32_t) _check );
+        trailerLength = 4;
+    }
+    
+    _output = [[NSData alloc] initWithBytes: trailer length: trailerLength];
+    _outputOffset = 0;
+    
+    return ( [self _writeOutputWaiting: YES] );
+}
+
+@end
@@ -43,12 +43,17 @@
 
 #import "iPhoneNonatomic.h"
 
-#if TARGET_OS_MAC
-# import <libkern/OSAtomic.h>
-#endif
-
+// Threading: an instance and its z_stream belong to whichever thread is driving the stream
+//  which owns it -- the thread of the runloop it's scheduled on, or the one calling -read:maxLength:
+//  or -write:maxLength: on an unscheduled stream. None of the buffer state is locked, and the
+//  owner works on the z_stream fields directly through the public ivars, several times per buffer.
+// To hand a stream to another thread, stop using it on the first (remove it from the runloop, or
+//  return from the last read/write call) before the second starts; whatever signals the second
+//  thread to begin (a lock, condition, or -performSelector:onThread:...) orders the memory accesses.
+// The status, error & delegate properties remain atomic, as they can be read from anywhere.
 @interface _AQGzipStreamInternal : NSObject
 {
+@public
     z_stream * __strong         _zStream;
     NSError *                   _error;
     NSStreamStatus              _status;
@@ -61,11 +66,6 @@
     NSUInteger                  _readOffset;    // offset from _zStream->output at which to begin reading
     CFRunLoopSourceRef __strong _runloopSource;
     mach_port_t                 _port;
-
-    // used to implement atomic access to z_stream members on Macintosh
-#if TARGET_OS_MAC
-    OSSpinLock                  _lock;
-#endif
 }
 
 @property (NS_NONATOMIC_IPHONEONLY assign) z_stream * __strong zStream;
@@ -76,31 +76,19 @@
 @property (nonatomic) NSInteger outputSize;
 @property (nonatomic, readonly) Bytef * input;
 @property (nonatomic, readonly) Bytef * output;
-@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger writeOffset;
-@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger readOffset;
+@property (nonatomic) NSUInteger writeOffset;
+@property (nonatomic) NSUInteger readOffset;
 @property (NS_NONATOMIC_IPHONEONLY readonly) CFRunLoopSourceRef runloopSource;
 @property (NS_NONATOMIC_IPHONEONLY readonly) mach_port_t port;
 
-/////////////////////////////////////////////////////////
-// z_stream member accessors
-
-@property (NS_NONATOMIC_IPHONEONLY readwrite) Bytef * next_in;
-@property (NS_NONATOMIC_IPHONEONLY readwrite) uInt avail_in;
-@property (NS_NONATOMIC_IPHONEONLY readwrite) uLong total_in;
-
-@property (NS_NONATOMIC_IPHONEONLY readwrite) Bytef * next_out;
-@property (NS_NONATOMIC_IPHONEONLY readwrite) uInt avail_out;
-@property (NS_NONATOMIC_IPHONEONLY readwrite) uLong total_out;
-
-@property (NS_NONATOMIC_IPHONEONLY readonly) char * msg;
-
-/////////////////////////////////////////////////////////
-
 - (void) createRunloopSourceForStream: (id) stream;
 - (void) postStreamEvent: (NSStreamEvent) event;
 - (void) setStatusForStream: (NSStream *) stream;
 - (void) setZlibError: (int) error;
 
+// once all the input has been used, this starts filling the input buffer from the beginning again
+- (void) resetInputIfEmpty;
+
 /////////////////////////////////////////////////////////
 
 @property (nonatomic, readonly) NSInteger inputRoom;
@@ -114,4 +102,7 @@
 - (NSInteger) readOutputToBuffer: (void *) buffer length: (NSInteger) length;
 - (NSInteger) readOutputToStream: (NSOutputStream *) stream;
 
+// marks bytes at outputPtr as read, after they were used in place
+- (void) consumeOutput: (NSInteger) length;
+
 @end
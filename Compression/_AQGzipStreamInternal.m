@@ -37,37 +37,19 @@
  */
 
 #import "_AQGzipStreamInternal.h"
-#import <libkern/OSAtomic.h>
+#import "_AQGzipBufferPool.h"
 
 // this file implements the common parts of the gzip stream implementation
 // i.e. the _AQGzipStreamInternal class
 
-#if TARGET_OS_MAC
-# define ATOMIC_LOCK    OSSpinLockLock(&_lock)
-# define ATOMIC_UNLOCK  OSSpinLockUnlock(&_lock)
-# define ATOMIC_ZSTREAM_GET(val)                        \
-    OSSpinLockLock(&_lock);                             \
-    __typeof__(_zStream->val) result = _zStream->val;   \
-    OSSpinLockUnlock(&_lock);                           \
-    return ( result )
-# define ATOMIC_ZSTREAM_SET(val, nval)                  \
-    OSSpinLockLock(&_lock);                             \
-    _zStream->val = nval;                               \
-    OSSpinLockUnlock(&_lock)
-#else
-# define ATOMIC_LOCK
-# define ATOMIC_UNLOCK
-# define ATOMIC_ZSTREAM_GET(val) return ( _zStream->val )
-# define ATOMIC_ZSTREAM_SET(val, nval) _zStream->val = nval
-#endif
-
 #define DEFAULT_BUFFER_SIZE (1024)
 
 NSString * const AQZlibErrorDomain = @"AQZlibErrorDomain";
 
 NSError * CreateZlibError( z_stream *pZ, int err )
 {
-    NSString * desc = [[NSString alloc] initWithUTF8String: pZ->msg];
+    // zlib doesn't always supply a message
+    NSString * desc = [[NSString alloc] initWithUTF8String: (pZ->msg != NULL ? pZ->msg : zError(err))];
     NSDictionary * userInfo = [[NSDictionary alloc] initWithObjectsAndKeys: desc, NSLocalizedDescriptionKey, nil];
     
     NSError * result = [NSError errorWithDomain: AQZlibErrorDomain
@@ -110,6 +92,10 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
     return ( NULL );
 }
 
+@interface _AQGzipStreamInternal ()
+- (void) _advanceReadOffset: (NSInteger) length;
+@end
+
 #pragma mark -
 
 @implementation _AQGzipStreamInternal
@@ -136,22 +122,23 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
     
 #if TARGET_OS_IPHONE
     _zStream = NSZoneMalloc( [self zone], sizeof(z_stream) );
-    _input   = NSZoneMalloc( [self zone], _inputSize );
-    _output  = NSZoneMalloc( [self zone], _outputSize );
 #else
     _zStream = NSAllocateCollectable( sizeof(z_stream), 0 );
-    _input   = NSAllocateCollectable( _inputSize, 0 );
-    _output  = NSAllocateCollectable( _outputSize, 0 );
 #endif
     
+    // the buffers come from a shared pool, as does everything zlib allocates
+    _input   = AQGzipBufferPoolAlloc( _inputSize );
+    _output  = AQGzipBufferPoolAlloc( _outputSize );
+    
+    memset( _zStream, 0, sizeof(z_stream) );
     _zStream->next_in = _input;
     _zStream->avail_in = 0;
     _zStream->total_in = 0;
     _zStream->next_out = _output;
     _zStream->avail_out = _outputSize;
     _zStream->total_out = 0;
-    _zStream->zalloc = NULL;
-    _zStream->zfree = NULL;
+    _zStream->zalloc = AQGzipBufferPoolZalloc;
+    _zStream->zfree = AQGzipBufferPoolZfree;
     
     return ( self );
 }
@@ -168,8 +155,8 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
         (void) mach_port_deallocate( mach_task_self(), _port );
     
     NSZoneFree( [self zone], _zStream );
-    NSZoneFree( [self zone], _input   );
-    NSZoneFree( [self zone], _output  );
+    AQGzipBufferPoolFree( _input );
+    AQGzipBufferPoolFree( _output );
     
     [_error release];
     [super dealloc];
@@ -179,17 +166,20 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
 {
     if ( _port != MACH_PORT_NULL )
         (void) mach_port_deallocate( mach_task_self(), _port );
+    
+    // the pool's memory isn't collectable
+    AQGzipBufferPoolFree( _input );
+    AQGzipBufferPoolFree( _output );
+    
     [super finalize];
 }
 
 - (void) setInputSize: (NSInteger) inputSize
 {
+    // only set before opening, so there's nothing in the old buffer to keep
     _inputSize = inputSize;
-#if TARGET_OS_IPHONE
-    _input = NSZoneRealloc( [self zone], _input, inputSize );
-#else
-    _input = NSReallocateCollectable( _input, inputSize, 0 );
-#endif
+    AQGzipBufferPoolFree( _input );
+    _input = AQGzipBufferPoolAlloc( inputSize );
     
     _zStream->next_in = _input;
 }
@@ -197,11 +187,8 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
 - (void) setOutputSize: (NSInteger) outputSize
 {
     _outputSize = outputSize;
-#if TARGET_OS_IPHONE
-    _output = NSZoneRealloc( [self zone], _output, outputSize );
-#else
-    _output = NSReallocateCollectable( _output, outputSize, 0 );
-#endif
+    AQGzipBufferPoolFree( _output );
+    _output = AQGzipBufferPoolAlloc( outputSize );
     
     _zStream->next_out = _output;
     _zStream->avail_out = outputSize;
@@ -269,6 +256,15 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
     [self postStreamEvent: NSStreamEventErrorOccurred];
 }
 
+- (void) resetInputIfEmpty
+{
+    if ( _zStream->avail_in != 0 )
+        return;
+    
+    _zStream->next_in = _input;
+    _writeOffset = 0;
+}
+
 - (void) setStatusForStream: (NSStream *) stream
 {
     if ( _zStream->total_out > 0 )
@@ -285,73 +281,6 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
     }
 }
 
-#pragma mark z_stream data accessors
-
-- (Bytef *) next_in
-{
-    ATOMIC_ZSTREAM_GET(next_in);
-}
-
-- (void) setNext_in: (Bytef *) value
-{
-    ATOMIC_ZSTREAM_SET(next_in, value);
-}
-
-- (uInt) avail_in
-{
-    ATOMIC_ZSTREAM_GET(avail_in);
-}
-
-- (void) setAvail_in: (uInt) value
-{
-    ATOMIC_ZSTREAM_SET(avail_in, value);
-}
-
-- (uLong) total_in
-{
-    ATOMIC_ZSTREAM_GET(total_in);
-}
-
-- (void) setTotal_in: (uLong) value
-{
-    ATOMIC_ZSTREAM_SET(total_in, value);
-}
-
-- (Bytef *) next_out
-{
-    ATOMIC_ZSTREAM_GET(next_out);
-}
-
-- (void) setNext_out: (Bytef *) value
-{
-    ATOMIC_ZSTREAM_SET(next_out, value);
-}
-
-- (uInt) avail_out
-{
-    ATOMIC_ZSTREAM_GET(avail_out);
-}
-
-- (void) setAvail_out: (uInt) value
-{
-    ATOMIC_ZSTREAM_SET(avail_out, value);
-}
-
-- (uLong) total_out
-{
-    ATOMIC_ZSTREAM_GET(total_out);
-}
-
-- (void) setTotal_out: (uLong) value
-{
-    ATOMIC_ZSTREAM_SET(total_out, value);
-}
-
-- (char *) msg
-{
-    ATOMIC_ZSTREAM_GET(msg);
-}
-
 #pragma mark Read/Write Helpers
 
 - (NSInteger) inputRoom
@@ -376,61 +305,54 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
 
 - (NSInteger) writeInputFromBuffer: (const void *) buffer length: (NSInteger) length
 {
-    ATOMIC_LOCK;
-    
     NSInteger amountToCopy = MIN(self.inputRoom, length);
     memcpy( self.inputPtr, buffer, amountToCopy );
     _zStream->avail_in += amountToCopy;
     _writeOffset += amountToCopy;
     
-    ATOMIC_UNLOCK;
-    
     return ( amountToCopy );
 }
 
 - (NSInteger) writeInputFromStream: (NSInputStream *) stream
 {
-    ATOMIC_LOCK;
-    
     NSInteger amountRead = [stream read: (uint8_t *)self.inputPtr
                               maxLength: self.inputRoom];
-    _zStream->avail_in += amountRead;
-    _writeOffset += amountRead;
-    
-    ATOMIC_UNLOCK;
+    if ( amountRead > 0 )
+    {
+        _zStream->avail_in += amountRead;
+        _writeOffset += amountRead;
+    }
     
     return ( amountRead );
 }
 
 - (NSInteger) readOutputToBuffer: (void *) buffer length: (NSInteger) length
 {
-    ATOMIC_LOCK;
-    
     NSInteger amountToCopy = MIN(self.outputAvailable, length);
     memcpy( buffer, self.outputPtr, amountToCopy );
-    _readOffset += amountToCopy;
-    
-    if ( _readOffset == _zStream->total_out )
-    {
-        // reset output buffer
-        _zStream->next_out = _output;
-        _zStream->avail_out = _outputSize;
-        _zStream->total_out = 0;
-        _readOffset = 0;
-    }
-    
-    ATOMIC_UNLOCK;
+    [self _advanceReadOffset: amountToCopy];
     
     return ( amountToCopy );
 }
 
 - (NSInteger) readOutputToStream: (NSOutputStream *) stream
 {
-    ATOMIC_LOCK;
-    
     NSInteger amountWritten = [stream write: (const uint8_t *)self.outputPtr
                                   maxLength: self.outputAvailable];
-    _readOffset += amountWritten;
+    if ( amountWritten > 0 )
+        [self _advanceReadOffset: amountWritten];
+    
+    return ( amountWritten );
+}
+
+- (void) consumeOutput: (NSInteger) length
+{
+    [self _advanceReadOffset: MIN(self.outputAvailable, length)];
+}
+
+- (void) _advanceReadOffset: (NSInteger) length
+{
+    _readOffset += length;
     
     if ( _readOffset == _zStream->total_out )
     {
@@ -440,10 +362,6 @@ static void * __AQGzipPerform( void * msg, CFIndex size, CFAllocatorRef allocato
         _zStream->total_out = 0;
         _readOffset = 0;
     }
-    
-    ATOMIC_UNLOCK;
-    
-    return ( amountWritten );
 }
 
 @end
@@ -39,11 +39,58 @@
 #import <Foundation/Foundation.h>
 #import "iPhoneNonatomic.h"
 
-@class _AQXMLParserInternal;
+@class _AQXMLParserInternal, AQXMLParser, AQXMLParserStatistics, AQXMLParserCheckpoint;
 @protocol AQXMLParserDelegate, AQXMLParserProgressDelegate;
 
 extern NSString * const AQXMLParserParsingRunLoopMode;
 
+// the domain of the error reported when one of the parser's limits is exceeded
+extern NSString * const AQXMLParserLimitErrorDomain;
+
+enum
+{
+	AQXMLParserTextNodeTooLongError		= 1,
+	AQXMLParserElementsTooDeepError		= 2,
+	AQXMLParserDocumentTooLongError		= 3
+	
+};
+
+// A read-only view of the attributes of a start tag, passed to
+//  -parser:didStartElement:namespaceURI:qualifiedName:attributeCursor:
+// It looks directly at the parser's own data, so strings are only created for the attributes
+//  you actually ask about. The cursor is only valid until that delegate method returns; use
+//  -copy if you need to keep it around for longer.
+// Namespace declarations are not included: they're reported through
+//  -parser:didStartMappingPrefix:toURI:.
+@interface AQXMLAttributeCursor : NSObject <NSCopying>
+{
+	AQXMLParser * __weak    _parser;        // nil once copied
+	const unsigned char **  _attributes;
+	NSUInteger              _count;
+	NSUInteger              _stride;
+	void *                  _storage;
+}
+
+@property (nonatomic, readonly) NSUInteger count;
+
+// these raise an NSRangeException if index is beyond the end of the cursor
+- (NSString *) nameAtIndex: (NSUInteger) index;             // qualified name, i.e. 'prefix:localName'
+- (NSString *) localNameAtIndex: (NSUInteger) index;
+- (NSString *) namespaceURIAtIndex: (NSUInteger) index;
+- (NSString *) valueAtIndex: (NSUInteger) index;
+
+// returns the UTF-8 value of an attribute, which is NOT NUL-terminated
+- (const char *) valueBytesAtIndex: (NSUInteger) index length: (NSUInteger *) length;
+
+// lookup by qualified name; returns NSNotFound/nil if there's no such attribute
+- (NSUInteger) indexOfAttributeWithName: (NSString *) qualifiedName;
+- (NSString *) valueForAttributeWithName: (NSString *) qualifiedName;
+
+// qualified names mapped to values, as passed to -parser:didStartElement:...attributes:
+- (NSDictionary *) attributeDictionary;
+
+@end
+
 // delegates should implement the same functions used by AQXMLParser
 
 @interface AQXMLParser : NSObject <NSStreamDelegate>
@@ -61,6 +108,14 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 
 - (id) initWithData: (NSData *) data;   // creates a stream from the data
 
+// Parses a local file by mapping it into memory a window at a time and handing the mapped
+//  pages straight to libxml2, rather than copying them out through a stream. Each window is
+//  unmapped once it has been parsed, so only a few megabytes of even a very large file are
+//  resident at once. Returns nil if the file can't be opened.
+// Such a parser can be used with -parse and -parseAsynchronouslyUsingRunLoop:..., but not
+//  with -parseInBackgroundDeliveringEventsToThread:...
+- (id) initWithContentsOfMappedFile: (NSString *) path;
+
 @property (NS_NONATOMIC_IPHONEONLY assign) id<AQXMLParserDelegate> __weak delegate;
 @property (NS_NONATOMIC_IPHONEONLY assign) id<AQXMLParserProgressDelegate> __weak progressDelegate;
 
@@ -69,9 +124,93 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 @property (NS_NONATOMIC_IPHONEONLY assign) BOOL shouldResolveExternalEntities;
 @property (NS_NONATOMIC_IPHONEONLY assign, getter=isInHTMLMode) BOOL HTMLMode;
 
+// when set, character data is accumulated internally and handed to the delegate once per
+//  text node, when the next element boundary (or comment, PI, etc.) is reached, rather than
+//  once per chunk handed up by libxml2. See -parser:foundCharacterBytes:length: below.
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL shouldBufferCharacters;
+
+// the number of bytes requested from the input stream on each read. Defaults to 64KB.
+// Ignored when the stream can hand over its own buffer (see AQXMLParserBufferedInputStream below).
+// For mapped files, this is the amount of the mapped data passed to libxml2 at a time.
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger readBufferSize;
+
+// when set (the default) the character reference "&#x13;", which libxml2 rejects, is
+//  replaced in the input with the same number of harmless characters. Matches which
+//  straddle two reads are handled.
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL shouldFilterControlCharacterReferences;
+
+// Restricts the events sent to the delegate to those for elements matching one of the given
+//  paths, and everything inside them. Paths take the forms '/feed/entry/id', '//entry/id',
+//  '/feed/*/id' or '/atom:feed/atom:entry'. No strings are created for elements outside the
+//  matching paths. Document events and errors are always sent. In HTML mode, element names
+//  in paths are matched regardless of case.
+// Returns NO if any path is invalid, or if parsing has already begun.
+- (BOOL) setPathFilter: (NSArray *) paths error: (NSError **) error;
+- (NSArray *) pathFilter;
+
+// In HTML mode, restricts element, character and similar events to elements with the given tag
+//  names and everything inside them. Other markup is still parsed by libxml2, but no strings
+//  or attribute dictionaries are created for it. Names are matched case-insensitively. When
+//  combined with a path filter, only events passing both are sent. Defaults to nil, which
+//  sends everything; it can't be changed once parsing has begun, and is ignored for XML.
+@property (NS_NONATOMIC_IPHONEONLY copy) NSSet * HTMLTagWhitelist;
+
+// The progress delegate is sent no more than one update every progressUpdateInterval seconds
+//  (default 0.1), and only once at least progressUpdateByteCount more bytes (default 16KB)
+//  have been read. A final update of 1.0 is sent when the input ends.
+@property (NS_NONATOMIC_IPHONEONLY assign) NSTimeInterval progressUpdateInterval;
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger progressUpdateByteCount;
+
+// When set before parsing begins, the parser keeps count of what it's doing, and how long it
+//  spends doing it. When not set, the only cost is a pointer check when creating strings.
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL collectsStatistics;
+
+// a snapshot of the statistics collected so far, or nil if they're not being collected
+@property (nonatomic, readonly) AQXMLParserStatistics * statistics;
+
+// When non-zero, a checkpoint is taken each time an element at this depth ends, where the root
+//  element is at depth 1. For a feed of <entry> elements inside a root element, use 2.
+// Must be set before parsing begins; XML only.
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger checkpointDepth;
+
+// the most recent checkpoint, or nil if none has been taken yet
+@property (nonatomic, readonly) AQXMLParserCheckpoint * lastCheckpoint;
+
+// Set before parsing to carry on from where an earlier parse left off. The stream must begin
+//  at the checkpoint's byteOffset, e.g. by requesting a byte range of the original resource.
+// The elements which were open at the checkpoint are re-opened without the delegate being
+//  told, so the next thing it sees is whatever followed the checkpoint in the document.
+@property (NS_NONATOMIC_IPHONEONLY retain) AQXMLParserCheckpoint * resumeCheckpoint;
+
+// Limits on the resources a single document can use, guarding against huge or malicious input:
+//  the number of bytes in a run of character data, the depth to which elements can be nested,
+//  and the total number of bytes parsed. Zero, the default, means no limit. When one is
+//  exceeded parsing stops, and parserError is set to an error in AQXMLParserLimitErrorDomain,
+//  which is also sent to the delegate's -parser:parseErrorOccurred:.
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger maxTextNodeLength;
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger maxElementDepth;
+@property (NS_NONATOMIC_IPHONEONLY assign) unsigned long long maxDocumentLength;
+
+// Lets a delegate which can't keep up stop the parser reading any more input until it's ready,
+//  rather than having it pile up in memory. Input already read is still parsed. These must be
+//  called on the thread receiving delegate messages, and have no effect on a mapped file
+//  being parsed by -parse.
+- (void) pauseReading;
+- (void) resumeReading;
+@property (nonatomic, readonly, getter=isReadingPaused) BOOL readingPaused;
+
 - (BOOL) parse;
 - (void) abortParsing;
 
+// Prepares the parser to parse another document, so one parser can handle many in turn. In XML
+//  mode libxml2's context is reset rather than recreated, keeping its name dictionary, as are
+//  the SAX handler and the parser's own buffers, so per-document setup costs almost nothing.
+// The delegate and settings are kept, though those which can only be changed before parsing
+//  begins stay fixed. Errors, checkpoints, statistics and any resumeCheckpoint are cleared.
+// Returns NO if a parse is still in progress.
+- (BOOL) resetWithStream: (NSInputStream *) stream;
+- (BOOL) resetWithData: (NSData *) data;
+
 // asynchronous parsing on the given runloop/mode
 // completionSelector should match the following structure:
 // - (void) xmlParser: (AQXMLParser *) parser completedOK: (BOOL) parsedOK context: (void *) context;
@@ -94,6 +233,29 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 @property (NS_NONATOMIC_IPHONEONLY assign) BOOL debugLogInput;
 @end
 
+@interface AQXMLParser (AQXMLParserBackgroundParsing)
+
+// Parses using two private threads: one reads the input stream into a bounded queue of
+//  chunks, the other runs libxml2 over those chunks. Delegate messages are collected into
+//  batches and performed, in order, on targetThread (the current thread if nil), which must
+//  be running its runloop in the common modes or AQXMLParserParsingRunLoopMode.
+// The completion selector is as for -parseAsynchronouslyUsingRunLoop:..., and is called on
+//  targetThread once every delegate message has been delivered.
+// -parser:foundCharacterBytes:length: is delivered with a copy of the bytes, and
+//  -parser:resolveExternalEntityName:systemID: is performed synchronously on targetThread.
+- (BOOL) parseInBackgroundDeliveringEventsToThread: (NSThread *) targetThread
+                                 notifyingDelegate: (id) asyncCompletionDelegate
+                                          selector: (SEL) completionSelector
+                                           context: (void *) contextPtr;
+
+// the number of chunks read from the stream which may be waiting to be parsed (default 8)
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger maxQueuedChunks;
+
+// the number of delegate messages collected before they're sent to the target thread (default 64)
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger eventBatchSize;
+
+@end
+
 @class HTTPMessage;
 
 @interface AQXMLParser (AQXMLParserHTTPStreamAdditions)
@@ -101,11 +263,77 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 @property (nonatomic, readonly) HTTPMessage * finalResponse;
 @end
 
+// Input streams which can expose their internal buffer directly can implement this, allowing
+//  the parser to hand that buffer straight to libxml2 without copying it out through
+//  -read:maxLength:. After parsing the bytes returned from -getBuffer:length: the parser calls
+//  -consumeBufferedBytes: to tell the stream how much of that buffer it has used.
+@protocol AQXMLParserBufferedInputStream <NSObject>
+- (BOOL) getBuffer: (uint8_t **) buffer length: (NSUInteger *) len;
+- (void) consumeBufferedBytes: (NSUInteger) length;
+@end
+
+// The position just after an element at the parser's checkpointDepth ended, along with the
+//  elements which were still open there. Checkpoints can be archived.
+// The offset counts the bytes of the XML itself, so for compressed input it's an offset into
+//  the decompressed data. Documents must be in an ASCII-compatible encoding to be resumed, and
+//  DTDs and entity declarations aren't carried over.
+@interface AQXMLParserCheckpoint : NSObject <NSCoding>
+{
+	unsigned long long  _byteOffset;
+	NSArray *           _openElements;
+	NSString *          _encoding;
+}
+
+@property (nonatomic, readonly) unsigned long long byteOffset;
+
+// qualified names of the elements still open, outermost first
+@property (nonatomic, readonly) NSArray * elementPath;
+
+@end
+
+@interface AQXMLParserStatistics : NSObject
+{
+	unsigned long long  _bytesPushed;
+	NSUInteger          _parseChunkCalls;
+	NSUInteger          _elementCount;
+	NSUInteger          _characterCallbackCount;
+	NSUInteger          _attributeCount;
+	NSUInteger          _stringsAllocated;
+	NSTimeInterval      _libxml2Time;
+	NSTimeInterval      _callbackTime;
+	NSUInteger          _peakElementDepth;
+}
+
+// bytes handed to libxml2, and the number of xmlParseChunk() calls used to do so
+@property (nonatomic, readonly) unsigned long long bytesPushed;
+@property (nonatomic, readonly) NSUInteger parseChunkCalls;
+
+@property (nonatomic, readonly) NSUInteger elementCount;
+@property (nonatomic, readonly) NSUInteger characterCallbackCount;
+@property (nonatomic, readonly) NSUInteger attributeCount;
+@property (nonatomic, readonly) NSUInteger stringsAllocated;
+
+// time spent inside libxml2 itself, and in the SAX callbacks, which includes creating the
+//  objects sent to the delegate as well as the delegate methods themselves
+@property (nonatomic, readonly) NSTimeInterval libxml2Time;
+@property (nonatomic, readonly) NSTimeInterval callbackTime;
+
+@property (nonatomic, readonly) NSUInteger peakElementDepth;
+
+@end
+
 // parser reports progress as a value between 0.0 and 1.0
 @protocol AQXMLParserProgressDelegate <NSObject>
 - (void) parser: (AQXMLParser *) parser updateProgress: (float) progress;
 @end
 
+// Input streams which decompress their data (such as AQGzipInputStream) can implement this,
+//  in which case progress is measured by the amount of compressed data they've consumed,
+//  since that's what any expected length (i.e. Content-Length) refers to.
+@protocol AQXMLParserProgressSource <NSObject>
+- (unsigned long long) compressedBytesRead;
+@end
+
 // tweaked versions of the delegate functions, accepting AQXMLParser instead of NSXMLParser (gets rid of compiler warnings)
 
 /*
@@ -154,6 +382,10 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 //    elementName == radar, namespaceURI == http://xml.apple.com/radar, qualifiedName == radar:radar
 // If namespace processing >isn't< on, the xmlns:radar="http://xml.apple.com/radar" is returned as an attribute pair, the elementName is 'radar:radar' and there is no qualifiedName.
 
+- (void)parser:(AQXMLParser *)parser didStartElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName attributeCursor:(AQXMLAttributeCursor *)attributes;
+// Used in preference to the method above, if implemented. No attribute dictionary is built; instead the cursor provides access to the attributes
+//  in place, and is only valid until this method returns.
+
 - (void)parser:(AQXMLParser *)parser didEndElement:(NSString *)elementName namespaceURI:(NSString *)namespaceURI qualifiedName:(NSString *)qName;
 // sent when an end tag is encountered. The various parameters are supplied as above.
 
@@ -168,6 +400,10 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 - (void)parser:(AQXMLParser *)parser foundCharacters:(NSString *)string;
 // This returns the string of the characters encountered thus far. You may not necessarily get the longest character run. The parser reserves the right to hand these to the delegate as potentially many calls in a row to -parser:foundCharacters:
 
+- (void)parser:(AQXMLParser *)parser foundCharacterBytes:(const char *)bytes length:(NSUInteger)length;
+// Only sent when shouldBufferCharacters is enabled, in which case it is used in preference to -parser:foundCharacters:.
+// The bytes are the complete UTF-8 contents of a text node. They point into a buffer owned by the parser, and are only valid until this method returns.
+
 - (void)parser:(AQXMLParser *)parser foundIgnorableWhitespace:(NSString *)whitespaceString;
 // The parser reports ignorable whitespace in the same way as characters it's found.
 
@@ -188,4 +424,8 @@ extern NSString * const AQXMLParserParsingRunLoopMode;
 
 - (void)parser:(AQXMLParser *)parser validationErrorOccurred:(NSError *)validationError;
 // If validation is on, this will report a fatal validation error to the delegate. The parser will stop parsing.
+
+- (void)parser:(AQXMLParser *)parser didReachCheckpoint:(AQXMLParserCheckpoint *)checkpoint;
+// Sent after the end of each element at the parser's checkpointDepth has been reported. If you're going to resume from the
+//  checkpoint later, this is the time to save any state of your own to go with it.
 @end
@@ -41,6 +41,8 @@
 #import "AQXMLParser.h"
 #import "AQXMLParserInternal.h"
 
+#import "AQXMLParserWorker.h"
+#import "AQXMLPathFilter.h"
 #import "NSStream+HTTPMessage.h"
 
 #import <libxml/parser.h>
@@ -51,6 +53,13 @@
 #import <libxml/encoding.h>
 #import <libxml/entities.h>
 
+#import <objc/runtime.h>
+#import <mach/mach_time.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <fcntl.h>
+#import <unistd.h>
+
 #if TARGET_OS_IPHONE
 # import <CFNetwork/CFNetwork.h>
 #else
@@ -60,12 +69,29 @@
 #define AUTO_DEBUG_LOG_INPUT 0
 
 NSString * const AQXMLParserParsingRunLoopMode = @"AQXMLParserParsingRunLoopMode";
+NSString * const AQXMLParserLimitErrorDomain = @"AQXMLParserLimitErrorDomain";
+
+#define DEFAULT_READ_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_MAX_QUEUED_CHUNKS (8)
+#define DEFAULT_EVENT_BATCH_SIZE (64)
+#define DEFAULT_PROGRESS_INTERVAL (0.1)
+#define DEFAULT_PROGRESS_BYTE_COUNT (16 * 1024)
+
+// the amount of a mapped file which is mapped at once; must be a multiple of the page size
+#define MAPPED_WINDOW_SIZE (8 * 1024 * 1024)
+
+// libxml2 chokes on this character reference, so we swap it for something of the same length
+static const char __controlRefPattern[]		= "&#x13;";
+static const char __controlRefReplacement[]	= "[ARGH]";
+#define CONTROL_REF_LENGTH	(sizeof(__controlRefPattern) - 1)
 
 enum
 {
 	AQXMLParserShouldProcessNamespaces	= 1<<0,
 	AQXMLParserShouldReportPrefixes		= 1<<1,
 	AQXMLParserShouldResolveExternals	= 1<<2,
+	AQXMLParserShouldBufferCharacters	= 1<<3,
+	AQXMLParserShouldFilterControlRefs	= 1<<4,
     
     // most significant bit indicates HTML mode
     AQXMLParserHTMLMode                 = 1<<31
@@ -74,16 +100,48 @@ enum
 
 @interface AQXMLParser (Internal)
 - (void) _setParserError: (int) err;
+- (void) _limitExceeded: (NSInteger) code;
 - (xmlParserCtxtPtr) _xmlParserContext;
 - (htmlParserCtxtPtr) _htmlParserContext;
 - (void) _pushNamespaces: (NSDictionary *) nsDict;
 - (void) _popNamespaces;
 - (void) _initializeSAX2Callbacks;
-- (void) _initializeParserWithBytes: (const void *) buf length: (NSUInteger) length;
+- (void) _resolveDelegateCapabilities;
+- (BOOL) _initializeParserWithBytes: (const void *) buf length: (NSUInteger) length;
+- (void) _resumeFromCheckpoint: (AQXMLParserCheckpoint *) checkpoint;
 - (void) _pushXMLData: (const void *) bytes length: (NSUInteger) length;
+- (void) _pushStreamData: (const uint8_t *) bytes length: (NSUInteger) length;
+- (void) _flushFilterCarry;
+- (void) _finishParsing;
+- (void) _reportStreamError: (NSError *) error;
+- (void) _backgroundParseFinished;
 - (_AQXMLParserInternal *) _info;
 - (void) _setStreamComplete: (BOOL) parsedOK;
-- (void) _setupExpectedLength;
+- (float) _expectedLengthOfStream;
+- (void) _updateProgressWithLength: (NSUInteger) length;
+- (void) _updateProgressWithLength: (NSUInteger) length streamPosition: (float) position expectedLength: (float) expected;
+- (void) _sendProgress: (float) progress;
+- (BOOL) _parseMappedFile;
+- (BOOL) _pushNextMappedSlice;
+- (void) _parseMappedSlices;
+- (void) _unmapWindow;
+- (void) _closeMappedFile;
+- (void) _readPausedStream;
+@end
+
+@interface AQXMLParserStatistics (Internal)
+- (id) _initWithCounters: (const AQXMLParserCounters *) counters;
+@end
+
+@interface AQXMLParserCheckpoint (Internal)
+- (id) _initWithOffset: (unsigned long long) offset openElements: (NSArray *) openElements encoding: (NSString *) encoding;
+- (NSArray *) _openElements;
+- (NSString *) _encoding;
+@end
+
+@interface AQXMLAttributeCursor (Internal)
+- (void) _setParser: (AQXMLParser *) parser attributes: (const xmlChar **) attributes
+			  count: (NSUInteger) count stride: (NSUInteger) stride;
 @end
 
 #pragma mark -
@@ -98,6 +156,180 @@ static inline NSString * NSStringFromXmlChar( const xmlChar * ch )
 												 encoding: NSUTF8StringEncoding] );
 }
 
+// signatures of the delegate methods we cache implementations for
+typedef void (*AQFoundCharactersIMP)(id, SEL, AQXMLParser *, NSString *);
+typedef void (*AQFoundCharacterBytesIMP)(id, SEL, AQXMLParser *, const char *, NSUInteger);
+typedef void (*AQDidStartElementIMP)(id, SEL, AQXMLParser *, NSString *, NSString *, NSString *, NSDictionary *);
+typedef void (*AQDidEndElementIMP)(id, SEL, AQXMLParser *, NSString *, NSString *, NSString *);
+typedef void (*AQDidStartElementCursorIMP)(id, SEL, AQXMLParser *, NSString *, NSString *, NSString *, AQXMLAttributeCursor *);
+
+static inline BOOL DelegateImplements( AQXMLParser * parser, NSUInteger flag )
+{
+	return ( ([parser _info]->delegateFlags & flag) == flag );
+}
+
+// the object to which delegate messages are sent: normally the delegate itself, but when
+//  parsing in the background this is a proxy which batches them up for the target thread
+static inline id<AQXMLParserDelegate> EventTarget( AQXMLParser * parser )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	if ( info->eventProxy != nil )
+		return ( info->eventProxy );
+	return ( parser.delegate );
+}
+
+// counts strings created for the delegate, when collecting statistics
+#define CountStrings(parser, n) \
+	do { AQXMLParserCounters * __c = [(parser) _info]->counters; if ( __c != NULL ) __c->stringsAllocated += (n); } while (0)
+
+// YES if we're outside every whitelisted HTML tag, or a path filter is in use and we're not
+//  inside anything it matched
+static inline BOOL FilterRejects( AQXMLParser * parser )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	if ( (info->whitelistNames != NULL) && (info->whitelistDepth == 0) )
+		return ( YES );
+	
+	_AQXMLPathFilter * filter = info->pathFilter;
+	return ( (filter != nil) && (AQXMLPathFilterIsMatching(filter) == NO) );
+}
+
+// Tracks the HTML tag whitelist, returning YES if events for the element should be passed on.
+// The HTML parser closes any implied end tags itself, so starts & ends always balance.
+static BOOL WhitelistStartElement( _AQXMLParserInternal * info, const xmlChar * name )
+{
+	if ( info->whitelistNames == NULL )
+		return ( YES );
+	
+	if ( info->whitelistDepth != 0 )
+	{
+		info->whitelistDepth++;
+		return ( YES );
+	}
+	
+	NSUInteger i;
+	for ( i = 0; i < info->whitelistCount; i++ )
+	{
+		if ( xmlStrcasecmp(info->whitelistNames[i], name) == 0 )
+		{
+			info->whitelistDepth = 1;
+			return ( YES );
+		}
+	}
+	
+	return ( NO );
+}
+
+static BOOL WhitelistEndElement( _AQXMLParserInternal * info )
+{
+	if ( info->whitelistNames == NULL )
+		return ( YES );
+	
+	if ( info->whitelistDepth == 0 )
+		return ( NO );
+	
+	info->whitelistDepth--;
+	return ( YES );
+}
+
+// Called at each element boundary, which ends any run of character data. Returns NO if the
+//  element takes us beyond the depth limit, in which case parsing has been stopped.
+static BOOL EnterElementWithinLimits( AQXMLParser * parser )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	info->textNodeLength = 0;
+	
+	if ( (info->maxElementDepth == 0) || (++info->limitDepth <= info->maxElementDepth) )
+		return ( YES );
+	
+	[parser _limitExceeded: AQXMLParserElementsTooDeepError];
+	return ( NO );
+}
+
+static inline void LeaveElementWithinLimits( _AQXMLParserInternal * info )
+{
+	info->textNodeLength = 0;
+	if ( info->limitDepth != 0 )
+		info->limitDepth--;
+}
+
+// the names are compared against libxml2's own, so they're kept as UTF-8
+static void CompileWhitelistNames( _AQXMLParserInternal * info )
+{
+	info->whitelistDepth = 0;
+	if ( (info->whitelistNames != NULL) || (info->tagWhitelist == nil) )
+		return;
+	
+	info->whitelistNames = malloc( [info->tagWhitelist count] * sizeof(xmlChar *) );
+	for ( NSString * tag in info->tagWhitelist )
+	{
+		info->whitelistNames[info->whitelistCount++] = xmlStrdup( (const xmlChar *) [[tag lowercaseString] UTF8String] );
+	}
+}
+
+static void FreeWhitelistNames( _AQXMLParserInternal * info )
+{
+	if ( info->whitelistNames == NULL )
+		return;
+	
+	NSUInteger i;
+	for ( i = 0; i < info->whitelistCount; i++ )
+		xmlFree( info->whitelistNames[i] );
+	free( info->whitelistNames );
+	
+	info->whitelistNames = NULL;
+	info->whitelistCount = 0;
+}
+
+// libxml2 interns element & attribute names in the parser context's dictionary, so a
+//  given name is always handed to us through the same pointer. We use that pointer as a
+//  key to return a single cached NSString for each distinct name.
+// Unlike NSStringFromXmlChar(), the result is NOT owned by the caller.
+static NSString * InternedNSStringFromXmlChar( AQXMLParser * parser, const xmlChar * ch )
+{
+	if ( ch == NULL )
+		return ( nil );
+	
+	_AQXMLParserInternal * info = [parser _info];
+	NSString * result = (NSString *) CFDictionaryGetValue( info->internedNames, ch );
+	if ( result != nil )
+		return ( result );
+	
+	result = NSStringFromXmlChar( ch );
+	CountStrings( parser, 1 );
+	
+	xmlParserCtxtPtr p = info->parserContext;
+	if ( (p != NULL) && (p->dict != NULL) && (xmlDictOwns(p->dict, ch) == 1) )
+	{
+		CFDictionarySetValue( info->internedNames, ch, result );
+		[result release];
+	}
+	else
+	{
+		// not a dictionary string, so its address can't be used as a key
+		[result autorelease];
+	}
+	
+	return ( result );
+}
+
+// returns the interned 'prefix:localname' string, or the interned localname if there's no prefix
+static NSString * InternedQualifiedName( AQXMLParser * parser, const xmlChar * prefix, const xmlChar * localname )
+{
+	if ( (prefix == NULL) || (*prefix == '\0') )
+		return ( InternedNSStringFromXmlChar(parser, localname) );
+	
+	xmlParserCtxtPtr p = [parser _xmlParserContext];
+	if ( (p != NULL) && (p->dict != NULL) )
+	{
+		const xmlChar * qname = xmlDictQLookup( p->dict, prefix, localname );
+		if ( qname != NULL )
+			return ( InternedNSStringFromXmlChar(parser, qname) );
+	}
+	
+	return ( [NSString stringWithFormat: @"%s:%s", prefix, localname] );
+}
+
 static inline NSString * AttributeTypeString( int type )
 {
 #define TypeCracker(t) case XML_ATTRIBUTE_ ## t: return @#t
@@ -165,6 +397,52 @@ static xmlParserInputPtr __resolveEntity( void * ctx, const xmlChar * publicId,
 	return ( xmlSAX2ResolveEntity(p, publicId, systemId) );
 }
 
+// hands any buffered character data to the delegate as a single text node
+static void __flushCharacters( AQXMLParser * parser )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	if ( info->characterBufferLength == 0 )
+		return;
+	
+	NSUInteger length = info->characterBufferLength;
+	info->characterBufferLength = 0;
+	
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
+	if ( info->foundCharacterBytesIMP != NULL )
+	{
+		((AQFoundCharacterBytesIMP)info->foundCharacterBytesIMP)( delegate, @selector(parser:foundCharacterBytes:length:),
+																  parser, (const char *)info->characterBuffer, length );
+	}
+	else if ( info->foundCharactersIMP != NULL )
+	{
+		NSString * str = [[NSString allocWithZone: nil] initWithBytes: info->characterBuffer
+															   length: length
+															 encoding: NSUTF8StringEncoding];
+		CountStrings( parser, 1 );
+		((AQFoundCharactersIMP)info->foundCharactersIMP)( delegate, @selector(parser:foundCharacters:), parser, str );
+		[str release];
+	}
+}
+
+static void __bufferCharacters( AQXMLParser * parser, const xmlChar * ch, int len )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	NSUInteger required = info->characterBufferLength + len;
+	
+	if ( required > info->characterBufferCapacity )
+	{
+		NSUInteger capacity = MAX(info->characterBufferCapacity * 2, 1024);
+		while ( capacity < required )
+			capacity *= 2;
+		
+		info->characterBuffer = realloc( info->characterBuffer, capacity );
+		info->characterBufferCapacity = capacity;
+	}
+	
+	memcpy( info->characterBuffer + info->characterBufferLength, ch, len );
+	info->characterBufferLength = required;
+}
+
 static void __characters( void * ctx, const xmlChar * ch, int len )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
@@ -176,14 +454,34 @@ static void __characters( void * ctx, const xmlChar * ch, int len )
 		return;
 	}
 	
-	id<AQXMLParserDelegate> delegate = parser.delegate;
-	if ( [delegate respondsToSelector: @selector(parser:foundCharacters:)] == NO )
+	_AQXMLParserInternal * info = [parser _info];
+	if ( info->maxTextNodeLength != 0 )
+	{
+		info->textNodeLength += len;
+		if ( info->textNodeLength > info->maxTextNodeLength )
+		{
+			[parser _limitExceeded: AQXMLParserTextNodeTooLongError];
+			return;
+		}
+	}
+	
+	if ( FilterRejects(parser) )
+		return;
+	
+	if ( [parser shouldBufferCharacters] )
+	{
+		__bufferCharacters( parser, ch, len );
+		return;
+	}
+	
+	if ( info->foundCharactersIMP == NULL )
 		return;
 	
 	NSString * str = [[NSString allocWithZone: nil] initWithBytes: ch
 														   length: len
 														 encoding: NSUTF8StringEncoding];
-	[delegate parser: parser foundCharacters: str];
+	CountStrings( parser, 1 );
+	((AQFoundCharactersIMP)info->foundCharactersIMP)( EventTarget(parser), @selector(parser:foundCharacters:), parser, str );
 	[str release];
 }
 
@@ -199,7 +497,7 @@ static void __entityDecl( void * ctx, const xmlChar * name, int type, const xmlC
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
 	xmlParserCtxtPtr p = [parser _xmlParserContext];
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
 	xmlSAX2EntityDecl( p, name, type, publicId, systemId, content );
 	
@@ -208,12 +506,12 @@ static void __entityDecl( void * ctx, const xmlChar * name, int type, const xmlC
 	
 	if ( [contentStr length] != 0 )
 	{
-		if ( [delegate respondsToSelector: @selector(parser:foundInternalEntityDeclarationWithName:value:)] )
+		if ( DelegateImplements(parser, AQXMLDelegateFoundInternalEntityDecl) )
 			[delegate parser: parser foundInternalEntityDeclarationWithName: nameStr value: contentStr];
 	}
 	else if ( [parser shouldResolveExternalEntities] )
 	{
-		if ( [delegate respondsToSelector: @selector(parser:foundExternalEntityDeclarationWithName:publicID:systemID:)] )
+		if ( DelegateImplements(parser, AQXMLDelegateFoundExternalEntityDecl) )
 		{
 			NSString * publicIDStr = NSStringFromXmlChar(publicId);
 			NSString * systemIDStr = NSStringFromXmlChar(systemId);
@@ -234,9 +532,9 @@ static void __attributeDecl( void * ctx, const xmlChar * elem, const xmlChar * f
 							 const xmlChar * defaultValue, xmlEnumerationPtr tree )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundAttributeDeclarationWithName:forElement:type:defaultValue:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateFoundAttributeDecl) == NO )
 		return;
 	
 	NSString * elemStr = NSStringFromXmlChar(elem);
@@ -254,9 +552,9 @@ static void __attributeDecl( void * ctx, const xmlChar * elem, const xmlChar * f
 static void __elementDecl( void * ctx, const xmlChar * name, int type, xmlElementContentPtr content )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundElementDeclarationWithName:model:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateFoundElementDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -267,9 +565,9 @@ static void __elementDecl( void * ctx, const xmlChar * name, int type, xmlElemen
 static void __notationDecl( void * ctx, const xmlChar * name, const xmlChar * publicId, const xmlChar * systemId )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundNotationDeclarationWithName:publicID:systemID:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateFoundNotationDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -289,11 +587,11 @@ static void __unparsedEntityDecl( void * ctx, const xmlChar * name, const xmlCha
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
 	xmlParserCtxtPtr p = [parser _xmlParserContext];
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
 	xmlSAX2UnparsedEntityDecl( p, name, publicId, systemId, notationName );
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundUnparsedEntityDeclarationWithName:publicID:systemID:notationName:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateFoundUnparsedEntityDecl) == NO )
 		return;
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -310,12 +608,8 @@ static void __unparsedEntityDecl( void * ctx, const xmlChar * name, const xmlCha
 	[notationNameStr release];
 }
 
-static void __startDocument( void * ctx )
+static void __setUpDocument( xmlParserCtxtPtr p )
 {
-	AQXMLParser * parser = (AQXMLParser *) ctx;
-	xmlParserCtxtPtr p = [parser _xmlParserContext];
-	id<AQXMLParserDelegate> delegate = parser.delegate;
-	
 	const char * encoding = (const char *) p->encoding;
 	if ( encoding == NULL )
 		encoding = (const char *) p->input->encoding;
@@ -324,8 +618,16 @@ static void __startDocument( void * ctx )
 		xmlSwitchEncoding( p, xmlParseCharEncoding(encoding) );
 	
 	xmlSAX2StartDocument( p );
+}
+
+static void __startDocument( void * ctx )
+{
+	AQXMLParser * parser = (AQXMLParser *) ctx;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parserDidStartDocument:)] == NO )
+	__setUpDocument( [parser _xmlParserContext] );
+	
+	if ( DelegateImplements(parser, AQXMLDelegateDidStartDocument) == NO )
 		return;
 	
 	[delegate parserDidStartDocument: parser];
@@ -334,9 +636,10 @@ static void __startDocument( void * ctx )
 static void __endDocument( void * ctx )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	__flushCharacters( parser );
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parserDidEndDocument:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateDidEndDocument) == NO )
 		return;
 	
 	[delegate parserDidEndDocument: parser];
@@ -345,58 +648,49 @@ static void __endDocument( void * ctx )
 static void __endElementNS( void * ctx, const xmlChar * localname, const xmlChar * prefix, const xmlChar * URI )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
-	
-	NSString * prefixStr = nil;
-	
-	if ( [parser shouldProcessNamespaces] )
-		prefixStr = NSStringFromXmlChar(prefix);
-	
-	NSString * localnameStr = NSStringFromXmlChar(localname);
-	
-	NSString * completeStr = nil;
-	if ( [prefixStr length] != 0 )
-		completeStr = [[NSString alloc] initWithFormat: @"%@:%@", prefixStr, localnameStr];
-	else
-		completeStr = [localnameStr retain];
+	_AQXMLParserInternal * info = [parser _info];
+	__flushCharacters( parser );
+	LeaveElementWithinLimits( info );
 	
-	NSString * uriStr = NSStringFromXmlChar(URI);
+	// the start of this element was filtered out, so there's no namespace scope to pop either
+	if ( (info->pathFilter != nil) && (AQXMLPathFilterEndElement(info->pathFilter) == NO) )
+		return;
 	
-	if ( [delegate respondsToSelector: @selector(parser:didEndElement:namespaceURI:qualifiedName:)] )
+	if ( info->didEndElementIMP != NULL )
 	{
-		if ( prefixStr != nil )
+		NSString * localnameStr = InternedNSStringFromXmlChar(parser, localname);
+		NSString * completeStr = nil;
+		NSString * uriStr = nil;
+		
+		if ( [parser shouldProcessNamespaces] && (prefix != NULL) )
 		{
+			completeStr = InternedQualifiedName(parser, prefix, localname);
+			uriStr = InternedNSStringFromXmlChar(parser, URI);
+			
 			if ( (completeStr == nil) && (uriStr == nil) )
 				uriStr = @"";
-			
-			[delegate parser: parser didEndElement: localnameStr
-				namespaceURI: uriStr qualifiedName: completeStr];
-		}
-		else
-		{
-			[delegate parser: parser didEndElement: localnameStr
-				namespaceURI: nil qualifiedName: nil];
 		}
+		
+		((AQDidEndElementIMP)info->didEndElementIMP)( EventTarget(parser),
+													  @selector(parser:didEndElement:namespaceURI:qualifiedName:),
+													  parser, localnameStr, uriStr, completeStr );
 	}
 	
 	[parser _popNamespaces];
-	
-	[prefixStr release];
-	[localnameStr release];
-    [completeStr release];
-	[uriStr release];
 }
 
 static void __processingInstruction( void * ctx, const xmlChar * target, const xmlChar * data )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	__flushCharacters( parser );
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundProcessingInstructionWithTarget:data:)] == NO )
+	if ( (DelegateImplements(parser, AQXMLDelegateFoundProcessingInstruction) == NO) || FilterRejects(parser) )
 		return;
 	
 	NSString * targetStr = NSStringFromXmlChar(target);
 	NSString * dataStr = NSStringFromXmlChar(data);
+	CountStrings( parser, 2 );
 	
 	[delegate parser: parser foundProcessingInstructionWithTarget: targetStr data: dataStr];
 	
@@ -407,9 +701,10 @@ static void __processingInstruction( void * ctx, const xmlChar * target, const x
 static void __cdataBlock( void * ctx, const xmlChar * value, int len )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	__flushCharacters( parser );
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundCDATA:)] == NO )
+	if ( (DelegateImplements(parser, AQXMLDelegateFoundCDATA) == NO) || FilterRejects(parser) )
 		return;
 	
 	NSData * data = [[NSData allocWithZone: nil] initWithBytes: value length: len];
@@ -420,12 +715,14 @@ static void __cdataBlock( void * ctx, const xmlChar * value, int len )
 static void __comment( void * ctx, const xmlChar * value )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	__flushCharacters( parser );
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:foundComment:)] == NO )
+	if ( (DelegateImplements(parser, AQXMLDelegateFoundComment) == NO) || FilterRejects(parser) )
 		return;
 	
 	NSString * commentStr = NSStringFromXmlChar(value);
+	CountStrings( parser, 1 );
 	[delegate parser: parser foundComment: commentStr];
 	[commentStr release];
 }
@@ -434,9 +731,9 @@ static void __errorCallback( void * ctx, const char * msg, ... )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
 	xmlParserCtxtPtr p = [parser _xmlParserContext];
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
-	if ( [delegate respondsToSelector: @selector(parser:parseErrorOccurred:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateParseErrorOccurred) == NO )
 		return;
 	
 	[delegate parser: parser parseErrorOccurred: [NSError errorWithDomain: NSXMLParserErrorDomain
@@ -447,10 +744,10 @@ static void __errorCallback( void * ctx, const char * msg, ... )
 static void __structuredErrorFunc( void * ctx, xmlErrorPtr errorData )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	_AQXMLParserInternal * info = [parser _info];
 	
-	if ( [delegate respondsToSelector: @selector(parser:parseErrorOccurred:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateParseErrorOccurred) == NO )
 		return;
 	
 	int code = (info->delegateAborted ? 0x200 : errorData->code);
@@ -463,7 +760,7 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
 	xmlParserCtxtPtr p = [parser _xmlParserContext];
-	id<AQXMLParserDelegate> delegate = parser.delegate;
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
 	
 	xmlEntityPtr entity = xmlGetPredefinedEntity( name );
 	if ( entity != NULL )
@@ -477,7 +774,7 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
 		return ( entity );
 	}
 	
-	if ( [delegate respondsToSelector: @selector(parser:resolveExternalEntityName:systemID:)] == NO )
+	if ( DelegateImplements(parser, AQXMLDelegateResolveExternalEntity) == NO )
 		return ( NULL );
 	
 	NSString * nameStr = NSStringFromXmlChar(name);
@@ -500,30 +797,59 @@ static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
 	return ( NULL );
 }
 
+// hands the delegate a cursor over libxml2's own attribute data, in place of a dictionary
+static void __startElementWithCursor( AQXMLParser * parser, NSString * localname, NSString * URI, NSString * qName,
+									  const xmlChar ** attributes, NSUInteger count, NSUInteger stride )
+{
+	_AQXMLParserInternal * info = [parser _info];
+	if ( info->attributeCursor == nil )
+		info->attributeCursor = [[AQXMLAttributeCursor alloc] init];
+	
+	AQXMLAttributeCursor * cursor = info->attributeCursor;
+	[cursor _setParser: parser attributes: attributes count: count stride: stride];
+	
+	((AQDidStartElementCursorIMP)info->didStartElementCursorIMP)( EventTarget(parser),
+																  @selector(parser:didStartElement:namespaceURI:qualifiedName:attributeCursor:),
+																  parser, localname, URI, qName, cursor );
+	
+	// the data it looks at is about to go away
+	[cursor _setParser: nil attributes: NULL count: 0 stride: 0];
+}
+
 static void __startElementNS( void * ctx, const xmlChar *localname, const xmlChar *prefix,
 							 const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
 							 int nb_attributes, int nb_defaulted, const xmlChar **attributes)
 {
 	AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = [parser delegate];
+	_AQXMLParserInternal * info = [parser _info];
+	__flushCharacters( parser );
+	
+	if ( EnterElementWithinLimits(parser) == NO )
+		return;
+	
+	// outside the filtered paths, nothing is created & no namespaces are pushed
+	if ( (info->pathFilter != nil) && (AQXMLPathFilterStartElement(info->pathFilter, localname, prefix) == NO) )
+		return;
 	
 	BOOL processNS = [parser shouldProcessNamespaces];
 	BOOL reportNS = [parser shouldReportNamespacePrefixes];
+	BOOL wantsCursor = (info->didStartElementCursorIMP != NULL);
+	BOOL wantsElement = (info->didStartElementIMP != NULL);
 	
-	NSString * prefixStr = NSStringFromXmlChar(prefix);
-	NSString * localnameStr = NSStringFromXmlChar(localname);
+	// nothing to build if nobody is listening
+	if ( (wantsElement == NO) && (wantsCursor == NO) && (reportNS == NO) )
+		return;
 	
-	NSString * completeStr = nil;
-	if ( [prefixStr length] != 0 )
-		completeStr = [[NSString alloc] initWithFormat: @"%@:%@", prefixStr, localnameStr];
-	else
-		completeStr = [localnameStr retain];
+	NSString * localnameStr = InternedNSStringFromXmlChar(parser, localname);
+	NSString * completeStr = InternedQualifiedName(parser, prefix, localname);
 	
 	NSString * uriStr = nil;
 	if ( processNS )
-		uriStr = NSStringFromXmlChar(URI);
+		uriStr = InternedNSStringFromXmlChar(parser, URI);
 	
-	NSMutableDictionary * attrDict = [[NSMutableDictionary alloc] initWithCapacity: nb_attributes + nb_namespaces];
+	NSMutableDictionary * attrDict = nil;
+	if ( wantsElement )
+		attrDict = [[NSMutableDictionary alloc] initWithCapacity: nb_attributes + nb_namespaces];
 	
 	NSMutableDictionary * nsDict = nil;
 	if ( reportNS )
@@ -532,55 +858,42 @@ static void __startElementNS( void * ctx, const xmlChar *localname, const xmlCha
 	int i;
 	for ( i = 0; i < (nb_namespaces * 2); i += 2 )
 	{
-		NSString * namespaceStr = nil;
 		NSString * qualifiedStr = nil;
 		
 		if ( namespaces[i] == NULL )
-		{
 			qualifiedStr = @"xmlns";
-		}
 		else
-		{
-			namespaceStr = NSStringFromXmlChar(namespaces[i]);
-			qualifiedStr = [[NSString alloc] initWithFormat: @"xmlns:%@", namespaceStr];
-		}
+			qualifiedStr = InternedQualifiedName(parser, (const xmlChar *)"xmlns", namespaces[i]);
 		
 		NSString * val = nil;
 		if ( namespaces[i+1] != NULL )
-			val = NSStringFromXmlChar(namespaces[i+1]);
+			val = InternedNSStringFromXmlChar(parser, namespaces[i+1]);
 		else
 			val = @"";
 		
 		[nsDict setObject: val forKey: completeStr];
 		[attrDict setObject: val forKey: qualifiedStr];
-		
-		[namespaceStr release];
-		[qualifiedStr release];
-		[val release];
 	}
 	
 	if ( reportNS )
 		[parser _pushNamespaces: nsDict];
 	[nsDict release];
 	
+	if ( wantsCursor )
+	{
+		__startElementWithCursor( parser, localnameStr, uriStr, completeStr, attributes, nb_attributes, 5 );
+		return;
+	}
+	
+	if ( wantsElement == NO )
+		return;
+	
 	for ( i = 0; i < (nb_attributes * 5); i += 5 )
 	{
 		if ( attributes[i] == NULL )
 			continue;
 		
-		NSString * attrLocalName = NSStringFromXmlChar(attributes[i]);
-		
-		NSString * attrPrefix = nil;
-		if ( attributes[i+1] != NULL )
-			attrPrefix = NSStringFromXmlChar(attributes[i+1]);
-		
-		NSString * attrQualified = nil;
-		if ( [attrPrefix length] != 0 )
-			attrQualified = [[NSString alloc] initWithFormat: @"%@:%@", attrPrefix, attrLocalName];
-		else
-			attrQualified = [attrLocalName retain];
-		
-		[attrPrefix release];
+		NSString * attrQualified = InternedQualifiedName(parser, attributes[i+1], attributes[i]);
 		
 		NSString * attrValue = @"";
 		if ( (attributes[i+3] != NULL) && (attributes[i+4] != NULL) )
@@ -589,180 +902,427 @@ static void __startElementNS( void * ctx, const xmlChar *localname, const xmlCha
 			attrValue = [[NSString alloc] initWithBytes: attributes[i+3]
 												 length: length
 											   encoding: NSUTF8StringEncoding];
+			CountStrings( parser, 1 );
 		}
 		
 		[attrDict setObject: attrValue forKey: attrQualified];
-		
-        [attrLocalName release];
-		[attrQualified release];
 		[attrValue release];
 	}
 	
-	if ( [delegate respondsToSelector: @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:)] )
-	{
-		[delegate parser: parser
-		 didStartElement: localnameStr
-			namespaceURI: uriStr
-		   qualifiedName: completeStr
-			  attributes: attrDict];
-	}
+	((AQDidStartElementIMP)info->didStartElementIMP)( EventTarget(parser),
+													  @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:),
+													  parser, localnameStr, uriStr, completeStr, attrDict );
 	
-	[localnameStr release];
-	[prefixStr release];
-	[uriStr release];
-	[completeStr release];
 	[attrDict release];
 }
 
 static void __startElement( void * ctx, const xmlChar * name, const xmlChar ** attrs )
 {
     AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = [parser delegate];
+    _AQXMLParserInternal * info = [parser _info];
+    __flushCharacters( parser );
+    
+    if ( EnterElementWithinLimits(parser) == NO )
+        return;
+    
+    // both filters need to see every element, so the whitelist's verdict is applied afterwards
+    BOOL whitelisted = WhitelistStartElement( info, name );
+    if ( (info->pathFilter != nil) && (AQXMLPathFilterStartElement(info->pathFilter, name, NULL) == NO) )
+        return;
+    if ( whitelisted == NO )
+        return;
+    
+    if ( info->didStartElementCursorIMP != NULL )
+    {
+        NSUInteger count = 0;
+        if ( attrs != NULL )
+        {
+            while ( attrs[count * 2] != NULL )
+                count++;
+        }
+        
+        __startElementWithCursor( parser, InternedNSStringFromXmlChar(parser, name), nil, nil, attrs, count, 2 );
+        return;
+    }
     
-    if ( [delegate respondsToSelector: @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:)] == NO )
+    if ( info->didStartElementIMP == NULL )
         return;
     
-    NSString * nameStr = NSStringFromXmlChar(name);
+    NSString * nameStr = InternedNSStringFromXmlChar(parser, name);
     NSMutableDictionary * attrDict = [[NSMutableDictionary alloc] init];
     
     if ( attrs != NULL )
     {
         while ( *attrs != NULL )
         {
-            NSString * keyStr = NSStringFromXmlChar(*attrs);
+            NSString * keyStr = InternedNSStringFromXmlChar(parser, *attrs);
             attrs++;
             
             NSString * valueStr = NSStringFromXmlChar(*attrs);
+            CountStrings( parser, 1 );
             attrs++;
             
             if ( (keyStr != nil) && (valueStr != nil) )
                 [attrDict setObject: valueStr forKey: keyStr];
             
-            [keyStr release];
             [valueStr release];
         }
     }
     
-    [delegate parser: parser
-     didStartElement: nameStr
-        namespaceURI: nil
-       qualifiedName: nil
-          attributes: attrDict];
+    ((AQDidStartElementIMP)info->didStartElementIMP)( EventTarget(parser),
+                                                      @selector(parser:didStartElement:namespaceURI:qualifiedName:attributes:),
+                                                      parser, nameStr, nil, nil, attrDict );
     
-    [nameStr release];
     [attrDict release];
 }
 
 static void __endElement( void * ctx, const xmlChar * name )
 {
     AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = [parser delegate];
+    _AQXMLParserInternal * info = [parser _info];
+    __flushCharacters( parser );
+    LeaveElementWithinLimits( info );
     
-    if ( [delegate respondsToSelector: @selector(parser:didEndElement:namespaceURI:qualifiedName:)] == NO )
+    BOOL whitelisted = WhitelistEndElement( info );
+    if ( (info->pathFilter != nil) && (AQXMLPathFilterEndElement(info->pathFilter) == NO) )
+        return;
+    if ( whitelisted == NO )
         return;
     
-    NSString * nameStr = NSStringFromXmlChar(name);
+    if ( info->didEndElementIMP == NULL )
+        return;
     
-    [delegate parser: parser didEndElement: nameStr namespaceURI: nil qualifiedName: nil];
-    [nameStr release];
+    ((AQDidEndElementIMP)info->didEndElementIMP)( EventTarget(parser),
+                                                  @selector(parser:didEndElement:namespaceURI:qualifiedName:),
+                                                  parser, InternedNSStringFromXmlChar(parser, name), nil, nil );
 }
 
 static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 {
     AQXMLParser * parser = (AQXMLParser *) ctx;
-	id<AQXMLParserDelegate> delegate = [parser delegate];
+	__flushCharacters( parser );
+	id<AQXMLParserDelegate> delegate = EventTarget(parser);
     
-    if ( [delegate respondsToSelector: @selector(parser:foundIgnorableWhitespace:)] == NO )
+	if ( (DelegateImplements(parser, AQXMLDelegateFoundIgnorableWhitespace) == NO) || FilterRejects(parser) )
 		return;
 	
 	NSString * str = [[NSString allocWithZone: nil] initWithBytes: ch
 														   length: len
 														 encoding: NSUTF8StringEncoding];
+	CountStrings( parser, 1 );
 	[delegate parser: parser foundCharacters: str];
 	[str release];
 }
 
 #pragma mark -
 
-@implementation AQXMLParser
+// When collecting statistics, these are installed in place of the callbacks above, so that
+//  parsers which aren't collecting them don't pay anything for it.
 
-@synthesize delegate=_delegate;
-@synthesize progressDelegate=_progressDelegate;
+static inline AQXMLParserCounters * Counters( void * ctx )
+{
+	return ( [(AQXMLParser *) ctx _info]->counters );
+}
 
-- (id) initWithStream: (NSInputStream *) stream
+#define TimeCallback(ctx, call) \
+	do { uint64_t __start = mach_absolute_time(); call; Counters(ctx)->callbackTime += mach_absolute_time() - __start; } while (0)
+
+static void __countedStartElementNS( void * ctx, const xmlChar *localname, const xmlChar *prefix,
+									 const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
+									 int nb_attributes, int nb_defaulted, const xmlChar **attributes )
 {
-	if ( [super init] == nil )
-		return ( nil );
-	
-	_internal = [[_AQXMLParserInternal alloc] init];
-#if TARGET_OS_IPHONE
-	_internal->saxHandler = NSZoneMalloc( [self zone], sizeof(struct _xmlSAXHandler) );
-#else
-	_internal->saxHandler = NSAllocateCollectable( sizeof(struct _xmlSAXHandler), 0 );
-#endif
-	_internal->parserContext = NULL;
-	_internal->error = nil;
-	
-	_stream = [stream retain];
-    if ( _internal->expectedDataLength != 0.0 )
-        [self _setupExpectedLength];
-	
-	[self _initializeSAX2Callbacks];
-	
-#if AUTO_DEBUG_LOG_INPUT == 1
-	self.debugLogInput = YES;
-#endif
+	AQXMLParserCounters * c = Counters( ctx );
+	c->elementCount++;
+	c->attributeCount += nb_attributes;
+	if ( ++c->depth > c->peakDepth )
+		c->peakDepth = c->depth;
 	
-	return ( self );
+	TimeCallback( ctx, __startElementNS(ctx, localname, prefix, URI, nb_namespaces, namespaces,
+										nb_attributes, nb_defaulted, attributes) );
 }
 
-- (id) initWithData: (NSData *) data
+static void __countedEndElementNS( void * ctx, const xmlChar * localname, const xmlChar * prefix, const xmlChar * URI )
 {
-    NSInputStream * stream = [[NSInputStream alloc] initWithData: data];
-    id result = [self initWithStream: stream];
-    _internal->expectedDataLength = (float) [data length];
-    [stream release];
-    return ( result );
+	Counters(ctx)->depth--;
+	TimeCallback( ctx, __endElementNS(ctx, localname, prefix, URI) );
 }
 
-- (void) dealloc
+static void __countedStartElement( void * ctx, const xmlChar * name, const xmlChar ** attrs )
 {
-	[_internal->error release];
-	[_internal->namespaces release];
-	[_internal->debugOutputStream release];
-	NSZoneFree( nil, _internal->saxHandler );
+	AQXMLParserCounters * c = Counters( ctx );
+	c->elementCount++;
+	if ( ++c->depth > c->peakDepth )
+		c->peakDepth = c->depth;
 	
-	if ( _internal->parserContext != NULL )
+	const xmlChar ** attr = attrs;
+	while ( (attr != NULL) && (*attr != NULL) )
 	{
-        if ( self.HTMLMode )
-        {
-            htmlFreeParserCtxt( _internal.htmlParserContext );
-        }
-        else    // XML mode
-        {
-            xmlParserCtxtPtr p = _internal.xmlParserContext;
-            if ( p->myDoc != NULL )
-                xmlFreeDoc( p->myDoc );
-            xmlFreeParserCtxt( _internal->parserContext );
-        }
+		c->attributeCount++;
+		attr += 2;
 	}
 	
-	[_internal release];
-	[_stream release];
-	
-	[super dealloc];
+	TimeCallback( ctx, __startElement(ctx, name, attrs) );
 }
 
-- (void) finalize
+static void __countedEndElement( void * ctx, const xmlChar * name )
 {
-	if ( _internal->parserContext != NULL )
-	{
-        if ( self.HTMLMode )
-        {
-            htmlFreeParserCtxt( _internal.htmlParserContext );
-        }
-        else    // XML mode
-        {
+	Counters(ctx)->depth--;
+	TimeCallback( ctx, __endElement(ctx, name) );
+}
+
+static void __countedCharacters( void * ctx, const xmlChar * ch, int len )
+{
+	Counters(ctx)->characterCallbacks++;
+	TimeCallback( ctx, __characters(ctx, ch, len) );
+}
+
+static void __countedIgnorableWhitespace( void * ctx, const xmlChar * ch, int len )
+{
+	Counters(ctx)->characterCallbacks++;
+	TimeCallback( ctx, __ignorableWhitespace(ctx, ch, len) );
+}
+
+static void __countedCdataBlock( void * ctx, const xmlChar * value, int len )
+{
+	Counters(ctx)->characterCallbacks++;
+	TimeCallback( ctx, __cdataBlock(ctx, value, len) );
+}
+
+static void __countedComment( void * ctx, const xmlChar * value )
+{
+	TimeCallback( ctx, __comment(ctx, value) );
+}
+
+static void __countedProcessingInstruction( void * ctx, const xmlChar * target, const xmlChar * data )
+{
+	TimeCallback( ctx, __processingInstruction(ctx, target, data) );
+}
+
+#pragma mark -
+
+// When the parser's checkpointDepth is set, these wrap whichever element callbacks are installed,
+//  keeping a note of the elements which enclose the checkpointed ones.
+
+// keys for the open elements recorded in a checkpoint
+static NSString * const AQCheckpointLocalNameKey	= @"localName";
+static NSString * const AQCheckpointPrefixKey		= @"prefix";
+static NSString * const AQCheckpointNamespacesKey	= @"namespaces";
+
+static void __checkpointStartElementNS( void * ctx, const xmlChar *localname, const xmlChar *prefix,
+										const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
+										int nb_attributes, int nb_defaulted, const xmlChar **attributes )
+{
+	_AQXMLParserInternal * info = [(AQXMLParser *) ctx _info];
+	
+	if ( ++info->elementDepth < info->checkpointDepth )
+	{
+		// there are only ever a few of these, so a new array is made each time
+		NSMutableDictionary * nsDict = [NSMutableDictionary dictionaryWithCapacity: nb_namespaces];
+		int i;
+		for ( i = 0; i < (nb_namespaces * 2); i += 2 )
+		{
+			NSString * nsPrefix = (namespaces[i] == NULL ? @"" : [NSString stringWithUTF8String: (const char *)namespaces[i]]);
+			NSString * nsURI = (namespaces[i+1] == NULL ? @"" : [NSString stringWithUTF8String: (const char *)namespaces[i+1]]);
+			[nsDict setObject: nsURI forKey: nsPrefix];
+		}
+		
+		NSMutableDictionary * element = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+										 [NSString stringWithUTF8String: (const char *)localname], AQCheckpointLocalNameKey,
+										 nsDict, AQCheckpointNamespacesKey, nil];
+		if ( prefix != NULL )
+			[element setObject: [NSString stringWithUTF8String: (const char *)prefix] forKey: AQCheckpointPrefixKey];
+		
+		NSArray * openElements = [info->openElements arrayByAddingObject: element];
+		[info->openElements release];
+		info->openElements = [openElements retain];
+	}
+	
+	info->checkpointedStartElementNs( ctx, localname, prefix, URI, nb_namespaces, namespaces,
+									  nb_attributes, nb_defaulted, attributes );
+}
+
+static void __checkpointEndElementNS( void * ctx, const xmlChar * localname, const xmlChar * prefix, const xmlChar * URI )
+{
+	AQXMLParser * parser = (AQXMLParser *) ctx;
+	_AQXMLParserInternal * info = [parser _info];
+	
+	info->checkpointedEndElementNs( ctx, localname, prefix, URI );
+	
+	NSUInteger depth = info->elementDepth--;
+	if ( depth == info->checkpointDepth )
+	{
+		// libxml2 has just stepped past the end tag
+		info->checkpointOffset = (unsigned long long) (info->checkpointBase + xmlByteConsumed(info->parserContext));
+		if ( info->checkpointOpenElements != info->openElements )
+		{
+			[info->checkpointOpenElements release];
+			info->checkpointOpenElements = [info->openElements retain];
+		}
+		
+		if ( DelegateImplements(parser, AQXMLDelegateDidReachCheckpoint) )
+			[EventTarget(parser) parser: parser didReachCheckpoint: parser.lastCheckpoint];
+	}
+	else if ( (depth < info->checkpointDepth) && ([info->openElements count] != 0) )
+	{
+		NSArray * openElements = [info->openElements subarrayWithRange: NSMakeRange(0, [info->openElements count] - 1)];
+		[info->openElements release];
+		info->openElements = [openElements retain];
+	}
+}
+
+// installed while the elements open at a checkpoint are re-opened, so the delegate doesn't see them
+static void __resumeStartDocument( void * ctx )
+{
+	__setUpDocument( [(AQXMLParser *) ctx _xmlParserContext] );
+}
+
+#pragma mark -
+
+@implementation AQXMLParser
+
+@synthesize progressDelegate=_progressDelegate;
+
+- (id) initWithStream: (NSInputStream *) stream
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_internal = [[_AQXMLParserInternal alloc] init];
+#if TARGET_OS_IPHONE
+	_internal->saxHandler = NSZoneMalloc( [self zone], sizeof(struct _xmlSAXHandler) );
+#else
+	_internal->saxHandler = NSAllocateCollectable( sizeof(struct _xmlSAXHandler), 0 );
+#endif
+	_internal->parserContext = NULL;
+	_internal->error = nil;
+	_internal->readBufferSize = DEFAULT_READ_BUFFER_SIZE;
+	_internal->maxQueuedChunks = DEFAULT_MAX_QUEUED_CHUNKS;
+	_internal->eventBatchSize = DEFAULT_EVENT_BATCH_SIZE;
+	_internal->parserFlags |= AQXMLParserShouldFilterControlRefs;
+	_internal->progressUpdateInterval = DEFAULT_PROGRESS_INTERVAL;
+	_internal->progressUpdateByteCount = DEFAULT_PROGRESS_BYTE_COUNT;
+	_internal->mappedFile = -1;
+	
+	// keys are libxml2 dictionary pointers, so no key callbacks
+	_internal->internedNames = (CFMutableDictionaryRef) CFMakeCollectable( CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, &kCFTypeDictionaryValueCallBacks) );
+	
+	_stream = [stream retain];
+	
+	[self _initializeSAX2Callbacks];
+	
+#if AUTO_DEBUG_LOG_INPUT == 1
+	self.debugLogInput = YES;
+#endif
+	
+	return ( self );
+}
+
+- (id) initWithData: (NSData *) data
+{
+    NSInputStream * stream = [[NSInputStream alloc] initWithData: data];
+    id result = [self initWithStream: stream];
+    _internal->expectedDataLength = (float) [data length];
+    [stream release];
+    return ( result );
+}
+
+- (id) initWithContentsOfMappedFile: (NSString *) path
+{
+	if ( [self initWithStream: nil] == nil )
+		return ( nil );
+	
+	int fd = open( [path fileSystemRepresentation], O_RDONLY );
+	if ( fd == -1 )
+	{
+		[self release];
+		return ( nil );
+	}
+	
+	struct stat info;
+	if ( fstat(fd, &info) == -1 )
+	{
+		close( fd );
+		[self release];
+		return ( nil );
+	}
+	
+	_internal->mappedFile = fd;
+	_internal->mappedFileSize = (unsigned long long) info.st_size;
+	_internal->expectedDataLength = (float) info.st_size;
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	[_internal->error release];
+	[_internal->namespaces release];
+	[_internal->debugOutputStream release];
+	[_internal->worker release];
+	[_internal->attributeCursor release];
+	[_internal->filterPaths release];
+	[_internal->pathFilter release];
+	[_internal->mappedRunLoopModes release];
+	[_internal->openElements release];
+	[_internal->checkpointOpenElements release];
+	[_internal->resumeCheckpoint release];
+	[_internal->tagWhitelist release];
+	[_internal->readRunLoopModes release];
+	NSZoneFree( nil, _internal->saxHandler );
+	
+	[self _closeMappedFile];
+	FreeWhitelistNames( _internal );
+	
+	if ( _internal->internedNames != NULL )
+		CFRelease( _internal->internedNames );
+	if ( _internal->characterBuffer != NULL )
+		free( _internal->characterBuffer );
+	if ( _internal->readBuffer != NULL )
+		free( _internal->readBuffer );
+	if ( _internal->counters != NULL )
+		free( _internal->counters );
+	
+	if ( _internal->parserContext != NULL )
+	{
+        if ( self.HTMLMode )
+        {
+            htmlFreeParserCtxt( _internal.htmlParserContext );
+        }
+        else    // XML mode
+        {
+            xmlParserCtxtPtr p = _internal.xmlParserContext;
+            if ( p->myDoc != NULL )
+                xmlFreeDoc( p->myDoc );
+            xmlFreeParserCtxt( _internal->parserContext );
+        }
+	}
+	
+	[_internal release];
+	[_stream release];
+	
+	[super dealloc];
+}
+
+- (void) finalize
+{
+	[self _closeMappedFile];
+	FreeWhitelistNames( _internal );
+	
+	if ( _internal->characterBuffer != NULL )
+		free( _internal->characterBuffer );
+	if ( _internal->readBuffer != NULL )
+		free( _internal->readBuffer );
+	if ( _internal->counters != NULL )
+		free( _internal->counters );
+	
+	if ( _internal->parserContext != NULL )
+	{
+        if ( self.HTMLMode )
+        {
+            htmlFreeParserCtxt( _internal.htmlParserContext );
+        }
+        else    // XML mode
+        {
             xmlParserCtxtPtr p = _internal.xmlParserContext;
             if ( p->myDoc != NULL )
                 xmlFreeDoc( p->myDoc );
@@ -773,6 +1333,22 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	[super finalize];
 }
 
+- (id<AQXMLParserDelegate>) delegate
+{
+	return ( _delegate );
+}
+
+- (void) setDelegate: (id<AQXMLParserDelegate>) delegate
+{
+	_delegate = delegate;
+	[self _resolveDelegateCapabilities];
+	
+	// the SAX handler is copied into the parser context when it's created, so only update
+	//  it if that hasn't happened yet
+	if ( _internal->parserContext == NULL )
+		[self _initializeSAX2Callbacks];
+}
+
 - (BOOL) debugLogInput
 {
 	return ( _internal->debugOutputStream != nil );
@@ -845,128 +1421,386 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 		_internal->parserFlags &= ~AQXMLParserShouldResolveExternals;
 }
 
-- (BOOL) isInHTMLMode
+- (BOOL) shouldBufferCharacters
 {
-    return ( (_internal->parserFlags & AQXMLParserHTMLMode) == AQXMLParserHTMLMode );
+	return ( (_internal->parserFlags & AQXMLParserShouldBufferCharacters) == AQXMLParserShouldBufferCharacters );
 }
 
-- (void) setHTMLMode: (BOOL) value
+- (void) setShouldBufferCharacters: (BOOL) value
 {
-    if ( [self _htmlParserContext] != NULL )
-        return;
-    
-    if ( value )
-        _internal->parserFlags |= AQXMLParserHTMLMode;
-    else
-        _internal->parserFlags &= ~AQXMLParserHTMLMode;
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	if ( value )
+		_internal->parserFlags |= AQXMLParserShouldBufferCharacters;
+	else
+		_internal->parserFlags &= ~AQXMLParserShouldBufferCharacters;
 }
 
-- (BOOL) parse
+- (NSArray *) pathFilter
 {
-	if ( [self parseAsynchronouslyUsingRunLoop: [NSRunLoop currentRunLoop]
-                                          mode: AQXMLParserParsingRunLoopMode
-                             notifyingDelegate: nil
-                                      selector: NULL
-                                       context: NULL] == NO )
-    {
-        return ( NO );
-    }
-	
-	if ( _internal->delegateAborted )
+	return ( _internal->filterPaths );
+}
+
+- (BOOL) setPathFilter: (NSArray *) paths error: (NSError **) error
+{
+	if ( [self _xmlParserContext] != NULL )
 		return ( NO );
 	
-	// run in the common runloop modes while we read the data from the stream
-	_internal->waitingRunLoop = [NSRunLoop currentRunLoop];
-	
-	while ( _streamComplete == NO )
+	if ( [paths count] != 0 )
 	{
-		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
-		[[NSRunLoop currentRunLoop] runMode: AQXMLParserParsingRunLoopMode
-                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
-		[pool drain];
+		// compile it once now, just to check the syntax
+		_AQXMLPathFilter * filter = [[_AQXMLPathFilter alloc] initWithPaths: paths dictionary: NULL error: error];
+		if ( filter == nil )
+			return ( NO );
+		[filter release];
 	}
-	
-	_internal->waitingRunLoop = nil;
-	
-	[_stream setDelegate: nil];
-	[_stream removeFromRunLoop: [NSRunLoop currentRunLoop]
-                       forMode: AQXMLParserParsingRunLoopMode];
-	[_stream close];
-	
-	if ( _internal->debugOutputStream != nil && [_internal->debugOutputStream streamStatus] != NSStreamStatusClosed )
+	else
 	{
-		NSString * str = [[NSString alloc] initWithData: [_internal->debugOutputStream propertyForKey: NSStreamDataWrittenToMemoryStreamKey]
-											   encoding: NSUTF8StringEncoding];
-		// DO NOT COMMENT OUT THIS LINE!!!!!!!!
-		// NO, REALLY--- STOP DOING IT!!!!!
-		NSLog( @"Response:\n%@", str );
-		[str release];
-		[_internal->debugOutputStream close];
+		paths = nil;
 	}
 	
-	return ( _internal->error == nil );
+	[_internal->filterPaths release];
+	_internal->filterPaths = [paths copy];
+	return ( YES );
 }
 
-- (BOOL) parseAsynchronouslyUsingRunLoop: (NSRunLoop *) runloop
-                                    mode: (NSString *) mode
-                       notifyingDelegate: (id) asyncCompletionDelegate
-                                selector: (SEL) completionSelector
-                                 context: (void *) contextPtr
+- (NSSet *) HTMLTagWhitelist
 {
-    if ( _stream == nil )
-		return ( NO );
-	
-	// see if bytes are already available on the stream
-	// if there are, we'll grab the first 4 bytes and use those to compute the encoding
-	// otherwise, we'll just go with no initial data
-	uint8_t buf[4];
-	size_t buflen = 0;
-	
-	_streamComplete = NO;
+	return ( _internal->tagWhitelist );
+}
+
+- (void) setHTMLTagWhitelist: (NSSet *) tags
+{
+	if ( [self _xmlParserContext] != NULL )
+		return;
 	
-	if ( [_stream hasBytesAvailable] )
-    {
-		buflen = [_stream read: buf maxLength: 4];
-        [self _initializeParserWithBytes: buf length: buflen];
-    }
-    
-    // store async callbacks details
-    _internal->asyncDelegate = asyncCompletionDelegate;
-    _internal->asyncSelector = completionSelector;
-    _internal->asyncContext  = contextPtr;
+	if ( [tags count] == 0 )
+		tags = nil;
 	
-	// start the stream processing going
-	[_stream setDelegate: self];
-	[_stream scheduleInRunLoop: runloop forMode: mode];
+	[_internal->tagWhitelist release];
+	_internal->tagWhitelist = [tags copy];
 	
-	if ( [_stream streamStatus] == NSStreamStatusNotOpen )
-		[_stream open];
-    
-    return ( YES );
 }
 
-- (void) stream: (NSStream *) stream handleEvent: (NSStreamEvent) streamEvent
+- (NSUInteger) maxTextNodeLength
 {
-	NSInputStream * input = (NSInputStream *) _stream;
-	
-	switch ( streamEvent )
-	{
-		case NSStreamEventOpenCompleted:
-		default:
-			break;
-			
+	return ( _internal->maxTextNodeLength );
+}
+
+- (void) setMaxTextNodeLength: (NSUInteger) value
+{
+	_internal->maxTextNodeLength = value;
+}
+
+- (NSUInteger) maxElementDepth
+{
+	return ( _internal->maxElementDepth );
+}
+
+- (void) setMaxElementDepth: (NSUInteger) value
+{
+	// the depth isn't counted without a limit, so one can't be imposed part-way through
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	_internal->maxElementDepth = value;
+}
+
+- (unsigned long long) maxDocumentLength
+{
+	return ( _internal->maxDocumentLength );
+}
+
+- (void) setMaxDocumentLength: (unsigned long long) value
+{
+	_internal->maxDocumentLength = value;
+}
+
+- (NSTimeInterval) progressUpdateInterval
+{
+	return ( _internal->progressUpdateInterval );
+}
+
+- (void) setProgressUpdateInterval: (NSTimeInterval) value
+{
+	_internal->progressUpdateInterval = value;
+}
+
+- (NSUInteger) progressUpdateByteCount
+{
+	return ( _internal->progressUpdateByteCount );
+}
+
+- (void) setProgressUpdateByteCount: (NSUInteger) value
+{
+	_internal->progressUpdateByteCount = value;
+}
+
+- (BOOL) collectsStatistics
+{
+	return ( _internal->counters != NULL );
+}
+
+- (void) setCollectsStatistics: (BOOL) value
+{
+	// the counting callbacks are installed when the context is created
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	if ( value && (_internal->counters == NULL) )
+	{
+		_internal->counters = calloc( 1, sizeof(AQXMLParserCounters) );
+	}
+	else if ( (value == NO) && (_internal->counters != NULL) )
+	{
+		free( _internal->counters );
+		_internal->counters = NULL;
+	}
+	
+	[self _initializeSAX2Callbacks];
+}
+
+- (AQXMLParserStatistics *) statistics
+{
+	if ( _internal->counters == NULL )
+		return ( nil );
+	
+	return ( [[[AQXMLParserStatistics alloc] _initWithCounters: _internal->counters] autorelease] );
+}
+
+- (NSUInteger) checkpointDepth
+{
+	return ( _internal->checkpointDepth );
+}
+
+- (void) setCheckpointDepth: (NSUInteger) value
+{
+	// the checkpoint callbacks are installed when the context is created
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	_internal->checkpointDepth = value;
+}
+
+- (AQXMLParserCheckpoint *) lastCheckpoint
+{
+	if ( _internal->checkpointOpenElements == nil )
+		return ( nil );
+	
+	NSString * encoding = nil;
+	xmlParserCtxtPtr p = [self _xmlParserContext];
+	if ( p != NULL )
+	{
+		const char * enc = (const char *) p->encoding;
+		if ( (enc == NULL) && (p->input != NULL) )
+			enc = (const char *) p->input->encoding;
+		if ( enc != NULL )
+			encoding = [NSString stringWithUTF8String: enc];
+	}
+	
+	return ( [[[AQXMLParserCheckpoint alloc] _initWithOffset: _internal->checkpointOffset
+												openElements: _internal->checkpointOpenElements
+													encoding: encoding] autorelease] );
+}
+
+- (AQXMLParserCheckpoint *) resumeCheckpoint
+{
+	return ( _internal->resumeCheckpoint );
+}
+
+- (void) setResumeCheckpoint: (AQXMLParserCheckpoint *) checkpoint
+{
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	[checkpoint retain];
+	[_internal->resumeCheckpoint release];
+	_internal->resumeCheckpoint = checkpoint;
+}
+
+- (NSUInteger) readBufferSize
+{
+	return ( _internal->readBufferSize );
+}
+
+- (void) setReadBufferSize: (NSUInteger) value
+{
+	// the buffer is allocated when parsing begins
+	if ( (_internal->readBuffer != NULL) || (value == 0) )
+		return;
+	
+	_internal->readBufferSize = value;
+}
+
+- (BOOL) shouldFilterControlCharacterReferences
+{
+	return ( (_internal->parserFlags & AQXMLParserShouldFilterControlRefs) == AQXMLParserShouldFilterControlRefs );
+}
+
+- (void) setShouldFilterControlCharacterReferences: (BOOL) value
+{
+	if ( [self _xmlParserContext] != NULL )
+		return;
+	
+	if ( value )
+		_internal->parserFlags |= AQXMLParserShouldFilterControlRefs;
+	else
+		_internal->parserFlags &= ~AQXMLParserShouldFilterControlRefs;
+}
+
+- (BOOL) isInHTMLMode
+{
+    return ( (_internal->parserFlags & AQXMLParserHTMLMode) == AQXMLParserHTMLMode );
+}
+
+- (void) setHTMLMode: (BOOL) value
+{
+    if ( [self _htmlParserContext] != NULL )
+        return;
+    
+    if ( value )
+        _internal->parserFlags |= AQXMLParserHTMLMode;
+    else
+        _internal->parserFlags &= ~AQXMLParserHTMLMode;
+}
+
+- (BOOL) parse
+{
+	if ( _internal->mappedFile != -1 )
+		return ( [self _parseMappedFile] );
+	
+	if ( [self parseAsynchronouslyUsingRunLoop: [NSRunLoop currentRunLoop]
+                                          mode: AQXMLParserParsingRunLoopMode
+                             notifyingDelegate: nil
+                                      selector: NULL
+                                       context: NULL] == NO )
+    {
+        return ( NO );
+    }
+	
+	if ( _internal->delegateAborted )
+		return ( NO );
+	
+	// run in the common runloop modes while we read the data from the stream
+	_internal->waitingRunLoop = [NSRunLoop currentRunLoop];
+	
+	while ( _streamComplete == NO )
+	{
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		[[NSRunLoop currentRunLoop] runMode: AQXMLParserParsingRunLoopMode
+                                 beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+		[pool drain];
+	}
+	
+	_internal->waitingRunLoop = nil;
+	
+	[_stream setDelegate: nil];
+	[_stream removeFromRunLoop: [NSRunLoop currentRunLoop]
+                       forMode: AQXMLParserParsingRunLoopMode];
+	[_stream close];
+	
+	if ( _internal->debugOutputStream != nil && [_internal->debugOutputStream streamStatus] != NSStreamStatusClosed )
+	{
+		NSString * str = [[NSString alloc] initWithData: [_internal->debugOutputStream propertyForKey: NSStreamDataWrittenToMemoryStreamKey]
+											   encoding: NSUTF8StringEncoding];
+		// DO NOT COMMENT OUT THIS LINE!!!!!!!!
+		// NO, REALLY--- STOP DOING IT!!!!!
+		NSLog( @"Response:\n%@", str );
+		[str release];
+		[_internal->debugOutputStream close];
+	}
+	
+	return ( _internal->error == nil );
+}
+
+- (BOOL) parseAsynchronouslyUsingRunLoop: (NSRunLoop *) runloop
+                                    mode: (NSString *) mode
+                       notifyingDelegate: (id) asyncCompletionDelegate
+                                selector: (SEL) completionSelector
+                                 context: (void *) contextPtr
+{
+	if ( _internal->mappedFile != -1 )
+	{
+		if ( _internal->mappedRunLoopModes != nil )
+			return ( NO );
+		
+		_streamComplete = NO;
+		_internal->asyncDelegate = asyncCompletionDelegate;
+		_internal->asyncSelector = completionSelector;
+		_internal->asyncContext  = contextPtr;
+		
+		// the file is parsed a slice at a time, each one performed separately on the runloop
+		_internal->mappedRunLoopModes = [[NSArray alloc] initWithObjects: mode, nil];
+		_internal->readRunLoop = runloop;
+		[runloop performSelector: @selector(_parseMappedSlices)
+						  target: self
+						argument: nil
+						   order: 0
+						   modes: _internal->mappedRunLoopModes];
+		return ( YES );
+	}
+	
+    if ( _stream == nil )
+		return ( NO );
+	
+	// see if bytes are already available on the stream
+	// if there are, we'll grab the first 4 bytes and use those to compute the encoding
+	// otherwise, we'll just go with no initial data
+	uint8_t buf[4];
+	size_t buflen = 0;
+	
+	_streamComplete = NO;
+	
+	if ( _internal->readBuffer == NULL )
+		_internal->readBuffer = malloc( _internal->readBufferSize );
+	_internal->streamProvidesBuffer = [_stream respondsToSelector: @selector(consumeBufferedBytes:)];
+	
+	if ( [_stream hasBytesAvailable] )
+    {
+		buflen = [_stream read: buf maxLength: 4];
+        [self _pushXMLData: buf length: buflen];
+    }
+    
+    // store async callbacks details
+    _internal->asyncDelegate = asyncCompletionDelegate;
+    _internal->asyncSelector = completionSelector;
+    _internal->asyncContext  = contextPtr;
+	
+	// start the stream processing going
+	[_stream setDelegate: self];
+	[_stream scheduleInRunLoop: runloop forMode: mode];
+	
+	[_internal->readRunLoopModes release];
+	_internal->readRunLoopModes = [[NSArray alloc] initWithObjects: mode, nil];
+	_internal->readRunLoop = runloop;
+	
+	if ( [_stream streamStatus] == NSStreamStatusNotOpen )
+		[_stream open];
+    
+    return ( YES );
+}
+
+- (void) stream: (NSStream *) stream handleEvent: (NSStreamEvent) streamEvent
+{
+	NSInputStream * input = (NSInputStream *) _stream;
+	
+	switch ( streamEvent )
+	{
+		case NSStreamEventOpenCompleted:
+		default:
+			break;
+			
 		case NSStreamEventErrorOccurred:
 		{
-			_internal->error = [[input streamError] retain];
-			if ( [_delegate respondsToSelector: @selector(parser:parseErrorOccurred:)] )
-				[_delegate parser: self parseErrorOccurred: _internal->error];
+			[self _reportStreamError: [input streamError]];
 			[self _setStreamComplete: NO];
 			break;
 		}
 			
 		case NSStreamEventEndEncountered:
 		{
-			xmlParseChunk( _internal->parserContext, NULL, 0, 1 );
+			[self _finishParsing];
 			[self _setStreamComplete: YES];
 			
 			if ( [_internal->debugOutputStream streamStatus] != NSStreamStatusClosed )
@@ -985,18 +1819,33 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 			
 		case NSStreamEventHasBytesAvailable:
 		{
-            if ( _internal->delegateAborted )
+            if ( _internal->delegateAborted || _internal->limitExceeded )
+                break;
+            
+            if ( _internal->readingPaused )
+            {
+                // left in the stream until -resumeReading
+                _internal->readPending = YES;
                 break;
+            }
             
-			uint8_t buf[1024];
-			int len = [input read: buf maxLength: 1024];
-			if ( len > 0 )
+			uint8_t * buf = NULL;
+			NSUInteger len = 0;
+			
+			if ( _internal->streamProvidesBuffer && [input getBuffer: &buf length: &len] && (len > 0) )
+			{
+				// parse straight out of the stream's own buffer, then tell it what we used
+				[self _pushStreamData: buf length: len];
+				[(id<AQXMLParserBufferedInputStream>)input consumeBufferedBytes: len];
+				[self _updateProgressWithLength: len];
+				break;
+			}
+			
+			NSInteger numRead = [input read: _internal->readBuffer maxLength: _internal->readBufferSize];
+			if ( numRead > 0 )
 			{
-				char * found = strnstr( (char *)buf, "&#x13;", len );
-				if ( found != NULL )
-					memcpy( found, "[ARGH]", 6 );
-				
-				[self _pushXMLData: buf length: len];
+				[self _pushStreamData: _internal->readBuffer length: numRead];
+				[self _updateProgressWithLength: numRead];
 			}
 			
 			break;
@@ -1004,305 +1853,1484 @@ static void __ignorableWhitespace( void * ctx, const xmlChar * ch, int len )
 	}
 }
 
-- (void) abortParsing
+- (void) abortParsing
+{
+	_internal->delegateAborted = YES;
+	
+	if ( _internal->worker != nil )
+	{
+		// the context belongs to the worker's parsing thread; it'll stop the parser itself
+		[_internal->worker cancel];
+	}
+	else if ( _internal->parserContext != NULL )
+	{
+		xmlStopParser( _internal->parserContext );
+	}
+    
+	[self _setStreamComplete: NO];  // must tell any async delegates that we're done parsing
+	
+	// if there's no async delegate (i.e. if we are parsing synchronously) then explicitly wake the runloop
+	CFRunLoopRef rl = [_internal->waitingRunLoop getCFRunLoop];
+	if ( rl != NULL )
+		CFRunLoopWakeUp( rl );
+}
+
+- (NSError *) parserError
+{
+	return ( [[_internal->error retain] autorelease] );
+}
+
+- (BOOL) resetWithStream: (NSInputStream *) stream
+{
+	if ( (_internal->worker != nil) || ((_internal->parserContext != NULL) && (_streamComplete == NO)) )
+		return ( NO );
+	
+	if ( _internal->mappedFile != -1 )
+		[self _closeMappedFile];
+	[_internal->mappedRunLoopModes release];
+	_internal->mappedRunLoopModes = nil;
+	
+	if ( _stream != nil )
+	{
+		[_stream setDelegate: nil];
+		for ( NSString * mode in _internal->readRunLoopModes )
+			[_stream removeFromRunLoop: _internal->readRunLoop forMode: mode];
+		[_stream close];
+		[_stream release];
+	}
+	_stream = [stream retain];
+	_streamComplete = NO;
+	
+	[_internal->readRunLoopModes release];
+	_internal->readRunLoopModes = nil;
+	_internal->readRunLoop = nil;
+	_internal->readingPaused = NO;
+	_internal->readPending = NO;
+	
+	[_internal->error release];
+	_internal->error = nil;
+	_internal->delegateAborted = NO;
+	[_internal->namespaces removeAllObjects];
+	
+	_internal->characterBufferLength = 0;
+	_internal->filterCarryLength = 0;
+	
+	_internal->limitDepth = 0;
+	_internal->textNodeLength = 0;
+	_internal->documentLength = 0;
+	_internal->limitExceeded = NO;
+	
+	// recompiled along with the context
+	[_internal->pathFilter release];
+	_internal->pathFilter = nil;
+	
+	_internal->elementDepth = 0;
+	_internal->checkpointBase = 0;
+	_internal->checkpointOffset = 0;
+	[_internal->openElements release];
+	_internal->openElements = nil;
+	[_internal->checkpointOpenElements release];
+	_internal->checkpointOpenElements = nil;
+	[_internal->resumeCheckpoint release];
+	_internal->resumeCheckpoint = nil;
+	
+	if ( _internal->counters != NULL )
+		memset( _internal->counters, 0, sizeof(AQXMLParserCounters) );
+	
+	_internal->asyncDelegate = nil;
+	_internal->asyncSelector = NULL;
+	_internal->asyncContext = NULL;
+	
+	_internal->expectedDataLength = 0.0f;
+	_internal->currentLength = 0.0f;
+	_internal->lastProgressLength = 0.0f;
+	_internal->lastProgressTime = 0.0;
+	_internal->expectedLengthChecked = NO;
+	
+	// the context itself is reset when the first bytes of the new document arrive
+	_internal->contextNeedsReset = (_internal->parserContext != NULL);
+	
+	return ( YES );
+}
+
+- (BOOL) resetWithData: (NSData *) data
+{
+	NSInputStream * stream = [[NSInputStream alloc] initWithData: data];
+	BOOL result = [self resetWithStream: stream];
+	if ( result )
+		_internal->expectedDataLength = (float) [data length];
+	[stream release];
+	return ( result );
+}
+
+- (void) pauseReading
+{
+	if ( _internal->readingPaused )
+		return;
+	
+	_internal->readingPaused = YES;
+	
+	// the worker's parsing thread stops taking chunks, and its reader stops once its queue fills
+	if ( _internal->worker != nil )
+		[_internal->worker setPaused: YES];
+}
+
+- (void) resumeReading
+{
+	if ( _internal->readingPaused == NO )
+		return;
+	
+	_internal->readingPaused = NO;
+	
+	if ( _internal->worker != nil )
+	{
+		[_internal->worker setPaused: NO];
+		return;
+	}
+	
+	if ( (_internal->readPending == NO) || _streamComplete )
+		return;
+	
+	_internal->readPending = NO;
+	
+	// we may well be inside a delegate callback, so the read waits for the runloop
+	if ( _internal->mappedFile != -1 )
+	{
+		[_internal->readRunLoop performSelector: @selector(_parseMappedSlices)
+										 target: self
+									   argument: nil
+										  order: 0
+										  modes: _internal->mappedRunLoopModes];
+	}
+	else
+	{
+		[_internal->readRunLoop performSelector: @selector(_readPausedStream)
+										 target: self
+									   argument: nil
+										  order: 0
+										  modes: _internal->readRunLoopModes];
+	}
+}
+
+- (BOOL) isReadingPaused
+{
+	return ( _internal->readingPaused );
+}
+
+@end
+
+@implementation AQXMLParser (AQXMLParserLocatorAdditions)
+
+- (NSString *) publicID
+{
+	return ( nil );
+}
+
+- (NSString *) systemID
+{
+	return ( nil );
+}
+
+- (NSInteger) lineNumber
+{
+	if ( _internal->parserContext == NULL )
+		return ( 0 );
+	
+	return ( xmlSAX2GetLineNumber(_internal->parserContext) );
+}
+
+- (NSInteger) columnNumber
+{
+	if ( _internal->parserContext == NULL )
+		return ( 0 );
+	
+	return ( xmlSAX2GetColumnNumber(_internal->parserContext) );
+}
+
+@end
+
+@implementation AQXMLParser (AQXMLParserBackgroundParsing)
+
+- (BOOL) parseInBackgroundDeliveringEventsToThread: (NSThread *) targetThread
+								 notifyingDelegate: (id) asyncCompletionDelegate
+										  selector: (SEL) completionSelector
+										   context: (void *) contextPtr
+{
+	if ( (_stream == nil) || (_internal->worker != nil) || (_internal->parserContext != NULL) )
+		return ( NO );
+	
+	if ( targetThread == nil )
+		targetThread = [NSThread currentThread];
+	
+	_streamComplete = NO;
+	
+	_internal->asyncDelegate = asyncCompletionDelegate;
+	_internal->asyncSelector = completionSelector;
+	_internal->asyncContext  = contextPtr;
+	
+	_internal->worker = [[_AQXMLParserWorker alloc] initWithParser: self
+															stream: _stream
+													  targetThread: targetThread];
+	if ( _internal->readingPaused )
+		[_internal->worker setPaused: YES];
+	
+	// route delegate messages through the worker's batching proxy
+	_internal->eventProxy = [_internal->worker eventProxy];
+	[self _resolveDelegateCapabilities];
+	
+	[_internal->worker start];
+	return ( YES );
+}
+
+- (NSUInteger) maxQueuedChunks
+{
+	return ( _internal->maxQueuedChunks );
+}
+
+- (void) setMaxQueuedChunks: (NSUInteger) value
+{
+	if ( (_internal->worker != nil) || (value == 0) )
+		return;
+	
+	_internal->maxQueuedChunks = value;
+}
+
+- (NSUInteger) eventBatchSize
+{
+	return ( _internal->eventBatchSize );
+}
+
+- (void) setEventBatchSize: (NSUInteger) value
+{
+	if ( (_internal->worker != nil) || (value == 0) )
+		return;
+	
+	_internal->eventBatchSize = value;
+}
+
+@end
+
+@implementation AQXMLParser (AQXMLParserHTTPStreamAdditions)
+
+- (HTTPMessage *) finalRequest
+{
+	return ( [_stream finalRequestMessage] );
+}
+
+- (HTTPMessage *) finalResponse
+{
+	return ( [_stream responseMessageHeader] );
+}
+
+@end
+
+
+@implementation AQXMLParser (Internal)
+
+- (void) _setParserError: (int) err
+{
+	[_internal->error release];
+	_internal->error = [[NSError alloc] initWithDomain: NSXMLParserErrorDomain
+												  code: err
+											  userInfo: nil];
+}
+
+// called on the parsing thread, which owns the context
+- (void) _limitExceeded: (NSInteger) code
+{
+	if ( _internal->limitExceeded )
+		return;
+	
+	_internal->limitExceeded = YES;
+	[_internal->error release];
+	_internal->error = [[NSError alloc] initWithDomain: AQXMLParserLimitErrorDomain
+												  code: code
+											  userInfo: nil];
+	
+	if ( DelegateImplements(self, AQXMLDelegateParseErrorOccurred) )
+		[EventTarget(self) parser: self parseErrorOccurred: _internal->error];
+	
+	if ( _internal->parserContext != NULL )
+		xmlStopParser( _internal->parserContext );
+}
+
+- (xmlParserCtxtPtr) _xmlParserContext
+{
+	return ( _internal.xmlParserContext );
+}
+
+- (htmlParserCtxtPtr) _htmlParserContext
+{
+    return ( _internal.htmlParserContext );
+}
+
+- (void) _pushNamespaces: (NSDictionary *) nsDict
+{
+	if ( _internal->namespaces == nil )
+		_internal->namespaces = [[NSMutableArray alloc] init];
+	
+	if ( nsDict != nil )
+	{
+		[_internal->namespaces addObject: nsDict];
+		
+		if ( DelegateImplements(self, AQXMLDelegateDidStartMappingPrefix) )
+		{
+			for ( NSString * key in nsDict )
+			{
+				[EventTarget(self) parser: self didStartMappingPrefix: key toURI: [nsDict objectForKey: key]];
+			}
+		}
+	}
+	else
+	{
+		[_internal->namespaces addObject: [NSNull null]];
+	}
+}
+
+- (void) _popNamespaces
+{
+	id obj = [_internal->namespaces lastObject];
+	if ( obj == nil )
+		return;
+	
+	if ( [obj isEqual: [NSNull null]] == NO )
+	{
+		if ( DelegateImplements(self, AQXMLDelegateDidEndMappingPrefix) )
+		{
+			for ( NSString * key in obj )
+			{
+				[EventTarget(self) parser: self didEndMappingPrefix: key];
+			}
+		}
+	}
+	
+	[_internal->namespaces removeLastObject];
+}
+
+- (void) _resolveDelegateCapabilities
+{
+	id delegate = _delegate;
+	NSUInteger flags = 0;
+	
+#define CheckDelegate(sel, flag) if ( [delegate respondsToSelector: @selector(sel)] ) flags |= flag
+	CheckDelegate(parser:foundCharacters:, AQXMLDelegateFoundCharacters);
+	CheckDelegate(parser:foundCharacterBytes:length:, AQXMLDelegateFoundCharacterBytes);
+	CheckDelegate(parser:didStartElement:namespaceURI:qualifiedName:attributes:, AQXMLDelegateDidStartElement);
+	CheckDelegate(parser:didEndElement:namespaceURI:qualifiedName:, AQXMLDelegateDidEndElement);
+	CheckDelegate(parser:didStartMappingPrefix:toURI:, AQXMLDelegateDidStartMappingPrefix);
+	CheckDelegate(parser:didEndMappingPrefix:, AQXMLDelegateDidEndMappingPrefix);
+	CheckDelegate(parser:foundIgnorableWhitespace:, AQXMLDelegateFoundIgnorableWhitespace);
+	CheckDelegate(parser:foundProcessingInstructionWithTarget:data:, AQXMLDelegateFoundProcessingInstruction);
+	CheckDelegate(parser:foundComment:, AQXMLDelegateFoundComment);
+	CheckDelegate(parser:foundCDATA:, AQXMLDelegateFoundCDATA);
+	CheckDelegate(parser:resolveExternalEntityName:systemID:, AQXMLDelegateResolveExternalEntity);
+	CheckDelegate(parser:parseErrorOccurred:, AQXMLDelegateParseErrorOccurred);
+	CheckDelegate(parserDidStartDocument:, AQXMLDelegateDidStartDocument);
+	CheckDelegate(parserDidEndDocument:, AQXMLDelegateDidEndDocument);
+	CheckDelegate(parser:foundNotationDeclarationWithName:publicID:systemID:, AQXMLDelegateFoundNotationDecl);
+	CheckDelegate(parser:foundUnparsedEntityDeclarationWithName:publicID:systemID:notationName:, AQXMLDelegateFoundUnparsedEntityDecl);
+	CheckDelegate(parser:foundAttributeDeclarationWithName:forElement:type:defaultValue:, AQXMLDelegateFoundAttributeDecl);
+	CheckDelegate(parser:foundElementDeclarationWithName:model:, AQXMLDelegateFoundElementDecl);
+	CheckDelegate(parser:foundInternalEntityDeclarationWithName:value:, AQXMLDelegateFoundInternalEntityDecl);
+	CheckDelegate(parser:foundExternalEntityDeclarationWithName:publicID:systemID:, AQXMLDelegateFoundExternalEntityDecl);
+	CheckDelegate(parser:didStartElement:namespaceURI:qualifiedName:attributeCursor:, AQXMLDelegateDidStartElementWithCursor);
+	CheckDelegate(parser:didReachCheckpoint:, AQXMLDelegateDidReachCheckpoint);
+#undef CheckDelegate
+	
+	// the cursor variant is used in preference to the dictionary one
+	if ( flags & AQXMLDelegateDidStartElementWithCursor )
+		flags &= ~AQXMLDelegateDidStartElement;
+	
+	_internal->delegateFlags = flags;
+	
+	// IMPs are looked up on whatever actually receives the messages, which may be a proxy
+	id target = (_internal->eventProxy != nil ? _internal->eventProxy : delegate);
+	Class targetClass = object_getClass( target );
+	
+#define CacheIMP(sel, flag) ((flags & flag) ? class_getMethodImplementation(targetClass, @selector(sel)) : NULL)
+	_internal->foundCharactersIMP = CacheIMP(parser:foundCharacters:, AQXMLDelegateFoundCharacters);
+	_internal->foundCharacterBytesIMP = CacheIMP(parser:foundCharacterBytes:length:, AQXMLDelegateFoundCharacterBytes);
+	_internal->didStartElementIMP = CacheIMP(parser:didStartElement:namespaceURI:qualifiedName:attributes:, AQXMLDelegateDidStartElement);
+	_internal->didEndElementIMP = CacheIMP(parser:didEndElement:namespaceURI:qualifiedName:, AQXMLDelegateDidEndElement);
+	_internal->didStartElementCursorIMP = CacheIMP(parser:didStartElement:namespaceURI:qualifiedName:attributeCursor:, AQXMLDelegateDidStartElementWithCursor);
+#undef CacheIMP
+}
+
+- (void) _initializeSAX2Callbacks
+{
+	xmlSAXHandlerPtr p = _internal.xmlSaxHandler;
+	NSUInteger flags = _internal->delegateFlags;
+	
+	// callbacks which only forward to the delegate are left unregistered when the delegate
+	//  doesn't implement the corresponding method, so libxml2 never calls us for them
+#define IfDelegate(mask, fn) (((flags & (mask)) != 0) ? fn : NULL)
+	
+	BOOL wantsCharacters = ((flags & (AQXMLDelegateFoundCharacters|AQXMLDelegateFoundCharacterBytes)) != 0);
+	BOOL flushesCharacters = ([self shouldBufferCharacters] && wantsCharacters);
+	
+	// limits are enforced whether or not the delegate is listening
+	BOOL enforcesLimits = ((_internal->maxTextNodeLength != 0) || (_internal->maxElementDepth != 0));
+	wantsCharacters = (wantsCharacters || (_internal->maxTextNodeLength != 0));
+	
+	// element boundaries also push/pop namespace mappings & flush buffered characters
+	NSUInteger elementMask = AQXMLDelegateDidStartElement | AQXMLDelegateDidStartElementWithCursor | AQXMLDelegateDidEndElement;
+	if ( [self shouldReportNamespacePrefixes] )
+		elementMask |= AQXMLDelegateDidStartMappingPrefix | AQXMLDelegateDidEndMappingPrefix;
+	// ...and a path filter, tag whitelist, limits or checkpoints have to see every element to know where they are
+	BOOL wantsElements = (flushesCharacters || ((flags & elementMask) != 0) || (_internal->filterPaths != nil) ||
+						  (_internal->checkpointDepth != 0) || (self.HTMLMode && (_internal->tagWhitelist != nil)) ||
+						  enforcesLimits);
+	
+	p->internalSubset = __internalSubset2;
+	p->isStandalone = __isStandalone;
+	p->hasInternalSubset = __hasInternalSubset2;
+	p->hasExternalSubset = __hasExternalSubset2;
+	p->resolveEntity = __resolveEntity;
+	p->getEntity = __getEntity;
+	p->entityDecl = __entityDecl;
+	p->notationDecl = IfDelegate(AQXMLDelegateFoundNotationDecl, __notationDecl);
+	p->attributeDecl = IfDelegate(AQXMLDelegateFoundAttributeDecl, __attributeDecl);
+	p->elementDecl = IfDelegate(AQXMLDelegateFoundElementDecl, __elementDecl);
+	p->unparsedEntityDecl = __unparsedEntityDecl;
+	p->setDocumentLocator = NULL;
+	p->startDocument = __startDocument;
+	p->endDocument = ((flushesCharacters || (flags & AQXMLDelegateDidEndDocument)) ? __endDocument : NULL);
+	
+	if ( self.HTMLMode )
+	{
+		// for HTML, we use the non-NS callbacks; for XML, we don't want these to get in the way.
+		p->startElement = (wantsElements ? __startElement : NULL);
+		p->endElement = (wantsElements ? __endElement : NULL);
+	}
+	else
+	{
+		p->startElement = NULL; //__startElement;
+		p->endElement = NULL; //__endElement;
+	}
+	p->startElementNs = (wantsElements ? __startElementNS : NULL);
+	p->endElementNs = (wantsElements ? __endElementNS : NULL);
+	p->reference = NULL;
+	p->characters = (wantsCharacters ? __characters : NULL);
+	p->ignorableWhitespace = IfDelegate(AQXMLDelegateFoundIgnorableWhitespace, __ignorableWhitespace);
+	p->processingInstruction = IfDelegate(AQXMLDelegateFoundProcessingInstruction, __processingInstruction);
+	p->warning = NULL;
+	p->error = IfDelegate(AQXMLDelegateParseErrorOccurred, __errorCallback);
+	xmlSetStructuredErrorFunc( self, __structuredErrorFunc );
+	p->getParameterEntity = __getParameterEntity;
+	// without a cdataBlock callback libxml2 reports CDATA through characters instead, so keep
+	//  it registered while characters are being consumed
+	p->cdataBlock = (wantsCharacters || (flags & AQXMLDelegateFoundCDATA) ? __cdataBlock : NULL);
+	p->comment = IfDelegate(AQXMLDelegateFoundComment, __comment);
+	p->externalSubset = __externalSubset2;
+	p->initialized = XML_SAX2_MAGIC;
+	
+#undef IfDelegate
+	
+	if ( _internal->counters != NULL )
+	{
+#define Counted(callback, counted) if ( p->callback != NULL ) p->callback = counted
+		Counted(startElementNs, __countedStartElementNS);
+		Counted(endElementNs, __countedEndElementNS);
+		Counted(startElement, __countedStartElement);
+		Counted(endElement, __countedEndElement);
+		Counted(characters, __countedCharacters);
+		Counted(ignorableWhitespace, __countedIgnorableWhitespace);
+		Counted(cdataBlock, __countedCdataBlock);
+		Counted(comment, __countedComment);
+		Counted(processingInstruction, __countedProcessingInstruction);
+#undef Counted
+	}
+	
+	if ( (_internal->checkpointDepth != 0) && (self.HTMLMode == NO) )
+	{
+		_internal->checkpointedStartElementNs = p->startElementNs;
+		_internal->checkpointedEndElementNs = p->endElementNs;
+		p->startElementNs = __checkpointStartElementNS;
+		p->endElementNs = __checkpointEndElementNS;
+	}
+}
+
+// returns NO if the bytes still need to be parsed
+- (BOOL) _initializeParserWithBytes: (const void *) buf length: (NSUInteger) length
+{
+    // pick up any option or delegate changes made since the handler was last set up
+    [self _initializeSAX2Callbacks];
+    _internal->contextNeedsReset = NO;
+    
+    if ( self.HTMLMode )
+    {
+        // there's no way to reset an HTML push context, so after -resetWithStream: it's replaced,
+        //  along with its dictionary & the names we interned from it
+        if ( _internal->parserContext != NULL )
+        {
+            htmlFreeParserCtxt( _internal.htmlParserContext );
+            CFDictionaryRemoveAllValues( _internal->internedNames );
+        }
+        
+        htmlSAXHandlerPtr saxPtr = _internal.htmlSaxHandler;
+        _internal->parserContext = htmlCreatePushParserCtxt( saxPtr, self,
+                                                             (const char *)(length > 0 ? buf : NULL),
+                                                             length, NULL, XML_CHAR_ENCODING_UTF8 );
+        
+        htmlCtxtUseOptions( _internal.htmlParserContext, XML_PARSE_RECOVER );
+        CompileWhitelistNames( _internal );
+    }
+    else
+    {
+        // a resumed parse begins with the checkpoint's open elements rather than these bytes
+        if ( _internal->resumeCheckpoint != nil )
+            length = 0;
+        
+        if ( _internal->parserContext != NULL )
+        {
+            // reusing the last document's context, dictionary & all; it keeps its own copy of
+            //  the SAX handler, which may have changed since then
+            xmlParserCtxtPtr p = _internal.xmlParserContext;
+            xmlCtxtResetPush( p, (const char *)(length > 0 ? buf : NULL), length, NULL, NULL );
+            memcpy( p->sax, _internal.xmlSaxHandler, sizeof(xmlSAXHandler) );
+            p->_private = NULL;
+        }
+        else
+        {
+            _internal->parserContext = xmlCreatePushParserCtxt( _internal.xmlSaxHandler, self,
+                                                               (const char *)(length > 0 ? buf : NULL),
+                                                               length, NULL );
+        }
+    
+        int options = [self shouldResolveExternalEntities] ? 
+                XML_PARSE_RECOVER | XML_PARSE_NOENT | XML_PARSE_DTDLOAD :
+                XML_PARSE_RECOVER | XML_PARSE_DTDATTR;
+        
+        xmlCtxtUseOptions( _internal->parserContext, options );
+    }
+    
+    if ( _internal->filterPaths != nil )
+    {
+        // the HTML parser doesn't promise to intern its names, so those are compared as strings
+        xmlDictPtr dict = (self.HTMLMode ? NULL : _internal.xmlParserContext->dict);
+        [_internal->pathFilter release];
+        _internal->pathFilter = [[_AQXMLPathFilter alloc] initWithPaths: _internal->filterPaths
+                                                              dictionary: dict
+                                                                   error: NULL];
+    }
+    
+    if ( (_internal->checkpointDepth != 0) && (_internal->openElements == nil) )
+        _internal->openElements = [[NSArray alloc] init];
+    
+    if ( (_internal->resumeCheckpoint != nil) && (self.HTMLMode == NO) )
+    {
+        [self _resumeFromCheckpoint: _internal->resumeCheckpoint];
+        return ( NO );
+    }
+    
+    return ( YES );
+}
+
+- (void) _resumeFromCheckpoint: (AQXMLParserCheckpoint *) checkpoint
+{
+    xmlParserCtxtPtr p = _internal.xmlParserContext;
+    NSArray * openElements = [checkpoint _openElements];
+    NSString * encodingName = [checkpoint _encoding];
+    
+    // an XML declaration to set the encoding, followed by a start tag for each open element,
+    //  complete with the namespaces it declared
+    NSMutableString * prefix = [NSMutableString stringWithString: @"<?xml version=\"1.0\""];
+    if ( encodingName != nil )
+        [prefix appendFormat: @" encoding=\"%@\"", encodingName];
+    [prefix appendString: @"?>"];
+    
+    for ( NSDictionary * element in openElements )
+    {
+        NSString * elementPrefix = [element objectForKey: AQCheckpointPrefixKey];
+        NSString * localName = [element objectForKey: AQCheckpointLocalNameKey];
+        if ( elementPrefix != nil )
+            [prefix appendFormat: @"<%@:%@", elementPrefix, localName];
+        else
+            [prefix appendFormat: @"<%@", localName];
+        
+        NSDictionary * namespaces = [element objectForKey: AQCheckpointNamespacesKey];
+        for ( NSString * nsPrefix in namespaces )
+        {
+            NSMutableString * uri = [[namespaces objectForKey: nsPrefix] mutableCopy];
+            [uri replaceOccurrencesOfString: @"&" withString: @"&amp;" options: 0 range: NSMakeRange(0, [uri length])];
+            [uri replaceOccurrencesOfString: @"<" withString: @"&lt;" options: 0 range: NSMakeRange(0, [uri length])];
+            [uri replaceOccurrencesOfString: @"\"" withString: @"&quot;" options: 0 range: NSMakeRange(0, [uri length])];
+            
+            if ( [nsPrefix length] == 0 )
+                [prefix appendFormat: @" xmlns=\"%@\"", uri];
+            else
+                [prefix appendFormat: @" xmlns:%@=\"%@\"", nsPrefix, uri];
+            [uri release];
+        }
+        
+        [prefix appendString: @">"];
+    }
+    
+    NSStringEncoding encoding = NSUTF8StringEncoding;
+    if ( encodingName != nil )
+    {
+        CFStringEncoding cfEncoding = CFStringConvertIANACharSetNameToEncoding( (CFStringRef) encodingName );
+        if ( cfEncoding != kCFStringEncodingInvalidId )
+            encoding = CFStringConvertEncodingToNSStringEncoding( cfEncoding );
+    }
+    
+    NSData * data = [prefix dataUsingEncoding: encoding allowLossyConversion: YES];
+    
+    // libxml2 needs to see the elements opened, but the delegate has already been told about
+    //  them, so nothing beyond setting up the document is done while it does
+    xmlSAXHandler silentHandler;
+    memset( &silentHandler, 0, sizeof(xmlSAXHandler) );
+    silentHandler.initialized = XML_SAX2_MAGIC;
+    silentHandler.startDocument = __resumeStartDocument;
+    
+    xmlSAXHandlerPtr handler = p->sax;
+    p->sax = &silentHandler;
+    xmlParseChunk( p, (const char *)[data bytes], (int)[data length], 0 );
+    p->sax = handler;
+    
+    if ( _internal->maxElementDepth != 0 )
+        _internal->limitDepth = [openElements count];
+    
+    // offsets are reported relative to the original document
+    _internal->checkpointBase = (long long) [checkpoint byteOffset] - (long long) xmlByteConsumed( p );
+    _internal->elementDepth = [openElements count];
+    [_internal->openElements release];
+    _internal->openElements = [openElements retain];
+    
+    // bring the path filter & namespace scopes up to the same place
+    BOOL reportNS = [self shouldReportNamespacePrefixes];
+    if ( reportNS && (_internal->namespaces == nil) )
+        _internal->namespaces = [[NSMutableArray alloc] init];
+    
+    for ( NSDictionary * element in openElements )
+    {
+        if ( _internal->pathFilter != nil )
+        {
+            NSString * elementPrefix = [element objectForKey: AQCheckpointPrefixKey];
+            const xmlChar * localname = xmlDictLookup( p->dict, (const xmlChar *)[[element objectForKey: AQCheckpointLocalNameKey] UTF8String], -1 );
+            const xmlChar * nsPrefix = (elementPrefix != nil ? xmlDictLookup(p->dict, (const xmlChar *)[elementPrefix UTF8String], -1) : NULL);
+            if ( AQXMLPathFilterStartElement(_internal->pathFilter, localname, nsPrefix) == NO )
+                continue;
+        }
+        
+        if ( reportNS )
+        {
+            NSDictionary * namespaces = [element objectForKey: AQCheckpointNamespacesKey];
+            [_internal->namespaces addObject: ([namespaces count] != 0 ? (id)namespaces : (id)[NSNull null])];
+        }
+    }
+}
+
+- (void) _pushXMLData: (const void *) bytes length: (NSUInteger) length
+{
+	if ( _internal->debugOutputStream != nil )
+		[_internal->debugOutputStream write: bytes maxLength: length];
+	
+	if ( _internal->limitExceeded )
+		return;
+	
+	_internal->documentLength += length;
+	if ( (_internal->maxDocumentLength != 0) && (_internal->documentLength > _internal->maxDocumentLength) )
+	{
+		[self _limitExceeded: AQXMLParserDocumentTooLongError];
+		[self _setStreamComplete: NO];
+		return;
+	}
+	
+	AQXMLParserCounters * counters = _internal->counters;
+	if ( counters != NULL )
+		counters->bytesPushed += length;
+	
+    if ( ((_internal->parserContext == NULL) || _internal->contextNeedsReset) &&
+         [self _initializeParserWithBytes: bytes length: length] )
+        return;
+    
+    uint64_t start = (counters != NULL ? mach_absolute_time() : 0);
+    
+    int err = XML_ERR_OK;
+    if ( self.HTMLMode )
+        err = htmlParseChunk( _internal.htmlParserContext, (const char *)bytes, length, 0 );
+    else
+        err = xmlParseChunk( _internal.xmlParserContext, (const char *)bytes, length, 0 );
+    
+    if ( counters != NULL )
+    {
+        counters->parseChunkCalls++;
+        counters->parseTime += mach_absolute_time() - start;
+    }
+    
+    if ( _internal->limitExceeded )
+    {
+        // stopped by one of our own limits, which has already set the error
+        [self _setStreamComplete: NO];
+    }
+    else if ( err != XML_ERR_OK )
+    {
+		NSData * data = [[NSData alloc] initWithBytesNoCopy: (void *)bytes length: length freeWhenDone: NO];
+		NSString * str = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
+		NSLog( @"Error %d in bytes: %@ (str: %@)", err, data, str );
+		[str release];
+		[data release];
+		
+        [self _setParserError: err];
+        [self _setStreamComplete: NO];
+    }
+}
+
+- (void) _pushStreamData: (const uint8_t *) bytes length: (NSUInteger) length
+{
+	if ( [self shouldFilterControlCharacterReferences] == NO )
+	{
+		[self _pushXMLData: bytes length: length];
+		return;
+	}
+	
+	// we never write into the input bytes, since they may belong to the stream; instead the
+	//  data is pushed in runs, with the replacement pushed in place of each match
+	const uint8_t * end = bytes + length;
+	
+	if ( _internal->filterCarryLength != 0 )
+	{
+		// the last read ended part-way through something that looked like a match
+		NSUInteger carried = _internal->filterCarryLength;
+		NSUInteger needed = CONTROL_REF_LENGTH - carried;
+		NSUInteger compare = MIN(needed, length);
+		
+		if ( memcmp(bytes, __controlRefPattern + carried, compare) == 0 )
+		{
+			if ( compare < needed )
+			{
+				// still incomplete
+				memcpy( _internal->filterCarry + carried, bytes, compare );
+				_internal->filterCarryLength += compare;
+				return;
+			}
+			
+			_internal->filterCarryLength = 0;
+			[self _pushXMLData: __controlRefReplacement length: CONTROL_REF_LENGTH];
+			bytes += needed;
+		}
+		else
+		{
+			// not a match after all; the pattern can't overlap itself, so the carried bytes are
+			//  just passed through
+			[self _flushFilterCarry];
+		}
+	}
+	
+	const uint8_t * runStart = bytes;
+	const uint8_t * p = bytes;
+	
+	while ( (p < end) && ((p = memchr(p, '&', end - p)) != NULL) )
+	{
+		NSUInteger remaining = end - p;
+		if ( remaining < CONTROL_REF_LENGTH )
+		{
+			if ( memcmp(p, __controlRefPattern, remaining) == 0 )
+			{
+				// hold back a possible match until the next read arrives
+				if ( p > runStart )
+					[self _pushXMLData: runStart length: p - runStart];
+				memcpy( _internal->filterCarry, p, remaining );
+				_internal->filterCarryLength = remaining;
+				return;
+			}
+		}
+		else if ( memcmp(p, __controlRefPattern, CONTROL_REF_LENGTH) == 0 )
+		{
+			if ( p > runStart )
+				[self _pushXMLData: runStart length: p - runStart];
+			[self _pushXMLData: __controlRefReplacement length: CONTROL_REF_LENGTH];
+			
+			p += CONTROL_REF_LENGTH;
+			runStart = p;
+			continue;
+		}
+		
+		p++;
+	}
+	
+	if ( end > runStart )
+		[self _pushXMLData: runStart length: end - runStart];
+}
+
+- (void) _flushFilterCarry
+{
+	if ( _internal->filterCarryLength == 0 )
+		return;
+	
+	NSUInteger length = _internal->filterCarryLength;
+	_internal->filterCarryLength = 0;
+	[self _pushXMLData: _internal->filterCarry length: length];
+}
+
+- (void) _finishParsing
+{
+	[self _flushFilterCarry];
+	
+	if ( (_progressDelegate != nil) && (_internal->expectedDataLength > 0.0) )
+		[self _sendProgress: 1.0f];
+	
+	if ( _internal->parserContext == NULL )
+		return;
+	
+	AQXMLParserCounters * counters = _internal->counters;
+	uint64_t start = (counters != NULL ? mach_absolute_time() : 0);
+	
+	if ( self.HTMLMode )
+		htmlParseChunk( _internal.htmlParserContext, NULL, 0, 1 );
+	else
+		xmlParseChunk( _internal.xmlParserContext, NULL, 0, 1 );
+	
+	if ( counters != NULL )
+	{
+		counters->parseChunkCalls++;
+		counters->parseTime += mach_absolute_time() - start;
+	}
+}
+
+- (void) _reportStreamError: (NSError *) error
+{
+	[_internal->error release];
+	_internal->error = [error retain];
+	
+	if ( DelegateImplements(self, AQXMLDelegateParseErrorOccurred) )
+		[EventTarget(self) parser: self parseErrorOccurred: error];
+}
+
+- (void) _backgroundParseFinished
+{
+	// any further delegate messages go straight to the delegate once more
+	_internal->eventProxy = nil;
+	[self _resolveDelegateCapabilities];
+	
+	[_internal->worker autorelease];
+	_internal->worker = nil;
+}
+
+- (_AQXMLParserInternal *) _info
+{
+	return ( _internal );
+}
+
+- (void) _setStreamComplete: (BOOL) parsedOK
+{
+	if ( (_internal->worker != nil) && ([_internal->worker isTargetThread] == NO) )
+	{
+		// called from the worker's parsing thread: stop there, and let the worker report
+		//  completion on the target thread once all pending delegate events are delivered
+		[_internal->worker stopParsing];
+		return;
+	}
+	
+	_streamComplete = YES;
+    
+    if ( _internal->asyncDelegate != nil )
+    {
+        @try
+        {
+            NSMethodSignature * sig = [_internal->asyncDelegate methodSignatureForSelector: _internal->asyncSelector];
+            NSInvocation * invoc = [NSInvocation invocationWithMethodSignature: sig];
+            
+            [invoc setTarget: _internal->asyncDelegate];
+            [invoc setSelector: _internal->asyncSelector];
+			
+			switch ( [sig numberOfArguments] )
+			{
+				default:		// yes, these are designed to fall through
+				case 5:
+					[invoc setArgument: &_internal->asyncContext atIndex: 4];
+				case 4:
+					[invoc setArgument: &parsedOK atIndex: 3];
+				case 3:
+					[invoc setArgument: &self atIndex: 2];
+					break;
+			}
+            
+            [invoc invoke];
+        }
+        @catch (NSException * e)
+        {
+            NSLog( @"Caught %@ while calling AQXMLParser async delegate: %@", e.name, e.reason );
+            @throw;
+        }
+    }
+}
+
+// called on the thread reading the stream
+- (void) _updateProgressWithLength: (NSUInteger) length
+{
+	if ( _progressDelegate == nil )
+		return;
+	
+	// response headers aren't available until data starts to arrive
+	if ( _internal->expectedLengthChecked == NO )
+	{
+		_internal->expectedLengthChecked = YES;
+		if ( _internal->expectedDataLength == 0.0 )
+			_internal->expectedDataLength = [self _expectedLengthOfStream];
+		_internal->streamReportsCompressedBytes = [_stream respondsToSelector: @selector(compressedBytesRead)];
+	}
+	
+	// the expected length of a decompressing stream is that of the data being downloaded, so
+	//  that's what we measure against
+	float position = -1.0f;
+	if ( _internal->streamReportsCompressedBytes )
+		position = (float) [(id<AQXMLParserProgressSource>)_stream compressedBytesRead];
+	
+	[self _updateProgressWithLength: length streamPosition: position expectedLength: 0.0f];
+}
+
+// Doesn't touch the stream, so the background parsing thread can call it with values the reader
+//  thread sampled when it read each chunk. A negative position means the stream can't report
+//  one, so the length is added up instead; an expected length of zero means it's unknown.
+- (void) _updateProgressWithLength: (NSUInteger) length streamPosition: (float) position expectedLength: (float) expected
+{
+	if ( _progressDelegate == nil )
+		return;
+	
+	if ( (_internal->expectedDataLength == 0.0) && (expected > 0.0) )
+		_internal->expectedDataLength = expected;
+	
+	if ( position >= 0.0f )
+		_internal->currentLength = position;
+	else
+		_internal->currentLength += (float) length;
+	
+	if ( _internal->expectedDataLength <= 0.0 )
+		return;
+	
+	// don't flood the delegate when reading in small pieces
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	if ( (_internal->currentLength - _internal->lastProgressLength < (float) _internal->progressUpdateByteCount) ||
+		 (now - _internal->lastProgressTime < _internal->progressUpdateInterval) )
+		return;
+	
+	_internal->lastProgressLength = _internal->currentLength;
+	_internal->lastProgressTime = now;
+	
+	[self _sendProgress: MIN(1.0f, _internal->currentLength / _internal->expectedDataLength)];
+}
+
+- (BOOL) _parseMappedFile
+{
+	_streamComplete = NO;
+	
+	while ( [self _pushNextMappedSlice] )
+		;
+	
+	if ( (_streamComplete == NO) && (_internal->delegateAborted == NO) )
+	{
+		[self _finishParsing];
+		[self _setStreamComplete: YES];
+	}
+	
+	[self _closeMappedFile];
+	
+	return ( (_internal->error == nil) && (_internal->delegateAborted == NO) );
+}
+
+- (void) _parseMappedSlices
+{
+	NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+	
+	if ( _internal->readingPaused && (_streamComplete == NO) )
+	{
+		// -resumeReading will schedule us again
+		_internal->readPending = YES;
+	}
+	else if ( [self _pushNextMappedSlice] )
+	{
+		// let everything else on the runloop have a go before the next one
+		[[NSRunLoop currentRunLoop] performSelector: @selector(_parseMappedSlices)
+											 target: self
+										   argument: nil
+											  order: 0
+											  modes: _internal->mappedRunLoopModes];
+	}
+	else
+	{
+		if ( (_streamComplete == NO) && (_internal->delegateAborted == NO) )
+		{
+			[self _finishParsing];
+			[self _setStreamComplete: YES];
+		}
+		
+		[self _closeMappedFile];
+	}
+	
+	[pool drain];
+}
+
+// returns NO once there's nothing more to push
+- (BOOL) _pushNextMappedSlice
+{
+	if ( _streamComplete || _internal->delegateAborted )
+		return ( NO );
+	
+	if ( (_internal->mappedWindow != NULL) && (_internal->mappedWindowConsumed == _internal->mappedWindowLength) )
+	{
+		_internal->mappedWindowOffset += _internal->mappedWindowLength;
+		[self _unmapWindow];
+	}
+	
+	if ( _internal->mappedWindow == NULL )
+	{
+		if ( _internal->mappedWindowOffset >= _internal->mappedFileSize )
+			return ( NO );
+		
+		size_t length = (size_t) MIN((unsigned long long)MAPPED_WINDOW_SIZE, _internal->mappedFileSize - _internal->mappedWindowOffset);
+		void * window = mmap( NULL, length, PROT_READ, MAP_FILE | MAP_PRIVATE, _internal->mappedFile, (off_t) _internal->mappedWindowOffset );
+		if ( window == MAP_FAILED )
+		{
+			[self _reportStreamError: [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil]];
+			[self _setStreamComplete: NO];
+			return ( NO );
+		}
+		
+		// we only ever walk forwards through it, so the kernel can read ahead & drop pages behind us
+		madvise( window, length, MADV_SEQUENTIAL );
+		
+		_internal->mappedWindow = (uint8_t *) window;
+		_internal->mappedWindowLength = length;
+		_internal->mappedWindowConsumed = 0;
+	}
+	
+	NSUInteger length = MIN(_internal->readBufferSize, _internal->mappedWindowLength - _internal->mappedWindowConsumed);
+	[self _pushStreamData: _internal->mappedWindow + _internal->mappedWindowConsumed length: length];
+	_internal->mappedWindowConsumed += length;
+	[self _updateProgressWithLength: length];
+	
+	return ( YES );
+}
+
+- (void) _unmapWindow
+{
+	if ( _internal->mappedWindow == NULL )
+		return;
+	
+	munmap( _internal->mappedWindow, _internal->mappedWindowLength );
+	_internal->mappedWindow = NULL;
+	_internal->mappedWindowLength = 0;
+	_internal->mappedWindowConsumed = 0;
+}
+
+// the stream won't tell us about the bytes we left behind again, so we go & get them
+- (void) _readPausedStream
+{
+	if ( _streamComplete || _internal->readingPaused )
+		return;
+	
+	if ( [_stream hasBytesAvailable] )
+		[self stream: _stream handleEvent: NSStreamEventHasBytesAvailable];
+}
+
+- (void) _closeMappedFile
+{
+	[self _unmapWindow];
+	
+	if ( _internal->mappedFile != -1 )
+	{
+		close( _internal->mappedFile );
+		_internal->mappedFile = -1;
+	}
+}
+
+- (void) _sendProgress: (float) progress
+{
+	// the background parsing thread queues it up with everything else bound for the target thread
+	if ( (_internal->worker != nil) && ([_internal->worker isTargetThread] == NO) )
+		[_internal->worker sendProgress: progress toDelegate: _progressDelegate];
+	else
+		[_progressDelegate parser: self updateProgress: progress];
+}
+
+// the length of the download, or zero if it isn't known; called on the thread reading the stream
+- (float) _expectedLengthOfStream
+{
+    float result = 0.0f;
+    
+    CFHTTPMessageRef msg = (CFHTTPMessageRef) [_stream propertyForKey: (NSString *)kCFStreamPropertyHTTPResponseHeader];
+    if ( msg != NULL )
+    {
+        CFStringRef str = CFHTTPMessageCopyHeaderFieldValue( msg, CFSTR("Content-Length") );
+        if ( str != NULL )
+        {
+            result = [(NSString *)str floatValue];
+            CFRelease( str );
+        }
+        return ( result );
+    }
+    
+    NSNumber * num = [_stream propertyForKey: (NSString *)kCFStreamPropertyFTPResourceSize];
+    if ( num != NULL )
+        return ( [num floatValue] );
+    
+    // for some forthcoming stream classes...
+    NSNumber * guess = [_stream propertyForKey: @"UncompressedDataLength"];
+    if ( guess != nil )
+        result = [guess floatValue];
+    
+    return ( result );
+}
+
+@end
+
+#pragma mark -
+
+static BOOL QualifiedNameMatches( const xmlChar * prefix, const xmlChar * localname, const char * name )
+{
+	if ( (prefix != NULL) && (*prefix != '\0') )
+	{
+		size_t len = strlen( (const char *) prefix );
+		if ( (strncmp(name, (const char *) prefix, len) != 0) || (name[len] != ':') )
+			return ( NO );
+		name += len + 1;
+	}
+	
+	return ( strcmp(name, (const char *) localname) == 0 );
+}
+
+static unsigned char * CopyAttributeBytes( unsigned char ** dst, const unsigned char * src, size_t len )
+{
+	if ( src == NULL )
+		return ( NULL );
+	
+	unsigned char * result = *dst;
+	memcpy( result, src, len );
+	result[len] = '\0';
+	*dst += len + 1;
+	return ( result );
+}
+
+@implementation AQXMLAttributeCursor
+
+@synthesize count=_count;
+
+- (void) dealloc
+{
+	if ( _storage != NULL )
+		free( _storage );
+	[super dealloc];
+}
+
+- (void) finalize
+{
+	if ( _storage != NULL )
+		free( _storage );
+	[super finalize];
+}
+
+- (void) _setParser: (AQXMLParser *) parser attributes: (const xmlChar **) attributes
+			  count: (NSUInteger) count stride: (NSUInteger) stride
 {
-	_internal->delegateAborted = YES;
-	if ( _internal->parserContext != NULL )
-		xmlStopParser( _internal->parserContext );
-    
-	[self _setStreamComplete: NO];  // must tell any async delegates that we're done parsing
+	_parser = parser;
+	_attributes = attributes;
+	_count = count;
+	_stride = stride;
+}
+
+// attributes come either from SAX2 (localname/prefix/URI/value/end) or from the HTML parser (name/value)
+- (const unsigned char **) _attributeAtIndex: (NSUInteger) index
+{
+	if ( index >= _count )
+	{
+		[NSException raise: NSRangeException
+					format: @"Index %lu is beyond the end of the attribute cursor (count %lu)",
+							(unsigned long)index, (unsigned long)_count];
+	}
 	
-	// if there's no async delegate (i.e. if we are parsing synchronously) then explicitly wake the runloop
-	CFRunLoopRef rl = [_internal->waitingRunLoop getCFRunLoop];
-	if ( rl != NULL )
-		CFRunLoopWakeUp( rl );
+	return ( _attributes + (index * _stride) );
 }
 
-- (NSError *) parserError
+- (const unsigned char *) _prefixBytesAtIndex: (NSUInteger) index
 {
-	return ( [[_internal->error retain] autorelease] );
+	const unsigned char ** attr = [self _attributeAtIndex: index];
+	return ( _stride == 5 ? attr[1] : NULL );
 }
 
-@end
+- (const unsigned char *) _URIBytesAtIndex: (NSUInteger) index
+{
+	const unsigned char ** attr = [self _attributeAtIndex: index];
+	return ( _stride == 5 ? attr[2] : NULL );
+}
 
-@implementation AQXMLParser (AQXMLParserLocatorAdditions)
+- (NSString *) _stringFromBytes: (const unsigned char *) bytes
+{
+	if ( _parser != nil )
+		return ( InternedNSStringFromXmlChar(_parser, bytes) );
+	return ( [NSStringFromXmlChar(bytes) autorelease] );
+}
 
-- (NSString *) publicID
+- (NSString *) nameAtIndex: (NSUInteger) index
 {
-	return ( nil );
+	const unsigned char * localname = [self _attributeAtIndex: index][0];
+	const unsigned char * prefix = [self _prefixBytesAtIndex: index];
+	
+	if ( _parser != nil )
+		return ( InternedQualifiedName(_parser, prefix, localname) );
+	if ( prefix == NULL )
+		return ( [self _stringFromBytes: localname] );
+	return ( [NSString stringWithFormat: @"%s:%s", prefix, localname] );
 }
 
-- (NSString *) systemID
+- (NSString *) localNameAtIndex: (NSUInteger) index
 {
-	return ( nil );
+	return ( [self _stringFromBytes: [self _attributeAtIndex: index][0]] );
 }
 
-- (NSInteger) lineNumber
+- (NSString *) namespaceURIAtIndex: (NSUInteger) index
 {
-	if ( _internal->parserContext == NULL )
-		return ( 0 );
+	return ( [self _stringFromBytes: [self _URIBytesAtIndex: index]] );
+}
+
+- (const char *) valueBytesAtIndex: (NSUInteger) index length: (NSUInteger *) length
+{
+	const unsigned char ** attr = [self _attributeAtIndex: index];
+	const char * result = NULL;
+	NSUInteger len = 0;
 	
-	return ( xmlSAX2GetLineNumber(_internal->parserContext) );
+	if ( _stride == 5 )
+	{
+		result = (const char *) attr[3];
+		if ( (attr[3] != NULL) && (attr[4] != NULL) )
+			len = attr[4] - attr[3];
+	}
+	else
+	{
+		result = (const char *) attr[1];
+		if ( result != NULL )
+			len = strlen( result );
+	}
+	
+	if ( length != NULL )
+		*length = len;
+	return ( result );
 }
 
-- (NSInteger) columnNumber
+- (NSString *) valueAtIndex: (NSUInteger) index
 {
-	if ( _internal->parserContext == NULL )
-		return ( 0 );
+	NSUInteger length = 0;
+	const char * bytes = [self valueBytesAtIndex: index length: &length];
+	if ( (bytes == NULL) || (length == 0) )
+		return ( @"" );
 	
-	return ( xmlSAX2GetColumnNumber(_internal->parserContext) );
+	return ( [[[NSString alloc] initWithBytes: bytes length: length encoding: NSUTF8StringEncoding] autorelease] );
 }
 
-@end
+- (NSUInteger) indexOfAttributeWithName: (NSString *) qualifiedName
+{
+	const char * name = [qualifiedName UTF8String];
+	if ( name == NULL )
+		return ( NSNotFound );
+	
+	NSUInteger i;
+	for ( i = 0; i < _count; i++ )
+	{
+		if ( QualifiedNameMatches([self _prefixBytesAtIndex: i], [self _attributeAtIndex: i][0], name) )
+			return ( i );
+	}
+	
+	return ( NSNotFound );
+}
 
-@implementation AQXMLParser (AQXMLParserHTTPStreamAdditions)
+- (NSString *) valueForAttributeWithName: (NSString *) qualifiedName
+{
+	NSUInteger index = [self indexOfAttributeWithName: qualifiedName];
+	if ( index == NSNotFound )
+		return ( nil );
+	return ( [self valueAtIndex: index] );
+}
 
-- (HTTPMessage *) finalRequest
+- (NSDictionary *) attributeDictionary
 {
-	return ( [_stream finalRequestMessage] );
+	NSMutableDictionary * result = [NSMutableDictionary dictionaryWithCapacity: _count];
+	
+	NSUInteger i;
+	for ( i = 0; i < _count; i++ )
+		[result setObject: [self valueAtIndex: i] forKey: [self nameAtIndex: i]];
+	
+	return ( result );
 }
 
-- (HTTPMessage *) finalResponse
+- (id) copyWithZone: (NSZone *) zone
 {
-	return ( [_stream responseMessageHeader] );
+	AQXMLAttributeCursor * copy = [[AQXMLAttributeCursor allocWithZone: zone] init];
+	if ( _count == 0 )
+		return ( copy );
+	
+	// everything goes into a single block: SAX2-style pointers, followed by the bytes they refer to
+	size_t pointerSize = _count * 5 * sizeof(const unsigned char *);
+	size_t size = pointerSize;
+	
+	NSUInteger i;
+	for ( i = 0; i < _count; i++ )
+	{
+		const unsigned char * prefix = [self _prefixBytesAtIndex: i];
+		const unsigned char * URI = [self _URIBytesAtIndex: i];
+		NSUInteger valueLength = 0;
+		(void) [self valueBytesAtIndex: i length: &valueLength];
+		
+		size += strlen( (const char *) [self _attributeAtIndex: i][0] ) + 1;
+		size += (prefix != NULL ? strlen((const char *) prefix) + 1 : 0);
+		size += (URI != NULL ? strlen((const char *) URI) + 1 : 0);
+		size += valueLength + 1;
+	}
+	
+	copy->_storage = malloc( size );
+	copy->_attributes = (const unsigned char **) copy->_storage;
+	copy->_count = _count;
+	copy->_stride = 5;
+	
+	const unsigned char ** attrs = (const unsigned char **) copy->_storage;
+	unsigned char * bytes = (unsigned char *) copy->_storage + pointerSize;
+	
+	for ( i = 0; i < _count; i++ )
+	{
+		const unsigned char * localname = [self _attributeAtIndex: i][0];
+		const unsigned char * prefix = [self _prefixBytesAtIndex: i];
+		const unsigned char * URI = [self _URIBytesAtIndex: i];
+		NSUInteger valueLength = 0;
+		const char * value = [self valueBytesAtIndex: i length: &valueLength];
+		
+		attrs[0] = CopyAttributeBytes( &bytes, localname, strlen((const char *) localname) );
+		attrs[1] = CopyAttributeBytes( &bytes, prefix, (prefix != NULL ? strlen((const char *) prefix) : 0) );
+		attrs[2] = CopyAttributeBytes( &bytes, URI, (URI != NULL ? strlen((const char *) URI) : 0) );
+		attrs[3] = CopyAttributeBytes( &bytes, (const unsigned char *) (value != NULL ? value : ""), valueLength );
+		attrs[4] = attrs[3] + valueLength;
+		
+		attrs += 5;
+	}
+	
+	return ( copy );
 }
 
 @end
 
+#pragma mark -
 
-@implementation AQXMLParser (Internal)
+@implementation AQXMLParserStatistics
 
-- (void) _setParserError: (int) err
+@synthesize bytesPushed=_bytesPushed, parseChunkCalls=_parseChunkCalls, elementCount=_elementCount;
+@synthesize characterCallbackCount=_characterCallbackCount, attributeCount=_attributeCount;
+@synthesize stringsAllocated=_stringsAllocated, libxml2Time=_libxml2Time, callbackTime=_callbackTime;
+@synthesize peakElementDepth=_peakElementDepth;
+
+static NSTimeInterval IntervalFromMachTime( uint64_t machTime )
 {
-	[_internal->error release];
-	_internal->error = [[NSError alloc] initWithDomain: NSXMLParserErrorDomain
-												  code: err
-											  userInfo: nil];
+	static mach_timebase_info_data_t __timebase = { 0, 0 };
+	if ( __timebase.denom == 0 )
+		mach_timebase_info( &__timebase );
+	
+	return ( (NSTimeInterval)(machTime * __timebase.numer / __timebase.denom) / 1000000000.0 );
 }
 
-- (xmlParserCtxtPtr) _xmlParserContext
+- (id) _initWithCounters: (const AQXMLParserCounters *) counters
 {
-	return ( _internal.xmlParserContext );
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_bytesPushed = counters->bytesPushed;
+	_parseChunkCalls = counters->parseChunkCalls;
+	_elementCount = counters->elementCount;
+	_characterCallbackCount = counters->characterCallbacks;
+	_attributeCount = counters->attributeCount;
+	_stringsAllocated = counters->stringsAllocated;
+	_peakElementDepth = counters->peakDepth;
+	
+	// callbacks happen inside xmlParseChunk(), so their time is part of the parse time
+	uint64_t libxml2Time = (counters->parseTime > counters->callbackTime ? counters->parseTime - counters->callbackTime : 0);
+	_libxml2Time = IntervalFromMachTime( libxml2Time );
+	_callbackTime = IntervalFromMachTime( counters->callbackTime );
+	
+	return ( self );
 }
 
-- (htmlParserCtxtPtr) _htmlParserContext
+- (NSString *) description
 {
-    return ( _internal.htmlParserContext );
+	return ( [NSString stringWithFormat: @"%@ { %llu bytes in %lu chunks, %lu elements, %lu attributes, "
+			  @"%lu character callbacks, %lu strings, peak depth %lu, libxml2 %.3fs, callbacks %.3fs }",
+			  [super description], _bytesPushed, (unsigned long)_parseChunkCalls, (unsigned long)_elementCount,
+			  (unsigned long)_attributeCount, (unsigned long)_characterCallbackCount,
+			  (unsigned long)_stringsAllocated, (unsigned long)_peakElementDepth, _libxml2Time, _callbackTime] );
 }
 
-- (void) _pushNamespaces: (NSDictionary *) nsDict
+@end
+
+#pragma mark -
+
+@implementation AQXMLParserCheckpoint
+
+@synthesize byteOffset=_byteOffset;
+
+- (id) _initWithOffset: (unsigned long long) offset openElements: (NSArray *) openElements encoding: (NSString *) encoding
 {
-	if ( _internal->namespaces == nil )
-		_internal->namespaces = [[NSMutableArray alloc] init];
+	if ( [super init] == nil )
+		return ( nil );
 	
-	if ( nsDict != nil )
-	{
-		[_internal->namespaces addObject: nsDict];
-		
-		if ( [_delegate respondsToSelector: @selector(parser:didStartMappingPrefix:toURI:)] )
-		{
-			for ( NSString * key in nsDict )
-			{
-				[_delegate parser: self didStartMappingPrefix: key toURI: [nsDict objectForKey: key]];
-			}
-		}
-	}
-	else
-	{
-		[_internal->namespaces addObject: [NSNull null]];
-	}
+	_byteOffset = offset;
+	_openElements = [openElements copy];
+	_encoding = [encoding copy];
+	
+	return ( self );
 }
 
-- (void) _popNamespaces
+- (id) initWithCoder: (NSCoder *) aDecoder
 {
-	id obj = [_internal->namespaces lastObject];
-	if ( obj == nil )
-		return;
+	if ( [super init] == nil )
+		return ( nil );
 	
-	if ( [obj isEqual: [NSNull null]] == NO )
-	{
-		if ( [_delegate respondsToSelector: @selector(parser:didEndMappingPrefix:)] )
-		{
-			for ( NSString * key in obj )
-			{
-				[_delegate parser: self didEndMappingPrefix: key];
-			}
-		}
-	}
+	_byteOffset = (unsigned long long) [aDecoder decodeInt64ForKey: @"byteOffset"];
+	_openElements = [[aDecoder decodeObjectForKey: @"openElements"] retain];
+	_encoding = [[aDecoder decodeObjectForKey: @"encoding"] retain];
 	
-	[_internal->namespaces removeLastObject];
+	return ( self );
 }
 
-- (void) _initializeSAX2Callbacks
+- (void) encodeWithCoder: (NSCoder *) aCoder
 {
-	xmlSAXHandlerPtr p = _internal.xmlSaxHandler;
-	
-	p->internalSubset = __internalSubset2;
-	p->isStandalone = __isStandalone;
-	p->hasInternalSubset = __hasInternalSubset2;
-	p->hasExternalSubset = __hasExternalSubset2;
-	p->resolveEntity = __resolveEntity;
-	p->getEntity = __getEntity;
-	p->entityDecl = __entityDecl;
-	p->notationDecl = __notationDecl;
-	p->attributeDecl = __attributeDecl;
-	p->elementDecl = __elementDecl;
-	p->unparsedEntityDecl = __unparsedEntityDecl;
-	p->setDocumentLocator = NULL;
-	p->startDocument = __startDocument;
-	p->endDocument = __endDocument;
-	p->startElement = NULL; //__startElement;
-	p->endElement = NULL; //__endElement;
-	p->startElementNs = __startElementNS;
-	p->endElementNs = __endElementNS;
-	p->reference = NULL;
-	p->characters = __characters;
-	p->ignorableWhitespace = __ignorableWhitespace;
-	p->processingInstruction = __processingInstruction;
-	p->warning = NULL;
-	p->error = __errorCallback;
-	xmlSetStructuredErrorFunc( self, __structuredErrorFunc );
-	p->getParameterEntity = __getParameterEntity;
-	p->cdataBlock = __cdataBlock;
-	p->comment = __comment;
-	p->externalSubset = __externalSubset2;
-	p->initialized = XML_SAX2_MAGIC;
+	[aCoder encodeInt64: (int64_t) _byteOffset forKey: @"byteOffset"];
+	[aCoder encodeObject: _openElements forKey: @"openElements"];
+	[aCoder encodeObject: _encoding forKey: @"encoding"];
 }
 
-- (void) _initializeParserWithBytes: (const void *) buf length: (NSUInteger) length
+- (void) dealloc
 {
-    if ( self.HTMLMode )
-    {
-        // for HTML, we use the non-NS callbacks; for XML, we don't want these to get in the way.
-        htmlSAXHandlerPtr saxPtr = _internal.htmlSaxHandler;
-        saxPtr->startElement = __startElement;
-        saxPtr->endElement = __endElement;
-        
-        _internal->parserContext = htmlCreatePushParserCtxt( saxPtr, self,
-                                                             (const char *)(length > 0 ? buf : NULL),
-                                                             length, NULL, XML_CHAR_ENCODING_UTF8 );
-        
-        htmlCtxtUseOptions( _internal.htmlParserContext, XML_PARSE_RECOVER );
-    }
-    else
-    {
-        _internal->parserContext = xmlCreatePushParserCtxt( _internal.xmlSaxHandler, self,
-                                                           (const char *)(length > 0 ? buf : NULL),
-                                                           length, NULL );
-    
-        int options = [self shouldResolveExternalEntities] ? 
-                XML_PARSE_RECOVER | XML_PARSE_NOENT | XML_PARSE_DTDLOAD :
-                XML_PARSE_RECOVER | XML_PARSE_DTDATTR;
-        
-        xmlCtxtUseOptions( _internal->parserContext, options );
-    }
+	[_openElements release];
+	[_encoding release];
+	[super dealloc];
 }
 
-- (void) _pushXMLData: (const void *) bytes length: (NSUInteger) length
+- (NSArray *) _openElements
 {
-	if ( _internal->debugOutputStream != nil )
-		[_internal->debugOutputStream write: bytes maxLength: length];
-	
-    if ( _internal->parserContext == NULL )
-    {
-        [self _initializeParserWithBytes: bytes length: length];
-    }
-    else
-    {
-        int err = XML_ERR_OK;
-        if ( self.HTMLMode )
-            err = htmlParseChunk( _internal.htmlParserContext, (const char *)bytes, length, 0 );
-        else
-            err = xmlParseChunk( _internal.xmlParserContext, (const char *)bytes, length, 0 );
-        
-        if ( err != XML_ERR_OK )
-        {
-			NSData * data = [[NSData alloc] initWithBytesNoCopy: (void *)bytes length: length freeWhenDone: NO];
-			NSString * str = [[NSString alloc] initWithData: data encoding: NSUTF8StringEncoding];
-			NSLog( @"Error %d in bytes: %@ (str: %@)", err, data, str );
-			[str release];
-			[data release];
-			
-            [self _setParserError: err];
-            [self _setStreamComplete: NO];
-        }
-    }
-    
-    if ( _progressDelegate != nil )
-    {
-        _internal->currentLength += (float) length;
-        //[_progressDelegate parser: self
-        //           updateProgress: (_internal->currentLength / _internal->expectedDataLength)];
-    }
+	return ( _openElements );
 }
 
-- (_AQXMLParserInternal *) _info
+- (NSString *) _encoding
 {
-	return ( _internal );
+	return ( _encoding );
 }
 
-- (void) _setStreamComplete: (BOOL) parsedOK
+- (NSArray *) elementPath
 {
-    _streamComplete = YES;
-    
-    if ( _internal->asyncDelegate != nil )
-    {
-        @try
-        {
-            NSMethodSignature * sig = [_internal->asyncDelegate methodSignatureForSelector: _internal->asyncSelector];
-            NSInvocation * invoc = [NSInvocation invocationWithMethodSignature: sig];
-            
-            [invoc setTarget: _internal->asyncDelegate];
-            [invoc setSelector: _internal->asyncSelector];
-			
-			switch ( [sig numberOfArguments] )
-			{
-				default:		// yes, these are designed to fall through
-				case 5:
-					[invoc setArgument: &_internal->asyncContext atIndex: 4];
-				case 4:
-					[invoc setArgument: &parsedOK atIndex: 3];
-				case 3:
-					[invoc setArgument: &self atIndex: 2];
-					break;
-			}
-            
-            [invoc invoke];
-        }
-        @catch (NSException * e)
-        {
-            NSLog( @"Caught %@ while calling AQXMLParser async delegate: %@", e.name, e.reason );
-            @throw;
-        }
-    }
+	NSMutableArray * result = [NSMutableArray arrayWithCapacity: [_openElements count]];
+	for ( NSDictionary * element in _openElements )
+	{
+		NSString * prefix = [element objectForKey: AQCheckpointPrefixKey];
+		NSString * localName = [element objectForKey: AQCheckpointLocalNameKey];
+		if ( prefix != nil )
+			[result addObject: [NSString stringWithFormat: @"%@:%@", prefix, localName]];
+		else
+			[result addObject: localName];
+	}
+	
+	return ( result );
 }
 
-- (void) _setupExpectedLength
+- (NSString *) description
 {
-    CFHTTPMessageRef msg = (CFHTTPMessageRef) [_stream propertyForKey: (NSString *)kCFStreamPropertyHTTPResponseHeader];
-    if ( msg != NULL )
-    {
-        CFStringRef str = CFHTTPMessageCopyHeaderFieldValue( msg, CFSTR("Content-Length") );
-        if ( str != NULL )
-        {
-            _internal->expectedDataLength = [(NSString *)str floatValue];
-            CFRelease( str );
-        }
-        return;
-    }
-    
-    NSNumber * num = [_stream propertyForKey: (NSString *)kCFStreamPropertyFTPResourceSize];
-    if ( num != NULL )
-    {
-        _internal->expectedDataLength = [num floatValue];
-        return;
-    }
-    
-    // for some forthcoming stream classes...
-    NSNumber * guess = [_stream propertyForKey: @"UncompressedDataLength"];
-    if ( guess != nil )
-        _internal->expectedDataLength = [guess floatValue];
+	return ( [NSString stringWithFormat: @"%@ { offset %llu, inside /%@ }", [super description], _byteOffset,
+			  [[self elementPath] componentsJoinedByString: @"/"]] );
 }
 
 @end
-
@@ -39,9 +39,37 @@
 #import <Foundation/Foundation.h>
 #import "AQXMLParser.h"
 
+@class _AQXMLBindingTable;
+
+// For each element, sends -start<Element>WithAttributes: and -end<Element> to itself if it
+//  implements them, where <Element> is the capitalized element name with any dashes removed.
+// Subclasses may instead (or as well) bind the text of particular elements directly to their
+//  properties; see +elementBindings below.
+
 @interface AQXMLParserDelegate : NSObject <AQXMLParserDelegate>
 {
 	NSString *				_characters;
+	
+	// binding mode
+	_AQXMLBindingTable *	_bindings;			// shared by all instances of the class
+	BOOL					_bindingsResolved;
+	NSMutableArray *		_elementStack;
+	NSMutableString *		_boundText;
+	void *					_captures;
+	NSUInteger				_captureCount;
+	NSUInteger				_captureCapacity;
 }
+
+// Override to return a dictionary mapping element paths to property names. When an element
+//  matching a path ends, its text is passed to the property's setter, before -end<Element>.
+// Paths are element names separated by '/'. Those beginning with '/' must match from the root
+//  element, e.g. '/feed/entry/title'; others need only match the innermost elements, e.g.
+//  'entry/title' or just 'title'.
+// This is called once per class, and the result shared by every instance on every thread.
+//  When it returns any bindings, text is only collected inside bound elements, and the
+//  characters property is no longer maintained.
++ (NSDictionary *) elementBindings;
+
+// the text of the current element; not used when the class has element bindings
 @property (nonatomic, copy) NSString * characters;
 @end
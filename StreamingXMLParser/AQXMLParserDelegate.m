@@ -38,6 +38,7 @@
 
 #import "AQXMLParserDelegate.h"
 #import "AQXMLParser.h"
+#import <objc/runtime.h>
 
 #if TARGET_OS_IPHONE
 # import <UIKit/UIApplication.h>
@@ -160,8 +161,163 @@ static CFStringRef _selectorDescription( const void * value )
 
 #pragma mark -
 
+typedef void (*AQBindingSetterIMP)(id, SEL, NSString *);
+
+// one element path bound to a property
+@interface _AQXMLBinding : NSObject
+{
+@public
+	NSArray *			ancestors;		// the path's other elements, innermost first
+	BOOL				absolute;
+	SEL					setter;
+	AQBindingSetterIMP	setterIMP;
+}
+@end
+
+@implementation _AQXMLBinding
+
+- (void) dealloc
+{
+	[ancestors release];
+	[super dealloc];
+}
+
+// stack holds the names of all open elements, with the one being matched last
+- (BOOL) matchesElementStack: (NSArray *) stack
+{
+	NSUInteger count = [stack count];
+	NSUInteger needed = [ancestors count] + 1;
+	
+	if ( (count < needed) || (absolute && (count != needed)) )
+		return ( NO );
+	
+	NSUInteger i = count - 1;
+	for ( NSString * name in ancestors )
+	{
+		if ( [name isEqualToString: [stack objectAtIndex: --i]] == NO )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+@end
+
+// all the bindings for one class, keyed by the name of the element at the end of the path
+@interface _AQXMLBindingTable : NSObject
+{
+	NSDictionary *	_bindingsByName;
+}
+- (id) initWithBindings: (NSDictionary *) bindings forClass: (Class) cls;
+- (_AQXMLBinding *) bindingForElementStack: (NSArray *) stack;
+@end
+
+@implementation _AQXMLBindingTable
+
+- (id) initWithBindings: (NSDictionary *) bindings forClass: (Class) cls
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	NSMutableDictionary * byName = [[NSMutableDictionary alloc] init];
+	
+	for ( NSString * path in bindings )
+	{
+		NSString * key = [bindings objectForKey: path];
+		NSString * setterName = [NSString stringWithFormat: @"set%@%@:", [[key substringToIndex: 1] uppercaseString],
+								 [key substringFromIndex: 1]];
+		
+		_AQXMLBinding * binding = [[_AQXMLBinding alloc] init];
+		binding->absolute = [path hasPrefix: @"/"];
+		binding->setter = NSSelectorFromString( setterName );
+		
+		if ( [cls instancesRespondToSelector: binding->setter] == NO )
+		{
+			[binding release];
+			[byName release];
+			[self release];
+			[NSException raise: NSInvalidArgumentException
+						format: @"%@ has no setter for property '%@', bound to element path '%@'", cls, key, path];
+		}
+		
+		binding->setterIMP = (AQBindingSetterIMP) class_getMethodImplementation( cls, binding->setter );
+		
+		NSMutableArray * components = [[[path componentsSeparatedByString: @"/"] mutableCopy] autorelease];
+		[components removeObject: @""];
+		
+		NSString * name = [components lastObject];
+		[components removeLastObject];
+		binding->ancestors = [[[components reverseObjectEnumerator] allObjects] copy];
+		
+		NSMutableArray * list = [byName objectForKey: name];
+		if ( list == nil )
+		{
+			list = [[NSMutableArray alloc] init];
+			[byName setObject: list forKey: name];
+			[list release];
+		}
+		
+		// the most specific paths are tried first
+		NSUInteger i = 0;
+		for ( _AQXMLBinding * other in list )
+		{
+			if ( [other->ancestors count] < [binding->ancestors count] )
+				break;
+			i++;
+		}
+		[list insertObject: binding atIndex: i];
+		[binding release];
+	}
+	
+	_bindingsByName = byName;
+	return ( self );
+}
+
+- (void) dealloc
+{
+	[_bindingsByName release];
+	[super dealloc];
+}
+
+- (_AQXMLBinding *) bindingForElementStack: (NSArray *) stack
+{
+	NSArray * candidates = [_bindingsByName objectForKey: [stack lastObject]];
+	for ( _AQXMLBinding * binding in candidates )
+	{
+		if ( [binding matchesElementStack: stack] )
+			return ( binding );
+	}
+	
+	return ( nil );
+}
+
+@end
+
+// text collected for a bound element, which starts at 'start' in the delegate's text buffer
+typedef struct _AQXMLCapture
+{
+	_AQXMLBinding *	binding;
+	NSUInteger		start;
+	NSUInteger		depth;
+	
+} AQXMLCapture;
+
+#pragma mark -
+
 static _AQXMLParserSelectorCache * __selectorCache = nil;
 
+// binding tables by class, built on first use; NSNull for classes without bindings
+static CFMutableDictionaryRef __bindingTables = NULL;
+static NSLock * __bindingTablesLock = nil;
+
+@interface AQXMLParserDelegate ()
+- (void) _resolveBindings;
+- (void) _startBoundElement: (NSString *) elementName;
+- (void) _resetBoundState;
+- (void) _endBoundElement;
+- (void) _appendBoundText: (NSString *) string;
+@end
+
 @implementation AQXMLParserDelegate
 
 @synthesize characters=_characters;
@@ -169,15 +325,76 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
 + (void) initialize
 {
     if ( self == [AQXMLParserDelegate class] )
+    {
         __selectorCache = [[_AQXMLParserSelectorCache alloc] init];
+        __bindingTables = CFDictionaryCreateMutable( kCFAllocatorDefault, 0, NULL, &kCFTypeDictionaryValueCallBacks );
+        __bindingTablesLock = [[NSLock alloc] init];
+    }
+}
+
++ (NSDictionary *) elementBindings
+{
+	return ( nil );
+}
+
++ (_AQXMLBindingTable *) _bindingTable
+{
+	[__bindingTablesLock lock];
+	
+	id table = (id) CFDictionaryGetValue( __bindingTables, self );
+	if ( table == nil )
+	{
+		@try
+		{
+			NSDictionary * bindings = [self elementBindings];
+			if ( [bindings count] != 0 )
+				table = [[[_AQXMLBindingTable alloc] initWithBindings: bindings forClass: self] autorelease];
+			else
+				table = [NSNull null];
+			
+			CFDictionarySetValue( __bindingTables, self, table );
+		}
+		@finally
+		{
+			[__bindingTablesLock unlock];
+		}
+	}
+	else
+	{
+		[__bindingTablesLock unlock];
+	}
+	
+	if ( table == [NSNull null] )
+		return ( nil );
+	
+	return ( table );
 }
 
 - (void) dealloc
 {
 	[_characters release];
+	[_elementStack release];
+	[_boundText release];
+	if ( _captures != NULL )
+		free( _captures );
 	[super dealloc];
 }
 
+- (void) finalize
+{
+	if ( _captures != NULL )
+		free( _captures );
+	[super finalize];
+}
+
+- (void) parserDidStartDocument: (AQXMLParser *) parser
+{
+	if ( _bindingsResolved == NO )
+		[self _resolveBindings];
+	else if ( _bindings != nil )
+		[self _resetBoundState];	// in case a previous parse was abandoned part-way through
+}
+
 - (void) parser: (AQXMLParser *) parser didStartElement: (NSString *) elementName
    namespaceURI: (NSString *) namespaceURI qualifiedName: (NSString *) qName
      attributes: (NSDictionary *) attributeDict
@@ -186,6 +403,11 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
 	
 	//NSLog( @"Starting element: %@", elementName );
 	
+	if ( _bindingsResolved == NO )
+		[self _resolveBindings];
+	if ( _bindings != nil )
+		[self _startBoundElement: elementName];
+	
 	SEL selector = [__selectorCache startSelectorForElement: elementName];
 	
     if ( [self respondsToSelector: selector] )
@@ -194,7 +416,8 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
         [self performSelector: selector withObject: attributeDict];
     }
 	
-    self.characters = nil;
+	if ( _bindings == nil )
+		self.characters = nil;
 	
 	[pool drain];
 }
@@ -204,6 +427,9 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
 {
 	NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
 	
+	if ( _bindings != nil )
+		[self _endBoundElement];
+	
 	SEL selector = [__selectorCache endSelectorForElement: elementName];
 	
     if ( [self respondsToSelector: selector] )
@@ -212,13 +438,17 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
         [self performSelector: selector];
     }
 	
-	self.characters = nil;
+	if ( _bindings == nil )
+		self.characters = nil;
 	
 	[pool drain];
 }
 
 - (void) parser: (AQXMLParser *) parser foundCDATA: (NSData *) CDATABlock
 {
+	if ( (_bindings != nil) && (_captureCount == 0) )
+		return;
+	
 	NSString * chars = [[NSString alloc] initWithData: CDATABlock encoding: NSUTF8StringEncoding];
     [self parser: parser foundCharacters: chars];
     [chars release];
@@ -229,6 +459,12 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
 	if ( string == nil )
         return;
 	
+	if ( _bindings != nil )
+	{
+		[self _appendBoundText: string];
+		return;
+	}
+	
 	NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
     
 	if ( self.characters != nil )
@@ -243,9 +479,103 @@ static _AQXMLParserSelectorCache * __selectorCache = nil;
 	[pool drain];
 }
 
+// only sent when the parser's shouldBufferCharacters is set
+- (void) parser: (AQXMLParser *) parser foundCharacterBytes: (const char *) bytes length: (NSUInteger) length
+{
+	// outside bound elements there's no need for a string at all
+	if ( (_bindings != nil) && (_captureCount == 0) )
+		return;
+	
+	if ( _bindings != nil )
+	{
+		// appending copies the characters, so the parser's buffer needn't outlive this call
+		NSString * string = [[NSString alloc] initWithBytesNoCopy: (void *)bytes length: length
+														 encoding: NSUTF8StringEncoding freeWhenDone: NO];
+		[self _appendBoundText: string];
+		[string release];
+		return;
+	}
+	
+	// subclasses may keep the string they're given, so it needs its own copy of the bytes
+	NSString * string = [[NSString alloc] initWithBytes: bytes length: length encoding: NSUTF8StringEncoding];
+	[self parser: parser foundCharacters: string];
+	[string release];
+}
+
 - (void) parser: (AQXMLParser *) parser parseErrorOccurred: (NSError *) error
 {
 	// superclass does nothing
 }
 
+#pragma mark Bindings
+
+- (void) _resolveBindings
+{
+	_bindings = [[self class] _bindingTable];
+	_bindingsResolved = YES;
+	
+	if ( _bindings != nil )
+	{
+		_elementStack = [[NSMutableArray alloc] init];
+		_boundText = [[NSMutableString alloc] init];
+	}
+}
+
+- (void) _resetBoundState
+{
+	[_elementStack removeAllObjects];
+	[_boundText setString: @""];
+	_captureCount = 0;
+}
+
+- (void) _startBoundElement: (NSString *) elementName
+{
+	// a root element starts a new document, even for subclasses which don't pass on
+	//  -parserDidStartDocument:, so nothing from an earlier one can still be open
+	if ( [_elementStack count] == 0 )
+		[self _resetBoundState];
+	
+	[_elementStack addObject: elementName];
+	
+	_AQXMLBinding * binding = [_bindings bindingForElementStack: _elementStack];
+	if ( binding == nil )
+		return;
+	
+	if ( _captureCount == _captureCapacity )
+	{
+		_captureCapacity = (_captureCapacity == 0 ? 4 : _captureCapacity * 2);
+		_captures = realloc( _captures, _captureCapacity * sizeof(AQXMLCapture) );
+	}
+	
+	AQXMLCapture * capture = &((AQXMLCapture *)_captures)[_captureCount++];
+	capture->binding = binding;
+	capture->start = [_boundText length];
+	capture->depth = [_elementStack count];
+}
+
+- (void) _endBoundElement
+{
+	if ( _captureCount != 0 )
+	{
+		AQXMLCapture * capture = &((AQXMLCapture *)_captures)[_captureCount - 1];
+		if ( capture->depth == [_elementStack count] )
+		{
+			NSString * text = [_boundText substringFromIndex: capture->start];
+			capture->binding->setterIMP( self, capture->binding->setter, text );
+			
+			// text from inside a nested bound element also belongs to the outer one
+			if ( --_captureCount == 0 )
+				[_boundText setString: @""];
+		}
+	}
+	
+	[_elementStack removeLastObject];
+}
+
+- (void) _appendBoundText: (NSString *) string
+{
+	if ( (_captureCount != 0) && (string != nil) )
+		[_boundText appendString: string];
+}
+
 @end
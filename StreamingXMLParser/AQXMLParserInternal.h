@@ -16,18 +16,145 @@
 #import <libxml/encoding.h>
 #import <libxml/entities.h>
 
+@class _AQXMLParserWorker, _AQXMLPathFilter, AQXMLAttributeCursor, AQXMLParserCheckpoint;
+
+// statistics, collected only when the parser's collectsStatistics property is set
+typedef struct _AQXMLParserCounters
+{
+	unsigned long long	bytesPushed;
+	NSUInteger			parseChunkCalls;
+	NSUInteger			elementCount;
+	NSUInteger			characterCallbacks;
+	NSUInteger			attributeCount;
+	NSUInteger			stringsAllocated;
+	uint64_t			parseTime;			// mach_absolute_time() units spent in xmlParseChunk()...
+	uint64_t			callbackTime;		// ...of which this was spent in our SAX callbacks
+	NSUInteger			depth;
+	NSUInteger			peakDepth;
+	
+} AQXMLParserCounters;
+
+// delegate capabilities, resolved once when the delegate is set
+enum
+{
+	AQXMLDelegateFoundCharacters            = 1<<0,
+	AQXMLDelegateFoundCharacterBytes        = 1<<1,
+	AQXMLDelegateDidStartElement            = 1<<2,
+	AQXMLDelegateDidEndElement              = 1<<3,
+	AQXMLDelegateDidStartMappingPrefix      = 1<<4,
+	AQXMLDelegateDidEndMappingPrefix        = 1<<5,
+	AQXMLDelegateFoundIgnorableWhitespace   = 1<<6,
+	AQXMLDelegateFoundProcessingInstruction = 1<<7,
+	AQXMLDelegateFoundComment               = 1<<8,
+	AQXMLDelegateFoundCDATA                 = 1<<9,
+	AQXMLDelegateResolveExternalEntity      = 1<<10,
+	AQXMLDelegateParseErrorOccurred         = 1<<11,
+	AQXMLDelegateDidStartDocument           = 1<<12,
+	AQXMLDelegateDidEndDocument             = 1<<13,
+	AQXMLDelegateFoundNotationDecl          = 1<<14,
+	AQXMLDelegateFoundUnparsedEntityDecl    = 1<<15,
+	AQXMLDelegateFoundAttributeDecl         = 1<<16,
+	AQXMLDelegateFoundElementDecl           = 1<<17,
+	AQXMLDelegateFoundInternalEntityDecl    = 1<<18,
+	AQXMLDelegateFoundExternalEntityDecl    = 1<<19,
+	AQXMLDelegateDidStartElementWithCursor  = 1<<20,
+	AQXMLDelegateDidReachCheckpoint         = 1<<21
+	
+};
+
 @interface _AQXMLParserInternal : NSObject
 {
 @public
     // parser structures -- these are actually the same for both XML & HTML
 	xmlSAXHandlerPtr	saxHandler;
 	xmlParserCtxtPtr	parserContext;
+	BOOL				contextNeedsReset;		// set by -resetWithStream: for the next document
 	
     // internal stuff
     NSUInteger			parserFlags;
 	NSError *			error;
 	NSMutableArray *	namespaces;
 	BOOL				delegateAborted;
+	
+	// cached delegate capabilities & the implementations of the hottest delegate methods
+	NSUInteger			delegateFlags;
+	IMP					foundCharactersIMP;
+	IMP					foundCharacterBytesIMP;
+	IMP					didStartElementIMP;
+	IMP					didEndElementIMP;
+	IMP					didStartElementCursorIMP;
+	
+	// reused for every start tag when the delegate wants an attribute cursor
+	AQXMLAttributeCursor *	attributeCursor;
+	
+	// NULL unless statistics are being collected
+	AQXMLParserCounters *	counters;
+	
+	// path filter, compiled against the context's name dictionary once parsing begins
+	NSArray *			filterPaths;
+	_AQXMLPathFilter *	pathFilter;
+	
+	// HTML tag whitelist: lowercased names, and the depth inside the outermost whitelisted element
+	NSSet *				tagWhitelist;
+	xmlChar **			whitelistNames;
+	NSUInteger			whitelistCount;
+	NSUInteger			whitelistDepth;
+	
+	// resource limits; zero means no limit
+	NSUInteger			maxTextNodeLength;
+	NSUInteger			maxElementDepth;
+	unsigned long long	maxDocumentLength;
+	NSUInteger			limitDepth;				// only counted when maxElementDepth is set
+	NSUInteger			textNodeLength;
+	unsigned long long	documentLength;
+	BOOL				limitExceeded;
+	
+	// input paused by the delegate; readPending is set if input arrived meanwhile
+	BOOL				readingPaused;
+	BOOL				readPending;
+	NSRunLoop * __weak	readRunLoop;
+	NSArray *			readRunLoopModes;
+	
+	// checkpoints, taken by wrapper callbacks installed only when checkpointDepth is set
+	NSUInteger			checkpointDepth;
+	NSUInteger			elementDepth;
+	NSArray *			openElements;			// elements above checkpointDepth, outermost first
+	long long			checkpointBase;			// added to libxml2's offset to give the stream offset
+	unsigned long long	checkpointOffset;
+	NSArray *			checkpointOpenElements;	// openElements at checkpointOffset; nil until one is taken
+	AQXMLParserCheckpoint *	resumeCheckpoint;
+	startElementNsSAX2Func	checkpointedStartElementNs;
+	endElementNsSAX2Func	checkpointedEndElementNs;
+	
+	// maps libxml2 dictionary-owned name pointers to NSStrings
+	CFMutableDictionaryRef	internedNames;
+	
+	// character data accumulated in buffered-characters mode
+	uint8_t *			characterBuffer;
+	NSUInteger			characterBufferLength;
+	NSUInteger			characterBufferCapacity;
+    
+    // stream reading
+    uint8_t *           readBuffer;
+    NSUInteger          readBufferSize;
+    BOOL                streamProvidesBuffer;   // supports getBuffer:length: & consumeBufferedBytes:
+    uint8_t             filterCarry[8];         // partial control-character reference from the last read
+    NSUInteger          filterCarryLength;
+    
+    // memory-mapped file input; mappedFile is -1 when reading from a stream
+    int                 mappedFile;
+    unsigned long long  mappedFileSize;
+    unsigned long long  mappedWindowOffset;     // file offset of the current window
+    uint8_t *           mappedWindow;
+    size_t              mappedWindowLength;
+    size_t              mappedWindowConsumed;
+    NSArray *           mappedRunLoopModes;     // when parsing asynchronously
+    
+    // background parsing
+    _AQXMLParserWorker * worker;
+    id                  eventProxy;             // receives delegate messages while the worker runs
+    NSUInteger          maxQueuedChunks;
+    NSUInteger          eventBatchSize;
     
     // async parse callback data
     id                  asyncDelegate;
@@ -37,6 +164,12 @@
     // progress variables
     float               expectedDataLength;
     float               currentLength;
+    float               lastProgressLength;
+    CFAbsoluteTime      lastProgressTime;
+    NSTimeInterval      progressUpdateInterval;
+    NSUInteger          progressUpdateByteCount;
+    BOOL                expectedLengthChecked;
+    BOOL                streamReportsCompressedBytes;
 	
 	NSOutputStream *	debugOutputStream;
 	
@@ -0,0 +1,112 @@
+/*
+ *  AQXMLParserPool.h
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "iPhoneNonatomic.h"
+#import "AQXMLParser.h"
+
+@protocol AQXMLParserPoolDelegate;
+
+// Parses many independent documents at once. Documents are added to a shared queue, and up
+//  to maxConcurrentParsers worker threads each take one at a time and run a new AQXMLParser
+//  (and therefore a new libxml2 context) over it, synchronously, on that thread.
+// The parser's delegate receives its messages on the worker thread, so each document should
+//  have a delegate of its own. Delegates are retained until their document has been parsed.
+// Worker threads are started as documents are added, and exit once the queue is empty.
+
+@interface AQXMLParserPool : NSObject
+{
+	id<AQXMLParserPoolDelegate> __weak	_delegate;
+	NSThread *			_completionThread;
+	
+	NSCondition *		_condition;
+	NSMutableArray *	_queue;
+	NSUInteger			_maxConcurrentParsers;
+	NSUInteger			_workerCount;
+	NSUInteger			_activeCount;
+	BOOL				_suspended;
+}
+
+// the thread on which completion selectors are performed, which must be running its runloop
+//  in the common modes or AQXMLParserParsingRunLoopMode. If nil (the default), completion is
+//  reported on the worker thread as soon as each document is finished.
+@property (NS_NONATOMIC_IPHONEONLY retain) NSThread * completionThread;
+
+// defaults to the number of active processors
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger maxConcurrentParsers;
+
+// sent each parser before it starts, on its worker thread, to configure its options
+@property (NS_NONATOMIC_IPHONEONLY assign) id<AQXMLParserPoolDelegate> __weak delegate;
+
+// while suspended, queued documents stay queued; those already being parsed carry on
+@property (NS_NONATOMIC_IPHONEONLY assign, getter=isSuspended) BOOL suspended;
+
+// documents waiting for a worker, and those being parsed right now
+@property (nonatomic, readonly) NSUInteger queuedDocumentCount;
+@property (nonatomic, readonly) NSUInteger activeDocumentCount;
+
+// The completion selector is as for -[AQXMLParser parseAsynchronouslyUsingRunLoop:...]:
+// - (void) xmlParser: (AQXMLParser *) parser completedOK: (BOOL) parsedOK context: (void *) context;
+// The parser is still available at that point, so its parserError & statistics can be
+//  inspected there.
+- (void) addStream: (NSInputStream *) stream
+	parserDelegate: (id<AQXMLParserDelegate>) parserDelegate
+ notifyingDelegate: (id) completionDelegate
+		  selector: (SEL) completionSelector
+		   context: (void *) contextPtr;
+
+// the file is only opened once a worker begins parsing it, and is read using
+//  -[AQXMLParser initWithContentsOfMappedFile:]
+- (void) addFileAtPath: (NSString *) path
+		parserDelegate: (id<AQXMLParserDelegate>) parserDelegate
+	 notifyingDelegate: (id) completionDelegate
+			  selector: (SEL) completionSelector
+			   context: (void *) contextPtr;
+
+// removes everything still queued; completion is NOT reported for those documents
+- (void) cancelQueuedDocuments;
+
+// blocks until the queue is empty & every worker has finished. When a completionThread is set,
+//  its completion messages may still be pending if that's the thread doing the waiting.
+- (void) waitUntilAllDocumentsAreFinished;
+
+@end
+
+@protocol AQXMLParserPoolDelegate <NSObject>
+@optional
+// called on the worker thread, before parsing begins
+- (void) parserPool: (AQXMLParserPool *) pool willStartParser: (AQXMLParser *) parser context: (void *) context;
+@end
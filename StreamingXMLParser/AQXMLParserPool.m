@@ -0,0 +1,347 @@
+/*
+ *  AQXMLParserPool.m
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQXMLParserPool.h"
+#import <libxml/parser.h>
+
+// the run loop modes completions are delivered in; set up by +initialize, since the workers
+//  all want it at once
+static NSArray * __deliveryModes = nil;
+
+// one queued document
+@interface _AQXMLParserPoolItem : NSObject
+{
+@public
+	NSInputStream *	stream;
+	NSString *		path;
+	id				parserDelegate;
+	id				completionDelegate;
+	SEL				completionSelector;
+	void *			context;
+}
+- (NSInvocation *) completionInvocationForParser: (AQXMLParser *) parser parsedOK: (BOOL) parsedOK;
+@end
+
+@implementation _AQXMLParserPoolItem
+
+- (void) dealloc
+{
+	[stream release];
+	[path release];
+	[parserDelegate release];
+	[super dealloc];
+}
+
+- (NSInvocation *) completionInvocationForParser: (AQXMLParser *) parser parsedOK: (BOOL) parsedOK
+{
+	if ( (completionDelegate == nil) || (completionSelector == NULL) )
+		return ( nil );
+	
+	NSMethodSignature * sig = [completionDelegate methodSignatureForSelector: completionSelector];
+	NSInvocation * invoc = [NSInvocation invocationWithMethodSignature: sig];
+	
+	[invoc setTarget: completionDelegate];
+	[invoc setSelector: completionSelector];
+	
+	switch ( [sig numberOfArguments] )
+	{
+		default:		// yes, these are designed to fall through
+		case 5:
+			[invoc setArgument: &context atIndex: 4];
+		case 4:
+			[invoc setArgument: &parsedOK atIndex: 3];
+		case 3:
+			[invoc setArgument: &parser atIndex: 2];
+			break;
+	}
+	
+	return ( invoc );
+}
+
+@end
+
+#pragma mark -
+
+@interface AQXMLParserPool ()
+- (void) _enqueueItem: (_AQXMLParserPoolItem *) item;
+- (void) _startWorkersIfNeeded;
+- (void) _parseItem: (_AQXMLParserPoolItem *) item;
+@end
+
+@implementation AQXMLParserPool
+
+@synthesize completionThread=_completionThread, delegate=_delegate;
+
++ (void) initialize
+{
+	// libxml2 sets up its global state lazily, which isn't safe to do from several threads at once
+	if ( self == [AQXMLParserPool class] )
+	{
+		xmlInitParser();
+		__deliveryModes = [[NSArray alloc] initWithObjects: NSRunLoopCommonModes, AQXMLParserParsingRunLoopMode, nil];
+	}
+}
+
+- (id) init
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_condition = [[NSCondition alloc] init];
+	_queue = [[NSMutableArray alloc] init];
+	_maxConcurrentParsers = [[NSProcessInfo processInfo] activeProcessorCount];
+	if ( _maxConcurrentParsers == 0 )
+		_maxConcurrentParsers = 1;
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	// each worker thread retains us, so none are running by now
+	[_completionThread release];
+	[_condition release];
+	[_queue release];
+	[super dealloc];
+}
+
+- (NSUInteger) maxConcurrentParsers
+{
+	return ( _maxConcurrentParsers );
+}
+
+- (void) setMaxConcurrentParsers: (NSUInteger) value
+{
+	if ( value == 0 )
+		return;
+	
+	// surplus workers exit after their current document
+	[_condition lock];
+	_maxConcurrentParsers = value;
+	[self _startWorkersIfNeeded];
+	[_condition unlock];
+}
+
+- (BOOL) isSuspended
+{
+	return ( _suspended );
+}
+
+- (void) setSuspended: (BOOL) value
+{
+	[_condition lock];
+	_suspended = value;
+	[self _startWorkersIfNeeded];
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+- (NSUInteger) queuedDocumentCount
+{
+	[_condition lock];
+	NSUInteger result = [_queue count];
+	[_condition unlock];
+	return ( result );
+}
+
+- (NSUInteger) activeDocumentCount
+{
+	[_condition lock];
+	NSUInteger result = _activeCount;
+	[_condition unlock];
+	return ( result );
+}
+
+- (void) addStream: (NSInputStream *) stream
+	parserDelegate: (id<AQXMLParserDelegate>) parserDelegate
+ notifyingDelegate: (id) completionDelegate
+		  selector: (SEL) completionSelector
+		   context: (void *) contextPtr
+{
+	_AQXMLParserPoolItem * item = [[_AQXMLParserPoolItem alloc] init];
+	item->stream = [stream retain];
+	item->parserDelegate = [parserDelegate retain];
+	item->completionDelegate = completionDelegate;
+	item->completionSelector = completionSelector;
+	item->context = contextPtr;
+	
+	[self _enqueueItem: item];
+	[item release];
+}
+
+- (void) addFileAtPath: (NSString *) path
+		parserDelegate: (id<AQXMLParserDelegate>) parserDelegate
+	 notifyingDelegate: (id) completionDelegate
+			  selector: (SEL) completionSelector
+			   context: (void *) contextPtr
+{
+	_AQXMLParserPoolItem * item = [[_AQXMLParserPoolItem alloc] init];
+	item->path = [path copy];
+	item->parserDelegate = [parserDelegate retain];
+	item->completionDelegate = completionDelegate;
+	item->completionSelector = completionSelector;
+	item->context = contextPtr;
+	
+	[self _enqueueItem: item];
+	[item release];
+}
+
+- (void) cancelQueuedDocuments
+{
+	[_condition lock];
+	[_queue removeAllObjects];
+	[_condition broadcast];
+	[_condition unlock];
+}
+
+- (void) waitUntilAllDocumentsAreFinished
+{
+	[_condition lock];
+	
+	while ( (([_queue count] != 0) && (_suspended == NO)) || (_workerCount != 0) )
+		[_condition wait];
+	
+	[_condition unlock];
+}
+
+#pragma mark Workers
+
+- (void) _enqueueItem: (_AQXMLParserPoolItem *) item
+{
+	[_condition lock];
+	[_queue addObject: item];
+	[self _startWorkersIfNeeded];
+	[_condition unlock];
+}
+
+// called with the condition locked
+- (void) _startWorkersIfNeeded
+{
+	if ( _suspended )
+		return;
+	
+	// every worker is either parsing something or about to take something from the queue
+	while ( (_workerCount < _maxConcurrentParsers) && (_workerCount < _activeCount + [_queue count]) )
+	{
+		_workerCount++;
+		[NSThread detachNewThreadSelector: @selector(_workerThreadMain) toTarget: self withObject: nil];
+	}
+}
+
+- (void) _workerThreadMain
+{
+	NSAutoreleasePool * rootPool = [[NSAutoreleasePool alloc] init];
+	
+	for ( ;; )
+	{
+		[_condition lock];
+		
+		if ( ([_queue count] == 0) || _suspended || (_workerCount > _maxConcurrentParsers) )
+		{
+			_workerCount--;
+			[_condition broadcast];
+			[_condition unlock];
+			break;
+		}
+		
+		_AQXMLParserPoolItem * item = [[_queue objectAtIndex: 0] retain];
+		[_queue removeObjectAtIndex: 0];
+		_activeCount++;
+		
+		[_condition unlock];
+		
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		[self _parseItem: item];
+		[item release];
+		[pool drain];
+		
+		[_condition lock];
+		_activeCount--;
+		[_condition broadcast];
+		[_condition unlock];
+	}
+	
+	[rootPool drain];
+}
+
+// worker thread
+- (void) _parseItem: (_AQXMLParserPoolItem *) item
+{
+	AQXMLParser * parser = nil;
+	if ( item->path != nil )
+		parser = [[AQXMLParser alloc] initWithContentsOfMappedFile: item->path];
+	
+	// if the file couldn't be opened, the stream will report why
+	if ( parser == nil )
+	{
+		NSInputStream * stream = item->stream;
+		if ( stream == nil )
+			stream = [NSInputStream inputStreamWithFileAtPath: item->path];
+		parser = [[AQXMLParser alloc] initWithStream: stream];
+	}
+	
+	parser.delegate = item->parserDelegate;
+	
+	id<AQXMLParserPoolDelegate> delegate = _delegate;
+	if ( [delegate respondsToSelector: @selector(parserPool:willStartParser:context:)] )
+		[delegate parserPool: self willStartParser: parser context: item->context];
+	
+	// runs this thread's runloop until the stream is done with
+	BOOL parsedOK = [parser parse];
+	
+	NSInvocation * invocation = [item completionInvocationForParser: parser parsedOK: parsedOK];
+	if ( invocation != nil )
+	{
+		if ( _completionThread != nil )
+		{
+			// the invocation keeps the parser alive until it's been performed
+			[invocation retainArguments];
+			[invocation performSelector: @selector(invoke)
+							   onThread: _completionThread
+							 withObject: nil
+						  waitUntilDone: NO
+								  modes: __deliveryModes];
+		}
+		else
+		{
+			[invocation invoke];
+		}
+	}
+	
+	[parser release];
+}
+
+@end
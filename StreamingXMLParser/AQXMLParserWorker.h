@@ -0,0 +1,101 @@
+/*
+ *  AQXMLParserWorker.h
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+
+@class AQXMLParser;
+
+// This is an internal class which implements AQXMLParser's background parsing mode.
+// It owns two threads: a reader, which services the input stream on its own runloop and
+//  places the data it reads into a bounded queue, and a parser, which takes chunks from
+//  that queue and hands them to libxml2. Delegate messages sent during parsing are caught
+//  by the worker's event proxy and performed in batches on the target thread.
+
+@interface _AQXMLParserWorker : NSObject
+{
+	AQXMLParser *		_parser;			// retained while the parsing thread runs
+	NSInputStream *		_stream;
+	NSThread *			_targetThread;
+	id					_eventProxy;
+	
+	// input chunk queue
+	NSCondition *		_queueCondition;
+	NSMutableArray *	_chunks;
+	NSUInteger			_maxChunks;
+	NSUInteger			_chunkSize;
+	BOOL				_inputComplete;
+	NSError *			_inputError;
+	
+	// the stream's progress, which only the reader thread looks at
+	BOOL				_progressChecked;
+	BOOL				_streamReportsCompressedBytes;
+	float				_expectedLength;
+	
+	// delegate event batches
+	NSCondition *		_batchCondition;
+	NSMutableArray *	_batch;
+	NSUInteger			_batchSize;
+	NSUInteger			_pendingBatches;
+	
+	volatile BOOL		_stopped;
+	volatile BOOL		_cancelled;
+	volatile BOOL		_paused;
+}
+
+- (id) initWithParser: (AQXMLParser *) parser
+			   stream: (NSInputStream *) stream
+		 targetThread: (NSThread *) targetThread;
+
+// the object which should receive delegate messages while the worker is running
+@property (nonatomic, readonly) id eventProxy;
+
+@property (nonatomic, readonly, getter=isTargetThread) BOOL targetThread;
+
+- (void) start;
+
+// queues a progress update along with the delegate events; parsing thread only
+- (void) sendProgress: (float) progress toDelegate: (id) progressDelegate;
+
+// stops parsing after the current chunk; completion is still reported
+- (void) stopParsing;
+
+// while paused, no more chunks are parsed, so the reader stops once the queue is full
+- (void) setPaused: (BOOL) paused;
+
+// stops everything & discards any undelivered events; completion is NOT reported
+- (void) cancel;
+
+@end
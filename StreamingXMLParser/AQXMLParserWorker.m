@@ -0,0 +1,560 @@
+/*
+ *  AQXMLParserWorker.m
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQXMLParserWorker.h"
+#import "AQXMLParser.h"
+#import "AQXMLParserInternal.h"
+#import <objc/runtime.h>
+
+// the number of event batches which may be waiting for the target thread before the
+//  parsing thread stops to let it catch up
+#define MAX_PENDING_BATCHES (4)
+
+@interface AQXMLParser ()
+- (_AQXMLParserInternal *) _info;
+- (void) _pushStreamData: (const uint8_t *) bytes length: (NSUInteger) length;
+- (void) _finishParsing;
+- (void) _reportStreamError: (NSError *) error;
+- (void) _setStreamComplete: (BOOL) parsedOK;
+- (void) _backgroundParseFinished;
+- (float) _expectedLengthOfStream;
+- (void) _updateProgressWithLength: (NSUInteger) length streamPosition: (float) position expectedLength: (float) expected;
+@end
+
+@interface _AQXMLParserWorker ()
+- (void) _addInvocation: (NSInvocation *) invocation retainingObject: (id) object;
+- (void) _performInvocationNow: (NSInvocation *) invocation;
+- (void) _sendBatch;
+@end
+
+static NSArray * DeliveryModes( void )
+{
+	static NSArray * __modes = nil;
+	if ( __modes == nil )
+		__modes = [[NSArray alloc] initWithObjects: NSRunLoopCommonModes, AQXMLParserParsingRunLoopMode, nil];
+	return ( __modes );
+}
+
+#pragma mark -
+
+// A chunk of input, along with the stream's progress as the reader thread saw it just after
+//  reading the chunk, so the parsing thread never needs to ask the stream itself.
+@interface _AQXMLParserChunk : NSObject
+{
+@public
+	NSData *			data;
+	float				streamPosition;		// negative if the stream can't report it
+	float				expectedLength;		// zero if not known
+}
+@end
+
+@implementation _AQXMLParserChunk
+
+- (void) dealloc
+{
+	[data release];
+	[super dealloc];
+}
+
+@end
+
+#pragma mark -
+
+// Stands in for the delegate on the parsing thread. Messages which return nothing are
+//  recorded & handed to the worker to batch up, while anything which returns a value is
+//  performed synchronously on the target thread.
+@interface _AQXMLParserEventProxy : NSProxy
+{
+	id						_delegate;
+	_AQXMLParserWorker *	_worker;		// not retained; the worker owns us
+}
+- (id) initWithDelegate: (id) delegate worker: (_AQXMLParserWorker *) worker;
+@end
+
+@implementation _AQXMLParserEventProxy
+
+- (id) initWithDelegate: (id) delegate worker: (_AQXMLParserWorker *) worker
+{
+	_delegate = delegate;
+	_worker = worker;
+	return ( self );
+}
+
+- (BOOL) respondsToSelector: (SEL) aSelector
+{
+	return ( [_delegate respondsToSelector: aSelector] );
+}
+
+- (NSMethodSignature *) methodSignatureForSelector: (SEL) aSelector
+{
+	return ( [_delegate methodSignatureForSelector: aSelector] );
+}
+
+- (void) forwardInvocation: (NSInvocation *) invocation
+{
+	[invocation setTarget: _delegate];
+	
+	if ( *[[invocation methodSignature] methodReturnType] != _C_VOID )
+	{
+		[_worker _performInvocationNow: invocation];
+		return;
+	}
+	
+	[invocation retainArguments];
+	[_worker _addInvocation: invocation retainingObject: nil];
+}
+
+- (void) parser: (AQXMLParser *) parser foundCharacterBytes: (const char *) bytes length: (NSUInteger) length
+{
+	// the bytes belong to the parser's character buffer, which will be reused long before
+	//  the target thread sees them, so we send a copy
+	NSData * data = [[NSData alloc] initWithBytes: bytes length: length];
+	const char * copied = (const char *) [data bytes];
+	SEL selector = @selector(parser:foundCharacterBytes:length:);
+	
+	NSInvocation * invocation = [NSInvocation invocationWithMethodSignature: [_delegate methodSignatureForSelector: selector]];
+	[invocation setTarget: _delegate];
+	[invocation setSelector: selector];
+	[invocation setArgument: &parser atIndex: 2];
+	[invocation setArgument: &copied atIndex: 3];
+	[invocation setArgument: &length atIndex: 4];
+	
+	// no -retainArguments here: it would treat the bytes as a NUL-terminated C string
+	[_worker _addInvocation: invocation retainingObject: data];
+	[data release];
+}
+
+- (void) parser: (AQXMLParser *) parser didStartElement: (NSString *) elementName namespaceURI: (NSString *) namespaceURI
+  qualifiedName: (NSString *) qName attributeCursor: (AQXMLAttributeCursor *) attributes
+{
+	// the parser reuses its cursor for every element, so the target thread gets its own copy
+	AQXMLAttributeCursor * copied = [attributes copy];
+	SEL selector = @selector(parser:didStartElement:namespaceURI:qualifiedName:attributeCursor:);
+	
+	NSInvocation * invocation = [NSInvocation invocationWithMethodSignature: [_delegate methodSignatureForSelector: selector]];
+	[invocation setTarget: _delegate];
+	[invocation setSelector: selector];
+	[invocation setArgument: &parser atIndex: 2];
+	[invocation setArgument: &elementName atIndex: 3];
+	[invocation setArgument: &namespaceURI atIndex: 4];
+	[invocation setArgument: &qName atIndex: 5];
+	[invocation setArgument: &copied atIndex: 6];
+	[invocation retainArguments];
+	
+	[_worker _addInvocation: invocation retainingObject: nil];
+	[copied release];
+}
+
+@end
+
+#pragma mark -
+
+@implementation _AQXMLParserWorker
+
+@synthesize eventProxy=_eventProxy;
+
+- (id) initWithParser: (AQXMLParser *) parser
+			   stream: (NSInputStream *) stream
+		 targetThread: (NSThread *) targetThread
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_parser = parser;
+	_stream = [stream retain];
+	_targetThread = [targetThread retain];
+	_eventProxy = [[_AQXMLParserEventProxy alloc] initWithDelegate: parser.delegate worker: self];
+	
+	_queueCondition = [[NSCondition alloc] init];
+	_maxChunks = parser.maxQueuedChunks;
+	_chunkSize = parser.readBufferSize;
+	_chunks = [[NSMutableArray alloc] initWithCapacity: _maxChunks];
+	
+	_batchCondition = [[NSCondition alloc] init];
+	_batchSize = parser.eventBatchSize;
+	_batch = [[NSMutableArray alloc] initWithCapacity: _batchSize];
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	[_stream release];
+	[_targetThread release];
+	[_eventProxy release];
+	[_queueCondition release];
+	[_chunks release];
+	[_inputError release];
+	[_batchCondition release];
+	[_batch release];
+	[super dealloc];
+}
+
+- (BOOL) isTargetThread
+{
+	return ( [NSThread currentThread] == _targetThread );
+}
+
+- (void) start
+{
+	// released on the target thread once parsing is complete
+	[_parser retain];
+	
+	[NSThread detachNewThreadSelector: @selector(_readerThreadMain) toTarget: self withObject: nil];
+	[NSThread detachNewThreadSelector: @selector(_parserThreadMain) toTarget: self withObject: nil];
+}
+
+- (void) _wakeThreads
+{
+	[_queueCondition lock];
+	[_queueCondition broadcast];
+	[_queueCondition unlock];
+	
+	[_batchCondition lock];
+	[_batchCondition broadcast];
+	[_batchCondition unlock];
+}
+
+- (void) stopParsing
+{
+	_stopped = YES;
+	[self _wakeThreads];
+}
+
+- (void) setPaused: (BOOL) paused
+{
+	[_queueCondition lock];
+	_paused = paused;
+	[_queueCondition broadcast];
+	[_queueCondition unlock];
+}
+
+- (void) cancel
+{
+	_cancelled = YES;
+	[self _wakeThreads];
+}
+
+#pragma mark Input Queue
+
+- (void) _enqueueChunk: (_AQXMLParserChunk *) chunk
+{
+	[_queueCondition lock];
+	
+	// this is where a slow parser pushes back on the network
+	while ( ([_chunks count] >= _maxChunks) && (_stopped == NO) && (_cancelled == NO) )
+		[_queueCondition wait];
+	
+	if ( (_stopped == NO) && (_cancelled == NO) )
+		[_chunks addObject: chunk];
+	
+	[_queueCondition broadcast];
+	[_queueCondition unlock];
+}
+
+- (_AQXMLParserChunk *) _dequeueChunk
+{
+	_AQXMLParserChunk * result = nil;
+	
+	[_queueCondition lock];
+	
+	while ( (_paused || (([_chunks count] == 0) && (_inputComplete == NO))) && (_stopped == NO) && (_cancelled == NO) )
+		[_queueCondition wait];
+	
+	if ( ([_chunks count] != 0) && (_stopped == NO) && (_cancelled == NO) )
+	{
+		result = [[_chunks objectAtIndex: 0] retain];
+		[_chunks removeObjectAtIndex: 0];
+	}
+	
+	[_queueCondition broadcast];
+	[_queueCondition unlock];
+	
+	return ( [result autorelease] );
+}
+
+- (void) _setInputComplete: (NSError *) error
+{
+	[_queueCondition lock];
+	
+	if ( error != nil )
+		_inputError = [error retain];
+	_inputComplete = YES;
+	
+	[_queueCondition broadcast];
+	[_queueCondition unlock];
+}
+
+#pragma mark Reader Thread
+
+- (void) _readerThreadMain
+{
+	NSAutoreleasePool * rootPool = [[NSAutoreleasePool alloc] init];
+	NSRunLoop * runloop = [NSRunLoop currentRunLoop];
+	
+	[_stream setDelegate: self];
+	[_stream scheduleInRunLoop: runloop forMode: NSDefaultRunLoopMode];
+	
+	if ( [_stream streamStatus] == NSStreamStatusNotOpen )
+		[_stream open];
+	
+	while ( (_inputComplete == NO) && (_stopped == NO) && (_cancelled == NO) )
+	{
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		[runloop runMode: NSDefaultRunLoopMode beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+		[pool drain];
+	}
+	
+	[_stream setDelegate: nil];
+	[_stream removeFromRunLoop: runloop forMode: NSDefaultRunLoopMode];
+	[_stream close];
+	
+	[rootPool drain];
+}
+
+- (void) stream: (NSStream *) stream handleEvent: (NSStreamEvent) streamEvent
+{
+	switch ( streamEvent )
+	{
+		case NSStreamEventHasBytesAvailable:
+		{
+			uint8_t * buf = malloc( _chunkSize );
+			NSInteger numRead = [_stream read: buf maxLength: _chunkSize];
+			if ( numRead <= 0 )
+			{
+				free( buf );
+				break;
+			}
+			
+			// response headers aren't available until data starts to arrive
+			if ( _progressChecked == NO )
+			{
+				_progressChecked = YES;
+				_expectedLength = [_parser _expectedLengthOfStream];
+				_streamReportsCompressedBytes = [_stream respondsToSelector: @selector(compressedBytesRead)];
+			}
+			
+			_AQXMLParserChunk * chunk = [[_AQXMLParserChunk alloc] init];
+			chunk->data = [[NSData alloc] initWithBytesNoCopy: buf length: numRead freeWhenDone: YES];
+			chunk->expectedLength = _expectedLength;
+			chunk->streamPosition = -1.0f;
+			if ( _streamReportsCompressedBytes )
+				chunk->streamPosition = (float) [(id<AQXMLParserProgressSource>)_stream compressedBytesRead];
+			
+			[self _enqueueChunk: chunk];
+			[chunk release];
+			break;
+		}
+			
+		case NSStreamEventEndEncountered:
+			[self _setInputComplete: nil];
+			break;
+			
+		case NSStreamEventErrorOccurred:
+			[self _setInputComplete: [stream streamError]];
+			break;
+			
+		default:
+			break;
+	}
+}
+
+#pragma mark Parser Thread
+
+- (void) _parserThreadMain
+{
+	NSAutoreleasePool * rootPool = [[NSAutoreleasePool alloc] init];
+	_AQXMLParserInternal * info = [_parser _info];
+	
+	_AQXMLParserChunk * chunk = nil;
+	while ( (chunk = [self _dequeueChunk]) != nil )
+	{
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		
+		// the stream belongs to the reader thread, so progress comes from what it saw
+		[_parser _pushStreamData: [chunk->data bytes] length: [chunk->data length]];
+		[_parser _updateProgressWithLength: [chunk->data length]
+							streamPosition: chunk->streamPosition
+							expectedLength: chunk->expectedLength];
+		
+		// the delegate can only ask us to stop from the target thread, so we stop the
+		//  libxml2 context ourselves, here on the thread which owns it
+		if ( info->delegateAborted && (info->parserContext != NULL) )
+			xmlStopParser( info->parserContext );
+		
+		// deliver everything this chunk produced
+		[self _sendBatch];
+		
+		[pool drain];
+	}
+	
+	if ( (_stopped == NO) && (_cancelled == NO) )
+	{
+		if ( _inputError != nil )
+			[_parser _reportStreamError: _inputError];
+		else
+			[_parser _finishParsing];
+	}
+	
+	[self _sendBatch];
+	
+	BOOL parsedOK = ((info->error == nil) && (info->delegateAborted == NO));
+	
+	// let the reader thread go, if it's still running
+	[self stopParsing];
+	
+	[self performSelector: @selector(_parseFinished:)
+				 onThread: _targetThread
+			   withObject: [NSNumber numberWithBool: parsedOK]
+			waitUntilDone: NO
+					modes: DeliveryModes()];
+	
+	[rootPool drain];
+}
+
+#pragma mark Event Batches
+
+- (void) _addInvocation: (NSInvocation *) invocation retainingObject: (id) object
+{
+	if ( _cancelled )
+		return;
+	
+	[_batch addObject: invocation];
+	if ( object != nil )
+		[_batch addObject: object];
+	
+	if ( [_batch count] >= _batchSize )
+		[self _sendBatch];
+}
+
+- (void) sendProgress: (float) progress toDelegate: (id) progressDelegate
+{
+	SEL selector = @selector(parser:updateProgress:);
+	NSInvocation * invocation = [NSInvocation invocationWithMethodSignature: [progressDelegate methodSignatureForSelector: selector]];
+	[invocation setTarget: progressDelegate];
+	[invocation setSelector: selector];
+	[invocation setArgument: &_parser atIndex: 2];
+	[invocation setArgument: &progress atIndex: 3];
+	
+	[self _addInvocation: invocation retainingObject: nil];
+}
+
+- (void) _performInvocationNow: (NSInvocation *) invocation
+{
+	// keep everything in order
+	[self _sendBatch];
+	
+	if ( _cancelled )
+		return;
+	
+	[invocation performSelector: @selector(invoke)
+					   onThread: _targetThread
+					 withObject: nil
+				  waitUntilDone: YES
+						  modes: DeliveryModes()];
+}
+
+- (void) _sendBatch
+{
+	if ( [_batch count] == 0 )
+		return;
+	
+	[_batchCondition lock];
+	
+	// don't let the delegate fall too far behind
+	while ( (_pendingBatches >= MAX_PENDING_BATCHES) && (_cancelled == NO) )
+		[_batchCondition wait];
+	
+	if ( _cancelled )
+	{
+		[_batchCondition unlock];
+		[_batch removeAllObjects];
+		return;
+	}
+	
+	_pendingBatches++;
+	[_batchCondition unlock];
+	
+	NSArray * batch = _batch;
+	_batch = [[NSMutableArray alloc] initWithCapacity: _batchSize];
+	
+	[self performSelector: @selector(_deliverBatch:)
+				 onThread: _targetThread
+			   withObject: batch
+			waitUntilDone: NO
+					modes: DeliveryModes()];
+	
+	[batch release];
+}
+
+// target thread
+- (void) _deliverBatch: (NSArray *) batch
+{
+	_AQXMLParserInternal * info = [_parser _info];
+	
+	for ( id obj in batch )
+	{
+		if ( _cancelled || info->delegateAborted )
+			break;
+		
+		// the batch also holds the data backing any foundCharacterBytes: messages
+		if ( [obj isKindOfClass: [NSInvocation class]] )
+			[obj invoke];
+	}
+	
+	[_batchCondition lock];
+	_pendingBatches--;
+	[_batchCondition signal];
+	[_batchCondition unlock];
+}
+
+// target thread
+- (void) _parseFinished: (NSNumber *) result
+{
+	AQXMLParser * parser = _parser;
+	BOOL cancelled = _cancelled;
+	
+	// this releases us
+	[parser _backgroundParseFinished];
+	
+	// if the delegate aborted, -abortParsing has already reported completion
+	if ( cancelled == NO )
+		[parser _setStreamComplete: [result boolValue]];
+	
+	[parser release];
+}
+
+@end
@@ -0,0 +1,96 @@
+/*
+ *  AQXMLPathFilter.h
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import <libxml/dict.h>
+
+// This is an internal class which implements AQXMLParser's pathFilter property.
+// Each path is compiled into a list of steps whose names are interned in the parser's own
+//  dictionary, so elements are matched by comparing pointers, and the set of partially
+//  matched steps for each path is kept as a bitmask for every open element. Once an element
+//  can no longer lead to a match, nothing below it is examined at all.
+
+typedef struct _AQXMLPathStep
+{
+	const xmlChar *		localname;		// NULL for '*'
+	const xmlChar *		prefix;			// NULL to match any prefix
+	BOOL				descendant;		// step was preceded by '//'
+	
+} AQXMLPathStep;
+
+typedef struct _AQXMLPath
+{
+	AQXMLPathStep *		steps;
+	NSUInteger			count;
+	
+} AQXMLPath;
+
+// paths are limited to this many steps, so the match states fit in a single word
+#define AQXML_MAX_PATH_STEPS	63
+
+@interface _AQXMLPathFilter : NSObject
+{
+@public
+	AQXMLPath *			paths;
+	NSUInteger			pathCount;
+	BOOL				compareStrings;		// names aren't guaranteed to be interned (HTML), so compare them ignoring case
+	xmlDictPtr			_dict;				// holds our interned step names
+	
+	// match states: one word per path for each open element
+	uint64_t *			states;
+	NSUInteger			stateCapacity;		// in elements
+	
+	NSUInteger			depth;
+	NSUInteger			matchDepth;			// depth of the matched element we're inside, or zero
+	NSUInteger			deadDepth;			// depth of the element below which nothing can match, or zero
+}
+
+// returns nil and sets *error for a path which isn't of the form '/a/b', '//b', '/a//c' or
+//  '/a/*/c'. Namespace prefixes, if used, must be those used in the document.
+- (id) initWithPaths: (NSArray *) pathStrings dictionary: (xmlDictPtr) dict error: (NSError **) error;
+
+@end
+
+// Return YES if events for the element should be passed on. The end of an element is passed
+//  on if its start was.
+extern BOOL AQXMLPathFilterStartElement( _AQXMLPathFilter * filter, const xmlChar * localname, const xmlChar * prefix );
+extern BOOL AQXMLPathFilterEndElement( _AQXMLPathFilter * filter );
+
+// YES if we're inside a matching element, meaning character data & the like should be passed on
+static inline BOOL AQXMLPathFilterIsMatching( _AQXMLPathFilter * filter )
+{
+	return ( filter->matchDepth != 0 );
+}
@@ -0,0 +1,282 @@
+/*
+ *  AQXMLPathFilter.m
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQXMLPathFilter.h"
+#import <libxml/xmlstring.h>
+
+#define STATE_BIT(s)	(((uint64_t)1) << (s))
+
+static NSError * PathError( NSString * path, NSString * reason )
+{
+	NSString * desc = [NSString stringWithFormat: @"Invalid path filter '%@': %@", path, reason];
+	return ( [NSError errorWithDomain: NSXMLParserErrorDomain
+								 code: NSXMLParserInvalidCharacterError
+							 userInfo: [NSDictionary dictionaryWithObject: desc forKey: NSLocalizedDescriptionKey]] );
+}
+
+static const xmlChar * InternString( xmlDictPtr dict, NSString * str )
+{
+	if ( dict != NULL )
+		return ( xmlDictLookup(dict, (const xmlChar *) [str UTF8String], -1) );
+	
+	// names are only compared as strings for HTML, which libxml2 lowercases
+	return ( xmlStrdup((const xmlChar *) [[str lowercaseString] UTF8String]) );
+}
+
+@implementation _AQXMLPathFilter
+
+- (BOOL) _compilePath: (NSString * ) pathString into: (AQXMLPath *) path dictionary: (xmlDictPtr) dict error: (NSError **) error
+{
+	if ( [pathString hasPrefix: @"/"] == NO )
+	{
+		if ( error != NULL )
+			*error = PathError( pathString, @"paths must begin with '/'" );
+		return ( NO );
+	}
+	
+	// '/a//b' splits into '', 'a', '', 'b'; an empty component marks the next step as a descendant
+	NSArray * components = [[pathString substringFromIndex: 1] componentsSeparatedByString: @"/"];
+	if ( [components count] > AQXML_MAX_PATH_STEPS )
+	{
+		if ( error != NULL )
+			*error = PathError( pathString, @"too many steps" );
+		return ( NO );
+	}
+	
+	path->steps = calloc( [components count], sizeof(AQXMLPathStep) );
+	path->count = 0;
+	
+	BOOL descendant = NO;
+	for ( NSString * component in components )
+	{
+		if ( [component length] == 0 )
+		{
+			if ( descendant )
+				break;		// '///' is invalid; caught below
+			descendant = YES;
+			continue;
+		}
+		
+		AQXMLPathStep * step = &path->steps[path->count++];
+		step->descendant = descendant;
+		descendant = NO;
+		
+		NSString * localname = component;
+		NSRange colon = [component rangeOfString: @":"];
+		if ( colon.location != NSNotFound )
+		{
+			step->prefix = InternString( dict, [component substringToIndex: colon.location] );
+			localname = [component substringFromIndex: NSMaxRange(colon)];
+		}
+		
+		if ( [localname isEqualToString: @"*"] == NO )
+			step->localname = InternString( dict, localname );
+	}
+	
+	if ( descendant || (path->count == 0) )
+	{
+		if ( error != NULL )
+			*error = PathError( pathString, @"paths must end with an element name or '*'" );
+		return ( NO );
+	}
+	
+	return ( YES );
+}
+
+- (id) initWithPaths: (NSArray *) pathStrings dictionary: (xmlDictPtr) dict error: (NSError **) error
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	// without a dictionary to intern names in, we fall back on comparing them
+	compareStrings = (dict == NULL);
+	if ( dict != NULL )
+		xmlDictReference( dict );
+	_dict = dict;
+	
+	pathCount = [pathStrings count];
+	paths = calloc( pathCount, sizeof(AQXMLPath) );
+	
+	NSUInteger i;
+	for ( i = 0; i < pathCount; i++ )
+	{
+		if ( [self _compilePath: [pathStrings objectAtIndex: i] into: &paths[i] dictionary: dict error: error] == NO )
+		{
+			[self release];
+			return ( nil );
+		}
+	}
+	
+	stateCapacity = 32;
+	states = malloc( stateCapacity * pathCount * sizeof(uint64_t) );
+	
+	return ( self );
+}
+
+- (void) _freeStorage
+{
+	NSUInteger i, j;
+	for ( i = 0; i < pathCount; i++ )
+	{
+		// interned names belong to the dictionary; our own copies don't
+		if ( compareStrings )
+		{
+			for ( j = 0; j < paths[i].count; j++ )
+			{
+				xmlFree( (xmlChar *) paths[i].steps[j].localname );
+				xmlFree( (xmlChar *) paths[i].steps[j].prefix );
+			}
+		}
+		
+		free( paths[i].steps );
+	}
+	
+	free( paths );
+	free( states );
+	paths = NULL;
+	states = NULL;
+	
+	if ( _dict != NULL )
+	{
+		xmlDictFree( _dict );
+		_dict = NULL;
+	}
+}
+
+- (void) dealloc
+{
+	[self _freeStorage];
+	[super dealloc];
+}
+
+- (void) finalize
+{
+	[self _freeStorage];
+	[super finalize];
+}
+
+@end
+
+static inline BOOL NamesMatch( const xmlChar * stepName, const xmlChar * name, BOOL compareStrings )
+{
+	if ( stepName == name )
+		return ( YES );
+	return ( compareStrings && (xmlStrcasecmp(stepName, name) == 0) );
+}
+
+static inline BOOL StepMatches( const AQXMLPathStep * step, const xmlChar * localname, const xmlChar * prefix,
+								BOOL compareStrings )
+{
+	if ( (step->localname != NULL) && (NamesMatch(step->localname, localname, compareStrings) == NO) )
+		return ( NO );
+	if ( (step->prefix != NULL) && (NamesMatch(step->prefix, prefix, compareStrings) == NO) )
+		return ( NO );
+	return ( YES );
+}
+
+BOOL AQXMLPathFilterStartElement( _AQXMLPathFilter * filter, const xmlChar * localname, const xmlChar * prefix )
+{
+	filter->depth++;
+	
+	// everything inside a match is passed on, and nothing inside a dead end can match
+	if ( (filter->matchDepth != 0) || (filter->deadDepth != 0) )
+		return ( filter->matchDepth != 0 );
+	
+	NSUInteger n = filter->pathCount;
+	if ( filter->depth > filter->stateCapacity )
+	{
+		filter->stateCapacity *= 2;
+		filter->states = realloc( filter->states, filter->stateCapacity * n * sizeof(uint64_t) );
+	}
+	
+	uint64_t * current = filter->states + ((filter->depth - 1) * n);
+	const uint64_t * parent = (filter->depth > 1 ? current - n : NULL);
+	
+	BOOL alive = NO;
+	NSUInteger i, s;
+	for ( i = 0; i < n; i++ )
+	{
+		const AQXMLPath * path = &filter->paths[i];
+		
+		// the document root is only preceded by the start state
+		uint64_t in = (parent != NULL ? parent[i] : STATE_BIT(0));
+		uint64_t out = 0;
+		
+		for ( s = 0; (s < path->count) && (in != 0); s++, in >>= 1 )
+		{
+			if ( (in & 1) == 0 )
+				continue;
+			
+			const AQXMLPathStep * step = &path->steps[s];
+			
+			// a descendant step can be satisfied at any depth below here
+			if ( step->descendant )
+				out |= STATE_BIT(s);
+			if ( StepMatches(step, localname, prefix, filter->compareStrings) )
+				out |= STATE_BIT(s+1);
+		}
+		
+		if ( out & STATE_BIT(path->count) )
+		{
+			filter->matchDepth = filter->depth;
+			return ( YES );
+		}
+		
+		current[i] = out;
+		if ( out != 0 )
+			alive = YES;
+	}
+	
+	if ( alive == NO )
+		filter->deadDepth = filter->depth;
+	
+	return ( NO );
+}
+
+BOOL AQXMLPathFilterEndElement( _AQXMLPathFilter * filter )
+{
+	BOOL result = (filter->matchDepth != 0);
+	
+	if ( filter->matchDepth == filter->depth )
+		filter->matchDepth = 0;
+	if ( filter->deadDepth == filter->depth )
+		filter->deadDepth = 0;
+	
+	if ( filter->depth > 0 )
+		filter->depth--;
+	
+	return ( result );
+}
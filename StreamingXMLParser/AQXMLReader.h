@@ -0,0 +1,108 @@
+/*
+ *  AQXMLReader.h
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "iPhoneNonatomic.h"
+
+@class _AQXMLReaderInternal;
+
+typedef enum
+{
+	AQXMLReaderEventNone,
+	AQXMLReaderEventStartDocument,
+	AQXMLReaderEventStartElement,
+	AQXMLReaderEventEndElement,
+	AQXMLReaderEventCharacters,
+	AQXMLReaderEventCDATA,
+	AQXMLReaderEventComment,
+	AQXMLReaderEventProcessingInstruction,
+	AQXMLReaderEventEndDocument,
+	AQXMLReaderEventError
+	
+} AQXMLReaderEventType;
+
+// A pull-style counterpart to AQXMLParser. Rather than having a delegate receive callbacks,
+//  the caller asks for one event at a time & looks at the reader's properties to find out
+//  what it contains. Data is read from the stream synchronously, in small chunks, only when
+//  the reader runs out of events.
+// The same libxml2 push parser is used underneath, with the same options as AQXMLParser.
+
+@interface AQXMLReader : NSObject
+{
+	NSInputStream *			_stream;
+	_AQXMLReaderInternal *	_internal;
+}
+
+- (id) initWithStream: (NSInputStream *) stream;
+- (id) initWithData: (NSData *) data;
+
+// the number of bytes read from the stream & handed to libxml2 at a time (default 4KB)
+// smaller values make -skipSubtree cheaper, since fewer events are built ahead of time
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger chunkSize;
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL shouldProcessNamespaces;
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL shouldResolveExternalEntities;
+
+// advances to the next event & returns its type. Returns AQXMLReaderEventNone once
+//  AQXMLReaderEventEndDocument or AQXMLReaderEventError has been returned.
+- (AQXMLReaderEventType) nextEvent;
+
+// when positioned on a start tag, moves to its matching end tag without creating any
+//  objects for the contents. Does nothing for any other event. Returns NO on error.
+- (BOOL) skipSubtree;
+
+// when positioned on a start tag, returns all the text it contains (including that of any
+//  nested elements) and moves to its matching end tag. Returns nil on error, or if not
+//  positioned on a start tag.
+- (NSString *) readElementText;
+
+// information about the current event
+@property (nonatomic, readonly) AQXMLReaderEventType eventType;
+@property (nonatomic, readonly) NSUInteger depth;		// the root element is at depth zero
+
+// start & end tags
+@property (nonatomic, readonly) NSString * elementName;
+@property (nonatomic, readonly) NSString * qualifiedName;
+@property (nonatomic, readonly) NSString * namespaceURI;
+@property (nonatomic, readonly) NSDictionary * attributes;		// start tags only
+
+// characters, CDATA & comments; for processing instructions, this is the data
+@property (nonatomic, readonly) NSString * text;
+// processing instructions only
+@property (nonatomic, readonly) NSString * target;
+
+@property (nonatomic, readonly) NSError * readerError;
+
+@end
@@ -0,0 +1,682 @@
+/*
+ *  AQXMLReader.m
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQXMLReader.h"
+#import <libxml/parser.h>
+#import <libxml/parserInternals.h>
+#import <libxml/SAX2.h>
+#import <libxml/xmlerror.h>
+
+#define DEFAULT_CHUNK_SIZE (4 * 1024)
+
+// a single parsing event, built by the SAX callbacks & queued until the caller asks for it
+@interface _AQXMLReaderEvent : NSObject
+{
+@public
+	AQXMLReaderEventType	type;
+	NSUInteger				depth;
+	NSString *				name;
+	NSString *				qName;
+	NSString *				URI;
+	NSDictionary *			attributes;
+	NSString *				target;
+	NSMutableString *		text;
+}
+@end
+
+@implementation _AQXMLReaderEvent
+
+- (void) dealloc
+{
+	[name release];
+	[qName release];
+	[URI release];
+	[attributes release];
+	[target release];
+	[text release];
+	[super dealloc];
+}
+
+@end
+
+@interface _AQXMLReaderInternal : NSObject
+{
+@public
+	xmlSAXHandler			saxHandler;
+	xmlParserCtxtPtr		parserContext;
+	
+	NSMutableArray *		events;
+	_AQXMLReaderEvent *		current;
+	NSUInteger				parseDepth;
+	
+	// while skipping, the callbacks only count tags until the element at skipDepth ends
+	BOOL					skipping;
+	NSUInteger				skipDepth;
+	
+	// maps libxml2 dictionary-owned name pointers to NSStrings
+	CFMutableDictionaryRef	internedNames;
+	
+	uint8_t *				readBuffer;
+	NSUInteger				chunkSize;
+	BOOL					inputComplete;
+	BOOL					parseComplete;
+	
+	BOOL					processNamespaces;
+	BOOL					resolveExternals;
+	int						fatalError;
+	NSError *				error;
+}
+@end
+
+@implementation _AQXMLReaderInternal
+
+- (void) dealloc
+{
+	[events release];
+	[current release];
+	[error release];
+	[super dealloc];
+}
+
+@end
+
+@interface AQXMLReader ()
+- (_AQXMLReaderInternal *) _info;
+@end
+
+#pragma mark -
+
+static NSString * InternedName( AQXMLReader * reader, const xmlChar * ch )
+{
+	if ( ch == NULL )
+		return ( nil );
+	
+	_AQXMLReaderInternal * info = [reader _info];
+	NSString * result = (NSString *) CFDictionaryGetValue( info->internedNames, ch );
+	if ( result != nil )
+		return ( result );
+	
+	result = [[NSString alloc] initWithUTF8String: (const char *) ch];
+	
+	xmlParserCtxtPtr p = info->parserContext;
+	if ( (p != NULL) && (p->dict != NULL) && (xmlDictOwns(p->dict, ch) == 1) )
+	{
+		CFDictionarySetValue( info->internedNames, ch, result );
+		[result release];
+	}
+	else
+	{
+		[result autorelease];
+	}
+	
+	return ( result );
+}
+
+static NSString * InternedQName( AQXMLReader * reader, const xmlChar * prefix, const xmlChar * localname )
+{
+	if ( (prefix == NULL) || (*prefix == '\0') )
+		return ( InternedName(reader, localname) );
+	
+	xmlParserCtxtPtr p = [reader _info]->parserContext;
+	const xmlChar * qname = xmlDictQLookup( p->dict, prefix, localname );
+	if ( qname != NULL )
+		return ( InternedName(reader, qname) );
+	
+	return ( [NSString stringWithFormat: @"%s:%s", prefix, localname] );
+}
+
+static _AQXMLReaderEvent * QueueEvent( AQXMLReader * reader, AQXMLReaderEventType type )
+{
+	_AQXMLReaderInternal * info = [reader _info];
+	_AQXMLReaderEvent * event = [[_AQXMLReaderEvent alloc] init];
+	event->type = type;
+	event->depth = info->parseDepth;
+	[info->events addObject: event];
+	[event release];
+	return ( event );
+}
+
+static void AppendText( AQXMLReader * reader, AQXMLReaderEventType type, const xmlChar * ch, int len )
+{
+	_AQXMLReaderInternal * info = [reader _info];
+	if ( info->skipping )
+		return;
+	
+	NSString * str = [[NSString alloc] initWithBytes: ch length: len encoding: NSUTF8StringEncoding];
+	
+	// libxml2 hands us text in pieces; join them back up
+	_AQXMLReaderEvent * event = [info->events lastObject];
+	if ( (event != nil) && (event->type == type) )
+	{
+		[event->text appendString: str];
+	}
+	else
+	{
+		event = QueueEvent( reader, type );
+		event->text = [str mutableCopy];
+	}
+	
+	[str release];
+}
+
+// the default SAX2 handlers expect the parser context as their argument, and they take care
+//  of the document & DTD bookkeeping which entity substitution relies upon
+static inline xmlParserCtxtPtr ParserContext( void * ctx )
+{
+	return ( [(AQXMLReader *) ctx _info]->parserContext );
+}
+
+static void __internalSubset( void * ctx, const xmlChar * name, const xmlChar * ExternalID, const xmlChar * SystemID )
+{
+	xmlSAX2InternalSubset( ParserContext(ctx), name, ExternalID, SystemID );
+}
+
+static void __externalSubset( void * ctx, const xmlChar * name, const xmlChar * ExternalID, const xmlChar * SystemID )
+{
+	xmlSAX2ExternalSubset( ParserContext(ctx), name, ExternalID, SystemID );
+}
+
+static xmlEntityPtr __getEntity( void * ctx, const xmlChar * name )
+{
+	return ( xmlSAX2GetEntity(ParserContext(ctx), name) );
+}
+
+static xmlEntityPtr __getParameterEntity( void * ctx, const xmlChar * name )
+{
+	return ( xmlSAX2GetParameterEntity(ParserContext(ctx), name) );
+}
+
+static void __entityDecl( void * ctx, const xmlChar * name, int type, const xmlChar * publicId,
+						  const xmlChar * systemId, xmlChar * content )
+{
+	xmlSAX2EntityDecl( ParserContext(ctx), name, type, publicId, systemId, content );
+}
+
+static void __startDocument( void * ctx )
+{
+	xmlSAX2StartDocument( ParserContext(ctx) );
+	QueueEvent( (AQXMLReader *) ctx, AQXMLReaderEventStartDocument );
+}
+
+static void __endDocument( void * ctx )
+{
+	// whatever we were skipping has gone for good
+	[(AQXMLReader *) ctx _info]->skipping = NO;
+	QueueEvent( (AQXMLReader *) ctx, AQXMLReaderEventEndDocument );
+}
+
+static void __startElementNS( void * ctx, const xmlChar *localname, const xmlChar *prefix,
+							 const xmlChar *URI, int nb_namespaces, const xmlChar **namespaces,
+							 int nb_attributes, int nb_defaulted, const xmlChar **attributes )
+{
+	AQXMLReader * reader = (AQXMLReader *) ctx;
+	_AQXMLReaderInternal * info = [reader _info];
+	
+	if ( info->skipping )
+	{
+		info->parseDepth++;
+		return;
+	}
+	
+	_AQXMLReaderEvent * event = QueueEvent( reader, AQXMLReaderEventStartElement );
+	event->name = [InternedName(reader, localname) retain];
+	event->qName = [InternedQName(reader, prefix, localname) retain];
+	if ( info->processNamespaces )
+		event->URI = [InternedName(reader, URI) retain];
+	
+	if ( nb_attributes > 0 )
+	{
+		NSMutableDictionary * attrDict = [[NSMutableDictionary alloc] initWithCapacity: nb_attributes];
+		
+		int i;
+		for ( i = 0; i < (nb_attributes * 5); i += 5 )
+		{
+			NSString * value = [[NSString alloc] initWithBytes: attributes[i+3]
+														 length: attributes[i+4] - attributes[i+3]
+													   encoding: NSUTF8StringEncoding];
+			[attrDict setObject: value forKey: InternedQName(reader, attributes[i+1], attributes[i])];
+			[value release];
+		}
+		
+		event->attributes = attrDict;
+	}
+	
+	info->parseDepth++;
+}
+
+static void __endElementNS( void * ctx, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI )
+{
+	AQXMLReader * reader = (AQXMLReader *) ctx;
+	_AQXMLReaderInternal * info = [reader _info];
+	
+	info->parseDepth--;
+	
+	if ( info->skipping )
+	{
+		if ( info->parseDepth != info->skipDepth )
+			return;
+		
+		// this is the end of the element being skipped, which the caller gets to see
+		info->skipping = NO;
+	}
+	
+	_AQXMLReaderEvent * event = QueueEvent( reader, AQXMLReaderEventEndElement );
+	event->name = [InternedName(reader, localname) retain];
+	event->qName = [InternedQName(reader, prefix, localname) retain];
+	if ( info->processNamespaces )
+		event->URI = [InternedName(reader, URI) retain];
+}
+
+static void __characters( void * ctx, const xmlChar * ch, int len )
+{
+	AppendText( (AQXMLReader *) ctx, AQXMLReaderEventCharacters, ch, len );
+}
+
+static void __cdataBlock( void * ctx, const xmlChar * value, int len )
+{
+	AppendText( (AQXMLReader *) ctx, AQXMLReaderEventCDATA, value, len );
+}
+
+static void __comment( void * ctx, const xmlChar * value )
+{
+	AQXMLReader * reader = (AQXMLReader *) ctx;
+	if ( [reader _info]->skipping )
+		return;
+	
+	_AQXMLReaderEvent * event = QueueEvent( reader, AQXMLReaderEventComment );
+	event->text = [[NSMutableString alloc] initWithUTF8String: (const char *) value];
+}
+
+static void __processingInstruction( void * ctx, const xmlChar * target, const xmlChar * data )
+{
+	AQXMLReader * reader = (AQXMLReader *) ctx;
+	if ( [reader _info]->skipping )
+		return;
+	
+	_AQXMLReaderEvent * event = QueueEvent( reader, AQXMLReaderEventProcessingInstruction );
+	event->target = [InternedName(reader, target) retain];
+	if ( data != NULL )
+		event->text = [[NSMutableString alloc] initWithUTF8String: (const char *) data];
+}
+
+static void __structuredError( void * ctx, xmlErrorPtr errorData )
+{
+	// we're in recovery mode, so only a fatal error will stop the parser
+	_AQXMLReaderInternal * info = [(AQXMLReader *) ctx _info];
+	if ( (errorData->level == XML_ERR_FATAL) && (info->fatalError == XML_ERR_OK) )
+		info->fatalError = errorData->code;
+}
+
+#pragma mark -
+
+@implementation AQXMLReader
+
+- (id) initWithStream: (NSInputStream *) stream
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_stream = [stream retain];
+	
+	_internal = [[_AQXMLReaderInternal alloc] init];
+	_internal->events = [[NSMutableArray alloc] init];
+	_internal->internedNames = (CFMutableDictionaryRef) CFMakeCollectable( CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, &kCFTypeDictionaryValueCallBacks) );
+	_internal->chunkSize = DEFAULT_CHUNK_SIZE;
+	
+	// anything not set here is ignored
+	xmlSAXHandlerPtr p = &_internal->saxHandler;
+	memset( p, 0, sizeof(xmlSAXHandler) );
+	
+	p->internalSubset = __internalSubset;
+	p->externalSubset = __externalSubset;
+	p->getEntity = __getEntity;
+	p->getParameterEntity = __getParameterEntity;
+	p->entityDecl = __entityDecl;
+	p->startDocument = __startDocument;
+	p->endDocument = __endDocument;
+	p->startElementNs = __startElementNS;
+	p->endElementNs = __endElementNS;
+	p->characters = __characters;
+	p->ignorableWhitespace = __characters;
+	p->cdataBlock = __cdataBlock;
+	p->comment = __comment;
+	p->processingInstruction = __processingInstruction;
+	p->serror = __structuredError;
+	p->initialized = XML_SAX2_MAGIC;
+	
+	return ( self );
+}
+
+- (id) initWithData: (NSData *) data
+{
+	NSInputStream * stream = [[NSInputStream alloc] initWithData: data];
+	id result = [self initWithStream: stream];
+	[stream release];
+	return ( result );
+}
+
+- (void) _freeParserResources
+{
+	if ( _internal->parserContext != NULL )
+	{
+		xmlParserCtxtPtr p = _internal->parserContext;
+		if ( p->myDoc != NULL )
+			xmlFreeDoc( p->myDoc );
+		xmlFreeParserCtxt( p );
+		_internal->parserContext = NULL;
+	}
+	
+	if ( _internal->readBuffer != NULL )
+	{
+		free( _internal->readBuffer );
+		_internal->readBuffer = NULL;
+	}
+}
+
+- (void) dealloc
+{
+	[self _freeParserResources];
+	if ( _internal->internedNames != NULL )
+		CFRelease( _internal->internedNames );
+	
+	[_stream close];
+	[_stream release];
+	[_internal release];
+	[super dealloc];
+}
+
+- (void) finalize
+{
+	[self _freeParserResources];
+	[_stream close];
+	[super finalize];
+}
+
+- (_AQXMLReaderInternal *) _info
+{
+	return ( _internal );
+}
+
+- (NSUInteger) chunkSize
+{
+	return ( _internal->chunkSize );
+}
+
+- (void) setChunkSize: (NSUInteger) value
+{
+	// can't change it once we've started reading
+	if ( (_internal->readBuffer != NULL) || (value == 0) )
+		return;
+	
+	_internal->chunkSize = value;
+}
+
+- (BOOL) shouldProcessNamespaces
+{
+	return ( _internal->processNamespaces );
+}
+
+- (void) setShouldProcessNamespaces: (BOOL) value
+{
+	if ( _internal->parserContext != NULL )
+		return;
+	
+	_internal->processNamespaces = value;
+}
+
+- (BOOL) shouldResolveExternalEntities
+{
+	return ( _internal->resolveExternals );
+}
+
+- (void) setShouldResolveExternalEntities: (BOOL) value
+{
+	if ( _internal->parserContext != NULL )
+		return;
+	
+	_internal->resolveExternals = value;
+}
+
+- (void) _setReaderError: (NSError *) error
+{
+	if ( _internal->error == nil )
+		_internal->error = [error retain];
+	
+	_internal->parseComplete = YES;
+	QueueEvent( self, AQXMLReaderEventError );
+}
+
+// reads & parses chunks of input until there's at least one event waiting, or there's nothing left
+- (BOOL) _fillEventQueue
+{
+	while ( ([_internal->events count] == 0) && (_internal->parseComplete == NO) )
+	{
+		NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+		NSInteger numRead = 0;
+		
+		if ( _internal->readBuffer == NULL )
+		{
+			_internal->readBuffer = malloc( _internal->chunkSize );
+			if ( [_stream streamStatus] == NSStreamStatusNotOpen )
+				[_stream open];
+		}
+		
+		if ( _internal->inputComplete == NO )
+		{
+			numRead = [_stream read: _internal->readBuffer maxLength: _internal->chunkSize];
+			if ( numRead < 0 )
+			{
+				[self _setReaderError: [_stream streamError]];
+				[pool drain];
+				break;
+			}
+			
+			if ( numRead == 0 )
+				_internal->inputComplete = YES;
+		}
+		
+		int err = XML_ERR_OK;
+		if ( _internal->parserContext == NULL )
+		{
+			_internal->parserContext = xmlCreatePushParserCtxt( &_internal->saxHandler, self,
+																(const char *)(numRead > 0 ? _internal->readBuffer : NULL),
+																numRead, NULL );
+			
+			int options = _internal->resolveExternals ?
+				XML_PARSE_RECOVER | XML_PARSE_NOENT | XML_PARSE_DTDLOAD :
+				XML_PARSE_RECOVER | XML_PARSE_DTDATTR;
+			
+			xmlCtxtUseOptions( _internal->parserContext, options );
+		}
+		else if ( numRead > 0 )
+		{
+			err = xmlParseChunk( _internal->parserContext, (const char *) _internal->readBuffer, numRead, 0 );
+		}
+		
+		if ( (err == XML_ERR_OK) && _internal->inputComplete )
+		{
+			err = xmlParseChunk( _internal->parserContext, NULL, 0, 1 );
+			_internal->parseComplete = YES;
+		}
+		
+		if ( (err == XML_ERR_OK) && (_internal->fatalError != XML_ERR_OK) )
+			err = _internal->fatalError;
+		
+		if ( err != XML_ERR_OK )
+		{
+			[self _setReaderError: [NSError errorWithDomain: NSXMLParserErrorDomain
+													   code: err
+												   userInfo: nil]];
+		}
+		
+		[pool drain];
+	}
+	
+	return ( [_internal->events count] != 0 );
+}
+
+- (AQXMLReaderEventType) nextEvent
+{
+	[_internal->current release];
+	_internal->current = nil;
+	
+	if ( [self _fillEventQueue] == NO )
+		return ( AQXMLReaderEventNone );
+	
+	_internal->current = [[_internal->events objectAtIndex: 0] retain];
+	[_internal->events removeObjectAtIndex: 0];
+	
+	return ( _internal->current->type );
+}
+
+- (BOOL) skipSubtree
+{
+	_AQXMLReaderEvent * event = _internal->current;
+	if ( (event == nil) || (event->type != AQXMLReaderEventStartElement) )
+		return ( YES );
+	
+	NSUInteger depth = event->depth;
+	
+	// anything already parsed has to be stepped over the slow way
+	while ( [_internal->events count] != 0 )
+	{
+		AQXMLReaderEventType type = [self nextEvent];
+		if ( type == AQXMLReaderEventError )
+			return ( NO );
+		if ( (type == AQXMLReaderEventEndElement) && (_internal->current->depth == depth) )
+			return ( YES );
+	}
+	
+	// the rest hasn't been parsed yet, so the callbacks will just count tags until it ends
+	_internal->skipping = YES;
+	_internal->skipDepth = depth;
+	
+	return ( ([self nextEvent] == AQXMLReaderEventEndElement) && (_internal->current->depth == depth) );
+}
+
+- (NSString *) readElementText
+{
+	_AQXMLReaderEvent * event = _internal->current;
+	if ( (event == nil) || (event->type != AQXMLReaderEventStartElement) )
+		return ( nil );
+	
+	NSUInteger depth = event->depth;
+	NSMutableString * result = [NSMutableString string];
+	
+	for ( ;; )
+	{
+		switch ( [self nextEvent] )
+		{
+			case AQXMLReaderEventCharacters:
+			case AQXMLReaderEventCDATA:
+				[result appendString: _internal->current->text];
+				break;
+				
+			case AQXMLReaderEventEndElement:
+				if ( _internal->current->depth == depth )
+					return ( result );
+				break;
+				
+			case AQXMLReaderEventError:
+			case AQXMLReaderEventEndDocument:
+			case AQXMLReaderEventNone:
+				return ( nil );
+				
+			default:
+				break;
+		}
+	}
+	
+	return ( nil );
+}
+
+- (AQXMLReaderEventType) eventType
+{
+	if ( _internal->current == nil )
+		return ( AQXMLReaderEventNone );
+	return ( _internal->current->type );
+}
+
+// all the per-event properties are nil/zero when there's no current event
+#define CurrentEventField(field) (_internal->current != nil ? _internal->current->field : nil)
+
+- (NSUInteger) depth
+{
+	if ( _internal->current == nil )
+		return ( 0 );
+	return ( _internal->current->depth );
+}
+
+- (NSString *) elementName
+{
+	return ( CurrentEventField(name) );
+}
+
+- (NSString *) qualifiedName
+{
+	return ( CurrentEventField(qName) );
+}
+
+- (NSString *) namespaceURI
+{
+	return ( CurrentEventField(URI) );
+}
+
+- (NSDictionary *) attributes
+{
+	if ( [self eventType] != AQXMLReaderEventStartElement )
+		return ( nil );
+	if ( _internal->current->attributes == nil )
+		return ( [NSDictionary dictionary] );
+	return ( _internal->current->attributes );
+}
+
+- (NSString *) text
+{
+	return ( CurrentEventField(text) );
+}
+
+- (NSString *) target
+{
+	return ( CurrentEventField(target) );
+}
+
+- (NSError *) readerError
+{
+	return ( _internal->error );
+}
+
+@end
@@ -0,0 +1,110 @@
+/*
+ *  AQXMLWriter.h
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import <Foundation/Foundation.h>
+#import "iPhoneNonatomic.h"
+
+// Writes XML to an output stream as it's generated. Everything goes through a single fixed
+//  size buffer which is written to the stream whenever it fills, so memory use doesn't depend
+//  on the size of the document. Any NSOutputStream will do, including AQGzipOutputStream.
+// Text is written as UTF-8. Names are written as given; text, attribute values and the like
+//  are escaped as necessary.
+// Each method returns NO if the stream can't be written to, in which case writerError
+//  describes why and nothing further is written.
+
+@interface AQXMLWriter : NSObject
+{
+	NSOutputStream *	_stream;
+	NSError *			_error;
+	
+	uint8_t *			_buffer;
+	NSUInteger			_bufferSize;
+	NSUInteger			_bufferLength;
+	
+	NSMutableArray *	_elementNames;		// the open elements, outermost first
+	uint8_t *			_elementFlags;		// what each one contains, for pretty-printing
+	NSUInteger			_flagsCapacity;
+	BOOL				_startTagOpen;		// the '>' of the last start tag hasn't been written yet
+	BOOL				_wroteSomething;
+	
+	BOOL				_prettyPrint;
+	NSString *			_indentString;
+}
+
+// the stream is opened if it isn't open already
+- (id) initWithStream: (NSOutputStream *) stream;
+
+// the size of the output buffer; defaults to 64KB, and can only be changed before writing
+@property (NS_NONATOMIC_IPHONEONLY assign) NSUInteger bufferSize;
+
+// puts each element on a line of its own, indented by its depth. Elements containing text are
+//  kept on one line, so no whitespace is added to any text.
+@property (NS_NONATOMIC_IPHONEONLY assign) BOOL prettyPrint;
+@property (NS_NONATOMIC_IPHONEONLY copy) NSString * indentString;	// default is two spaces
+
+// the number of elements currently open
+@property (nonatomic, readonly) NSUInteger depth;
+
+@property (nonatomic, readonly) NSError * writerError;
+
+// writes the XML declaration
+- (BOOL) writeStartDocument;
+
+// closes any open elements & writes out everything buffered; doesn't close the stream
+- (BOOL) writeEndDocument;
+
+- (BOOL) writeStartElement: (NSString *) name;
+- (BOOL) writeStartElement: (NSString *) name attributes: (NSDictionary *) attributes;
+
+// only valid immediately after a start element or another attribute
+- (BOOL) writeAttribute: (NSString *) name value: (NSString *) value;
+
+// empty elements are closed as '<name/>'
+- (BOOL) writeEndElement;
+
+// a start element, its text, and its end element
+- (BOOL) writeElement: (NSString *) name text: (NSString *) text;
+
+- (BOOL) writeCharacters: (NSString *) text;
+- (BOOL) writeCharacterBytes: (const char *) bytes length: (NSUInteger) length;		// UTF-8
+- (BOOL) writeCDATA: (NSString *) text;
+- (BOOL) writeComment: (NSString *) comment;
+- (BOOL) writeProcessingInstructionWithTarget: (NSString *) target data: (NSString *) data;
+
+// writes anything buffered to the stream
+- (BOOL) flush;
+
+@end
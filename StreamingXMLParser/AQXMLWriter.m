@@ -0,0 +1,477 @@
+/*
+ *  AQXMLWriter.m
+ *  AQToolkit
+ *
+ *  Copyright (c) 2009, Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#import "AQXMLWriter.h"
+
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+
+// what an open element contains
+enum
+{
+	AQXMLWriterHasChildElements	= 1<<0,
+	AQXMLWriterHasText			= 1<<1
+	
+};
+
+// Replacements for the bytes which can't be written as-is, indexed by byte value; NULL means the
+//  byte is written unchanged. Control characters other than whitespace aren't allowed in XML
+//  at all, so they're dropped. UTF-8 sequences never contain bytes below 0x80, so multi-byte
+//  characters pass straight through.
+static const char * const __textEscapes[256] =
+{
+	[0x00 ... 0x08] = "", [0x0B] = "", [0x0C] = "", [0x0E ... 0x1F] = "",
+	['\r'] = "&#13;",
+	['&'] = "&amp;",
+	['<'] = "&lt;",
+	['>'] = "&gt;"
+};
+
+// attribute values also need their whitespace preserved & their quotes escaped
+static const char * const __attributeEscapes[256] =
+{
+	[0x00 ... 0x08] = "", [0x0B] = "", [0x0C] = "", [0x0E ... 0x1F] = "",
+	['\t'] = "&#9;",
+	['\n'] = "&#10;",
+	['\r'] = "&#13;",
+	['&'] = "&amp;",
+	['<'] = "&lt;",
+	['>'] = "&gt;",
+	['"'] = "&quot;"
+};
+
+@interface AQXMLWriter ()
+- (BOOL) _appendBytes: (const void *) bytes length: (NSUInteger) length;
+- (BOOL) _appendCString: (const char *) str;
+- (BOOL) _writeBytes: (const uint8_t *) bytes length: (NSUInteger) length escapes: (const char * const *) escapes;
+- (BOOL) _writeString: (NSString *) string escapes: (const char * const *) escapes;
+- (BOOL) _closeStartTag;
+- (BOOL) _beginNode: (BOOL) isText;
+- (BOOL) _writeNewlineAndIndent: (NSUInteger) depth;
+@end
+
+@implementation AQXMLWriter
+
+@synthesize prettyPrint=_prettyPrint, indentString=_indentString;
+
+- (id) initWithStream: (NSOutputStream *) stream
+{
+	if ( [super init] == nil )
+		return ( nil );
+	
+	_stream = [stream retain];
+	_bufferSize = DEFAULT_BUFFER_SIZE;
+	_elementNames = [[NSMutableArray alloc] init];
+	_indentString = @"  ";
+	
+	if ( [_stream streamStatus] == NSStreamStatusNotOpen )
+		[_stream open];
+	
+	return ( self );
+}
+
+- (void) dealloc
+{
+	[_stream release];
+	[_error release];
+	[_elementNames release];
+	[_indentString release];
+	if ( _buffer != NULL )
+		free( _buffer );
+	if ( _elementFlags != NULL )
+		free( _elementFlags );
+	[super dealloc];
+}
+
+- (void) finalize
+{
+	if ( _buffer != NULL )
+		free( _buffer );
+	if ( _elementFlags != NULL )
+		free( _elementFlags );
+	[super finalize];
+}
+
+- (NSUInteger) bufferSize
+{
+	return ( _bufferSize );
+}
+
+- (void) setBufferSize: (NSUInteger) value
+{
+	// the buffer is allocated by the first write
+	if ( (_buffer != NULL) || (value == 0) )
+		return;
+	
+	_bufferSize = value;
+}
+
+- (NSUInteger) depth
+{
+	return ( [_elementNames count] );
+}
+
+- (NSError *) writerError
+{
+	return ( [[_error retain] autorelease] );
+}
+
+#pragma mark Document
+
+- (BOOL) writeStartDocument
+{
+	return ( [self _appendCString: "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"] );
+}
+
+- (BOOL) writeEndDocument
+{
+	while ( [_elementNames count] != 0 )
+	{
+		if ( [self writeEndElement] == NO )
+			return ( NO );
+	}
+	
+	if ( _prettyPrint && _wroteSomething && ([self _appendCString: "\n"] == NO) )
+		return ( NO );
+	
+	return ( [self flush] );
+}
+
+#pragma mark Elements
+
+- (BOOL) writeStartElement: (NSString *) name
+{
+	if ( [self _beginNode: NO] == NO )
+		return ( NO );
+	
+	if ( ([self _appendCString: "<"] == NO) || ([self _writeString: name escapes: NULL] == NO) )
+		return ( NO );
+	
+	NSUInteger depth = [_elementNames count];
+	if ( depth == _flagsCapacity )
+	{
+		_flagsCapacity = (_flagsCapacity == 0 ? 16 : _flagsCapacity * 2);
+		_elementFlags = realloc( _elementFlags, _flagsCapacity );
+	}
+	
+	_elementFlags[depth] = 0;
+	[_elementNames addObject: name];
+	_startTagOpen = YES;
+	
+	return ( YES );
+}
+
+- (BOOL) writeStartElement: (NSString *) name attributes: (NSDictionary *) attributes
+{
+	if ( [self writeStartElement: name] == NO )
+		return ( NO );
+	
+	for ( NSString * key in attributes )
+	{
+		if ( [self writeAttribute: key value: [attributes objectForKey: key]] == NO )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+- (BOOL) writeAttribute: (NSString *) name value: (NSString *) value
+{
+	if ( _startTagOpen == NO )
+	{
+		[NSException raise: NSInternalInconsistencyException
+					format: @"Attribute '%@' written outside of a start tag", name];
+	}
+	
+	return ( [self _appendCString: " "] &&
+			 [self _writeString: name escapes: NULL] &&
+			 [self _appendCString: "=\""] &&
+			 [self _writeString: value escapes: __attributeEscapes] &&
+			 [self _appendCString: "\""] );
+}
+
+- (BOOL) writeEndElement
+{
+	NSUInteger depth = [_elementNames count];
+	if ( depth == 0 )
+		return ( _error == nil );
+	
+	NSString * name = [[_elementNames lastObject] retain];
+	uint8_t flags = _elementFlags[depth - 1];
+	[_elementNames removeLastObject];
+	
+	BOOL result = NO;
+	if ( _startTagOpen )
+	{
+		_startTagOpen = NO;
+		result = [self _appendCString: "/>"];
+	}
+	else
+	{
+		// only elements which contain nothing but other elements have their end tags on a new line
+		if ( _prettyPrint && (flags == AQXMLWriterHasChildElements) && ([self _writeNewlineAndIndent: depth - 1] == NO) )
+			result = NO;
+		else
+			result = ([self _appendCString: "</"] && [self _writeString: name escapes: NULL] && [self _appendCString: ">"]);
+	}
+	
+	[name release];
+	return ( result );
+}
+
+- (BOOL) writeElement: (NSString *) name text: (NSString *) text
+{
+	return ( [self writeStartElement: name] &&
+			 ([text length] == 0 || [self writeCharacters: text]) &&
+			 [self writeEndElement] );
+}
+
+#pragma mark Content
+
+- (BOOL) writeCharacters: (NSString *) text
+{
+	if ( [self _beginNode: YES] == NO )
+		return ( NO );
+	return ( [self _writeString: text escapes: __textEscapes] );
+}
+
+- (BOOL) writeCharacterBytes: (const char *) bytes length: (NSUInteger) length
+{
+	if ( [self _beginNode: YES] == NO )
+		return ( NO );
+	return ( [self _writeBytes: (const uint8_t *)bytes length: length escapes: __textEscapes] );
+}
+
+- (BOOL) writeCDATA: (NSString *) text
+{
+	if ( [self _beginNode: YES] == NO )
+		return ( NO );
+	
+	// a CDATA section can't contain its own terminator, so that's split across two sections
+	if ( [text rangeOfString: @"]]>"].location != NSNotFound )
+		text = [text stringByReplacingOccurrencesOfString: @"]]>" withString: @"]]]]><![CDATA[>"];
+	
+	return ( [self _appendCString: "<![CDATA["] &&
+			 [self _writeString: text escapes: NULL] &&
+			 [self _appendCString: "]]>"] );
+}
+
+// the comment mustn't contain '--'
+- (BOOL) writeComment: (NSString *) comment
+{
+	if ( [self _beginNode: NO] == NO )
+		return ( NO );
+	
+	return ( [self _appendCString: "<!--"] &&
+			 [self _writeString: comment escapes: NULL] &&
+			 [self _appendCString: "-->"] );
+}
+
+- (BOOL) writeProcessingInstructionWithTarget: (NSString *) target data: (NSString *) data
+{
+	if ( [self _beginNode: NO] == NO )
+		return ( NO );
+	
+	if ( ([self _appendCString: "<?"] == NO) || ([self _writeString: target escapes: NULL] == NO) )
+		return ( NO );
+	
+	if ( ([data length] != 0) && (([self _appendCString: " "] == NO) || ([self _writeString: data escapes: NULL] == NO)) )
+		return ( NO );
+	
+	return ( [self _appendCString: "?>"] );
+}
+
+#pragma mark Output
+
+- (BOOL) flush
+{
+	if ( _error != nil )
+		return ( NO );
+	
+	NSUInteger written = 0;
+	while ( written < _bufferLength )
+	{
+		NSInteger count = [_stream write: _buffer + written maxLength: _bufferLength - written];
+		if ( count <= 0 )
+		{
+			_error = [[_stream streamError] retain];
+			if ( _error == nil )
+				_error = [[NSError alloc] initWithDomain: NSPOSIXErrorDomain code: EIO userInfo: nil];
+			_bufferLength = 0;
+			return ( NO );
+		}
+		
+		written += count;
+	}
+	
+	_bufferLength = 0;
+	return ( YES );
+}
+
+- (BOOL) _appendBytes: (const void *) bytes length: (NSUInteger) length
+{
+	if ( _error != nil )
+		return ( NO );
+	
+	if ( _buffer == NULL )
+		_buffer = malloc( _bufferSize );
+	
+	_wroteSomething = YES;
+	
+	const uint8_t * p = (const uint8_t *) bytes;
+	while ( length != 0 )
+	{
+		if ( (_bufferLength == _bufferSize) && ([self flush] == NO) )
+			return ( NO );
+		
+		NSUInteger count = MIN(length, _bufferSize - _bufferLength);
+		memcpy( _buffer + _bufferLength, p, count );
+		_bufferLength += count;
+		p += count;
+		length -= count;
+	}
+	
+	return ( YES );
+}
+
+- (BOOL) _appendCString: (const char *) str
+{
+	return ( [self _appendBytes: str length: strlen(str)] );
+}
+
+- (BOOL) _writeBytes: (const uint8_t *) bytes length: (NSUInteger) length escapes: (const char * const *) escapes
+{
+	if ( escapes == NULL )
+		return ( [self _appendBytes: bytes length: length] );
+	
+	const uint8_t * end = bytes + length;
+	const uint8_t * run = bytes;
+	const uint8_t * p;
+	
+	for ( p = bytes; p < end; p++ )
+	{
+		const char * replacement = escapes[*p];
+		if ( replacement == NULL )
+			continue;
+		
+		if ( (p > run) && ([self _appendBytes: run length: p - run] == NO) )
+			return ( NO );
+		if ( (*replacement != '\0') && ([self _appendCString: replacement] == NO) )
+			return ( NO );
+		
+		run = p + 1;
+	}
+	
+	if ( end > run )
+		return ( [self _appendBytes: run length: end - run] );
+	
+	return ( _error == nil );
+}
+
+- (BOOL) _writeString: (NSString *) string escapes: (const char * const *) escapes
+{
+	// most strings can hand over their UTF-8 directly
+	const char * str = CFStringGetCStringPtr( (CFStringRef) string, kCFStringEncodingUTF8 );
+	if ( str != NULL )
+		return ( [self _writeBytes: (const uint8_t *)str length: strlen(str) escapes: escapes] );
+	
+	// otherwise it's converted a piece at a time, so long strings don't need a second copy
+	uint8_t chunk[1024];
+	NSRange range = NSMakeRange( 0, [string length] );
+	
+	while ( range.length != 0 )
+	{
+		NSUInteger used = 0;
+		if ( ([string getBytes: chunk maxLength: sizeof(chunk) usedLength: &used encoding: NSUTF8StringEncoding
+						options: 0 range: range remainingRange: &range] == NO) || (used == 0) )
+		{
+			// only unpaired surrogates stop a UTF-8 conversion; don't write a truncated document
+			if ( _error == nil )
+				_error = [[NSError alloc] initWithDomain: NSCocoaErrorDomain code: NSFileWriteInapplicableStringEncodingError userInfo: nil];
+			return ( NO );
+		}
+		
+		if ( [self _writeBytes: chunk length: used escapes: escapes] == NO )
+			return ( NO );
+	}
+	
+	return ( _error == nil );
+}
+
+- (BOOL) _closeStartTag
+{
+	if ( _startTagOpen == NO )
+		return ( _error == nil );
+	
+	_startTagOpen = NO;
+	return ( [self _appendCString: ">"] );
+}
+
+// called before writing anything inside the current element
+- (BOOL) _beginNode: (BOOL) isText
+{
+	if ( [self _closeStartTag] == NO )
+		return ( NO );
+	
+	NSUInteger depth = [_elementNames count];
+	if ( depth != 0 )
+		_elementFlags[depth - 1] |= (isText ? AQXMLWriterHasText : AQXMLWriterHasChildElements);
+	
+	if ( (_prettyPrint == NO) || isText || (_wroteSomething == NO) )
+		return ( YES );
+	
+	// don't add whitespace to an element which has text in it
+	if ( (depth != 0) && (_elementFlags[depth - 1] & AQXMLWriterHasText) )
+		return ( YES );
+	
+	return ( [self _writeNewlineAndIndent: depth] );
+}
+
+- (BOOL) _writeNewlineAndIndent: (NSUInteger) depth
+{
+	if ( [self _appendCString: "\n"] == NO )
+		return ( NO );
+	
+	NSUInteger i;
+	for ( i = 0; i < depth; i++ )
+	{
+		if ( [self _writeString: _indentString escapes: NULL] == NO )
+			return ( NO );
+	}
+	
+	return ( YES );
+}
+
+@end
@@ -0,0 +1,465 @@
+/*
+ *  GzipThroughput.m
+ *  GzipThroughput
+ *
+ *  Created by Jim Dovey on 11/8/2009.
+ *
+ *  Copyright (c) 2009 Jim Dovey
+ *  All rights reserved.
+ *  
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *  Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *  
+ *  Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *  
+ *  Neither the name of this project's author nor the names of its
+ *  contributors may be used to endorse or promote products derived from
+ *  this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF 
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// The harness only relies on the stream API the original Compression sources had; anything
+//  added since is looked up at runtime, so the same file can measure an older tree. Xcode's
+//  project lists the current sources, so to measure another revision build it by hand:
+//
+//    git worktree add /tmp/before <revision>
+//    clang -O2 -I/tmp/before -I/tmp/before/Compression -framework Foundation \
+//        -lz -o GzipThroughput-before GzipThroughput.m /tmp/before/Compression/*.m
+
+#if TARGET_OS_IPHONE
+# error This isn't designed for iPhone; it's a command-line app.
+#endif
+
+#import <Foundation/Foundation.h>
+#import <sysexits.h>
+#import <getopt.h>
+#import <zlib.h>
+#import "AQGzipStream.h"
+
+static void usage( void ) __dead2;
+
+static const char *     _shortCommandLineArgs = "s:l:t:k:b:zh";
+static struct option    _longCommandLineArgs[] = {
+    { "size", required_argument, NULL, 's' },
+    { "level", required_argument, NULL, 'l' },
+    { "threads", required_argument, NULL, 't' },
+    { "block-size", required_argument, NULL, 'k' },
+    { "buffer-size", required_argument, NULL, 'b' },
+    { "zero-copy", no_argument, NULL, 'z' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+// the size of each -write:maxLength: & -read:maxLength: call
+#define kTransferChunkSize      (64 * 1024)
+
+// stream methods which not every revision of the Compression sources has
+@protocol GzipStreamNewerAPI
+- (void) setCompressionThreadCount: (NSUInteger) value;
+- (void) setCompressionBlockSize: (NSUInteger) value;
+- (void) consumeBufferedBytes: (NSUInteger) length;
+@end
+
+@interface ThroughputReader : NSObject
+{
+    AQGzipInputStream * _stream;
+    uint8_t *           _buffer;
+    unsigned long long  _bytesRead;
+    CFAbsoluteTime      _lastReadTime;
+    BOOL                _zeroCopy;
+    BOOL                _finished;
+}
+- (id) initWithStream: (AQGzipInputStream *) stream zeroCopy: (BOOL) zeroCopy;
+- (unsigned long long) readToEnd;
+@property (nonatomic, readonly) CFAbsoluteTime lastReadTime;
+@end
+
+# pragma mark -
+
+static void usage( void )
+{
+    fprintf( stderr, "Compresses a block of generated, XML-like data in memory using\n"
+             "AQGzipOutputStream, then decompresses the result using AQGzipInputStream,\n"
+             "printing the throughput of each in megabytes of uncompressed data per second.\n"
+             "The data is generated before any timing starts, and the compressed data is\n"
+             "checked against it using zlib directly once the timing is done.\n\n" );
+    fprintf( stderr, "Usage: GzipThroughput [OPTIONS]\n" );
+    fprintf( stderr, "  Options:\n" );
+    fprintf( stderr, "    [-s|--size]=MB             Megabytes of data to push through (default 64).\n" );
+    fprintf( stderr, "    [-l|--level]=LEVEL         Compression level, 0-9 (default is zlib's, 6).\n" );
+    fprintf( stderr, "    [-t|--threads]=COUNT       Compression threads (default 1), where supported.\n" );
+    fprintf( stderr, "    [-k|--block-size]=KB       Parallel compression block size (default 128).\n" );
+    fprintf( stderr, "    [-b|--buffer-size]=KB      Input & output buffer size of both streams\n"
+                     "                               (default is the streams' own).\n" );
+    fprintf( stderr, "    [-z|--zero-copy]           Decompress using -getBuffer:length: and\n"
+                     "                               -consumeBufferedBytes: instead of -read:maxLength:,\n"
+                     "                               where supported.\n" );
+    fprintf( stderr, "    [-h|--help]                Display this message.\n" );
+    fflush( stderr );
+    exit( EX_USAGE );
+}
+
+static NSData * CreateTestData( NSUInteger length )
+{
+    NSMutableData * data = [[NSMutableData alloc] initWithCapacity: length + 128];
+    uint32_t seed = 1;
+    unsigned long index = 0;
+    
+    // repetitive markup around varying numbers compresses roughly like a real XML feed
+    while ( [data length] < length )
+    {
+        char record[128];
+        seed = (seed * 1103515245) + 12345;
+        int count = snprintf( record, sizeof(record), "<item id=\"%lu\"><value>%u</value></item>\n",
+                              index++, (seed >> 8) & 0xffff );
+        [data appendBytes: record length: count];
+    }
+    
+    [data setLength: length];
+    return ( data );
+}
+
+static double MBPerSecond( NSUInteger length, CFAbsoluteTime time )
+{
+    if ( time <= 0.0 )
+        return ( 0.0 );
+    return ( ((double) length / (1024.0 * 1024.0)) / time );
+}
+
+// inflates the whole of the compressed data with zlib, which insists on a complete gzip
+//  member: the final block & the CRC-32 and length trailer
+static BOOL VerifyCompressedData( NSData * compressed, NSData * input )
+{
+    z_stream stream;
+    memset( &stream, 0, sizeof(z_stream) );
+    if ( inflateInit2(&stream, MAX_WBITS + 16) != Z_OK )
+        return ( NO );
+    
+    uint8_t * buffer = malloc( kTransferChunkSize );
+    const uint8_t * expected = (const uint8_t *) [input bytes];
+    NSUInteger offset = 0;
+    BOOL matches = YES;
+    int err = Z_OK;
+    
+    stream.next_in = (Bytef *) [compressed bytes];
+    stream.avail_in = (uInt) [compressed length];
+    
+    while ( matches && (err == Z_OK) )
+    {
+        stream.next_out = buffer;
+        stream.avail_out = kTransferChunkSize;
+        err = inflate( &stream, Z_NO_FLUSH );
+        
+        NSUInteger produced = kTransferChunkSize - stream.avail_out;
+        if ( (offset + produced > [input length]) || (memcmp(buffer, expected + offset, produced) != 0) )
+            matches = NO;
+        offset += produced;
+    }
+    
+    inflateEnd( &stream );
+    free( buffer );
+    
+    BOOL valid = (matches && (err == Z_STREAM_END) && (offset == [input length]) && (stream.avail_in == 0));
+    if ( err != Z_STREAM_END )
+        fprintf( stdout, "  Compressed data is invalid or incomplete (zlib error %d)\n", err );
+    else if ( valid == NO )
+        fprintf( stdout, "  Compressed data doesn't match the input\n" );
+    else
+        fprintf( stdout, "  Verified with zlib\n" );
+    
+    return ( valid );
+}
+
+static NSData * RunCompressionTest( NSData * input, AQGzipCompressionLevel level, NSUInteger threads,
+                                    NSUInteger blockSize, NSInteger bufferSize )
+{
+    NSOutputStream * destination = [[NSOutputStream alloc] initToMemory];
+    AQGzipOutputStream * stream = [[AQGzipOutputStream alloc] initWithDestinationStream: destination];
+    
+    stream.compressionLevel = level;
+    if ( bufferSize != 0 )
+    {
+        stream.inputBufferSize = bufferSize;
+        stream.outputBufferSize = bufferSize;
+    }
+    
+    if ( [stream respondsToSelector: @selector(setCompressionThreadCount:)] )
+    {
+        [(id<GzipStreamNewerAPI>) stream setCompressionThreadCount: threads];
+        if ( blockSize != 0 )
+            [(id<GzipStreamNewerAPI>) stream setCompressionBlockSize: blockSize];
+    }
+    else if ( threads != 1 )
+    {
+        fprintf( stdout, "This revision can only compress on one thread\n" );
+        threads = 1;
+    }
+    
+    const uint8_t * bytes = (const uint8_t *) [input bytes];
+    NSUInteger length = [input length];
+    NSUInteger offset = 0;
+    
+    fprintf( stdout, "Compressing %.02fMB on %lu thread(s)...\n", (double) length / (1024.0 * 1024.0),
+             (unsigned long) threads );
+    
+    CFAbsoluteTime time = CFAbsoluteTimeGetCurrent();
+    [stream open];
+    
+    while ( offset < length )
+    {
+        NSInteger written = [stream write: bytes + offset maxLength: MIN(kTransferChunkSize, length - offset)];
+        if ( written <= 0 )
+            break;
+        offset += written;
+    }
+    
+    [stream close];
+    time = CFAbsoluteTimeGetCurrent() - time;
+    
+    NSData * result = nil;
+    if ( (offset < length) || ([stream streamStatus] == NSStreamStatusError) )
+    {
+        fprintf( stdout, "  Failed after %lu bytes: %s\n", (unsigned long) offset,
+                 [[[stream streamError] localizedDescription] UTF8String] );
+    }
+    else
+    {
+        result = [[destination propertyForKey: NSStreamDataWrittenToMemoryStreamKey] retain];
+        fprintf( stdout, "  %.02f seconds, %.02f MB/s, compressed to %.01f%%\n", time,
+                 MBPerSecond(length, time), ((double) [result length] * 100.0) / (double) length );
+    }
+    
+    [stream release];
+    [destination release];
+    
+    return ( result );
+}
+
+static BOOL RunDecompressionTest( NSData * compressed, NSUInteger expectedLength, NSInteger bufferSize,
+                                  BOOL zeroCopy )
+{
+    AQGzipInputStream * stream = [[AQGzipInputStream alloc] initWithCompressedData: compressed];
+    if ( bufferSize != 0 )
+    {
+        stream.inputBufferSize = bufferSize;
+        stream.outputBufferSize = bufferSize;
+    }
+    
+    if ( zeroCopy && ([stream respondsToSelector: @selector(consumeBufferedBytes:)] == NO) )
+    {
+        fprintf( stdout, "This revision can't decompress without copying\n" );
+        zeroCopy = NO;
+    }
+    
+    ThroughputReader * reader = [[ThroughputReader alloc] initWithStream: stream zeroCopy: zeroCopy];
+    
+    fprintf( stdout, "Decompressing%s...\n", (zeroCopy ? " without copying" : "") );
+    
+    // timed to the last byte read, so waiting for an end which never comes isn't counted
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    unsigned long long length = [reader readToEnd];
+    CFAbsoluteTime time = reader.lastReadTime - start;
+    
+    if ( length != expectedLength )
+    {
+        fprintf( stdout, "  Expected %lu bytes, got %llu: %s\n", (unsigned long) expectedLength, length,
+                 [[[stream streamError] localizedDescription] UTF8String] );
+    }
+    else
+    {
+        fprintf( stdout, "  %.02f seconds, %.02f MB/s\n", time, MBPerSecond(expectedLength, time) );
+    }
+    
+    [reader release];
+    [stream release];
+    
+    return ( length == expectedLength );
+}
+
+# pragma mark -
+
+@implementation ThroughputReader
+
+@synthesize lastReadTime=_lastReadTime;
+
+- (id) initWithStream: (AQGzipInputStream *) stream zeroCopy: (BOOL) zeroCopy
+{
+    if ( [super init] == nil )
+        return ( nil );
+    
+    _stream = [stream retain];
+    _zeroCopy = zeroCopy;
+    if ( _zeroCopy == NO )
+        _buffer = malloc( kTransferChunkSize );
+    
+    return ( self );
+}
+
+- (void) dealloc
+{
+    [_stream release];
+    free( _buffer );
+    [super dealloc];
+}
+
+- (unsigned long long) readToEnd
+{
+    // the input stream only starts decompressing once its source has told it there's data,
+    //  so it has to be run from a run loop
+    NSRunLoop * runLoop = [NSRunLoop currentRunLoop];
+    
+    [_stream setDelegate: self];
+    [_stream scheduleInRunLoop: runLoop forMode: NSDefaultRunLoopMode];
+    _lastReadTime = CFAbsoluteTimeGetCurrent();
+    [_stream open];
+    
+    while ( _finished == NO )
+    {
+        unsigned long long before = _bytesRead;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        
+        NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+        BOOL ran = [runLoop runMode: NSDefaultRunLoopMode beforeDate: [NSDate dateWithTimeIntervalSinceNow: 1.0]];
+        [pool drain];
+        
+        // give up if the stream stalls (a whole second with nothing read), rather than waiting forever
+        BOOL stalled = ((_bytesRead == before) && (CFAbsoluteTimeGetCurrent() - start >= 1.0));
+        if ( (ran == NO) || stalled || ([_stream streamStatus] >= NSStreamStatusAtEnd) )
+            break;
+    }
+    
+    [_stream close];
+    [_stream removeFromRunLoop: runLoop forMode: NSDefaultRunLoopMode];
+    [_stream setDelegate: nil];
+    
+    return ( _bytesRead );
+}
+
+- (void) stream: (NSStream *) stream handleEvent: (NSStreamEvent) event
+{
+    switch ( event )
+    {
+        case NSStreamEventHasBytesAvailable:
+        {
+            if ( _zeroCopy )
+            {
+                uint8_t * bytes = NULL;
+                NSUInteger length = 0;
+                while ( [_stream getBuffer: &bytes length: &length] )
+                {
+                    _bytesRead += length;
+                    [(id<GzipStreamNewerAPI>) _stream consumeBufferedBytes: length];
+                }
+            }
+            else
+            {
+                NSInteger length = 0;
+                while ( (length = [_stream read: _buffer maxLength: kTransferChunkSize]) > 0 )
+                    _bytesRead += length;
+            }
+            
+            _lastReadTime = CFAbsoluteTimeGetCurrent();
+            break;
+        }
+            
+        case NSStreamEventEndEncountered:
+        case NSStreamEventErrorOccurred:
+            _finished = YES;
+            break;
+            
+        default:
+            break;
+    }
+}
+
+@end
+
+# pragma mark -
+
+int main (int argc, char * const argv[])
+{
+    NSUInteger sizeMB = 64;
+    AQGzipCompressionLevel level = AQGzipCompressionLevelDefault;
+    NSUInteger threads = 1;
+    NSUInteger blockSizeKB = 0;
+    NSInteger bufferSizeKB = 0;
+    BOOL zeroCopy = NO;
+    int ch = -1;
+    
+    while ( (ch = getopt_long(argc, argv, _shortCommandLineArgs, _longCommandLineArgs, NULL)) != -1 )
+    {
+        switch ( ch )
+        {
+            case 'h':
+            default:
+                usage();        // dead call, terminates program
+                break;
+                
+            case 's':
+                sizeMB = (NSUInteger) strtoul( optarg, NULL, 10 );
+                break;
+                
+            case 'l':
+                level = (AQGzipCompressionLevel) strtol( optarg, NULL, 10 );
+                break;
+                
+            case 't':
+                threads = (NSUInteger) strtoul( optarg, NULL, 10 );
+                break;
+                
+            case 'k':
+                blockSizeKB = (NSUInteger) strtoul( optarg, NULL, 10 );
+                break;
+                
+            case 'b':
+                bufferSizeKB = (NSInteger) strtol( optarg, NULL, 10 );
+                break;
+                
+            case 'z':
+                zeroCopy = YES;
+                break;
+        }
+    }
+    
+    if ( (sizeMB == 0) || (threads == 0) || (bufferSizeKB < 0) ||
+         (level < AQGzipCompressionLevelDefault) || (level > AQGzipCompressionLevelBest) )
+        usage();        // dead call, terminates program
+    
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    
+    NSData * input = CreateTestData( sizeMB * 1024 * 1024 );
+    NSData * compressed = RunCompressionTest( input, level, threads, blockSizeKB * 1024, bufferSizeKB * 1024 );
+    
+    int result = EX_SOFTWARE;
+    if ( compressed != nil )
+    {
+        // the throughput is still reported for output which turns out to be broken
+        BOOL valid = VerifyCompressedData( compressed, input );
+        if ( RunDecompressionTest(compressed, [input length], bufferSizeKB * 1024, zeroCopy) && valid )
+            result = 0;
+    }
+    
+    [compressed release];
+    [input release];
+    [pool drain];
+    
+    return ( result );
+}